@@ -0,0 +1,45 @@
+#include "args.h"
+#include "file.h"
+#include "vm.h"
+
+#include <iostream>
+
+using namespace Backend;
+using namespace Frontend;
+
+// Generated by synaot.
+extern NativeProgram const translated_program;
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        Arguments args(argc, argv);
+        args.engine = VirtualMachine::Engine::Native;
+        args.native_program = &translated_program;
+
+        switch (args.type)
+        {
+            case Arguments::InputType::File:
+                interpret_file(args.arg, args);
+                break;
+            case Arguments::InputType::Snapshot:
+                interpret_snapshot(args.arg, args);
+                break;
+            case Arguments::InputType::Batch:
+                interpret_batch(args.arg, args);
+                break;
+            default:
+                std::cout << "Specify -f or -r, optionally followed by any of fe's options except -e, "
+                    "or -b with fe's batch options" << std::endl;
+        }
+    }
+    catch (std::exception const& ex)
+    {
+        std::cerr << "Error during VM execution: " << ex.what() << std::endl;
+    }
+
+    std::cout << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,337 @@
+#include "disasm.h"
+#include "image.h"
+#include "io.h"
+#include "vm.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace Backend;
+using std::uint16_t;
+
+namespace
+{
+    const uint16_t FirstRegister = 32768;
+
+    // The program decrypts most of its code at run time, so it is run up to
+    // its first prompt, or through an input script, and translated from
+    // memory as it is then. Every address that ran is known to be code.
+    std::unique_ptr<VirtualMachine> run_program(std::string const& program, std::string const& script,
+            std::vector<bool>& executed)
+    {
+        auto io = std::make_shared<StringIO>();
+        if (!script.empty())
+        {
+            std::ifstream in(script, std::ifstream::binary);
+            if (!in)
+            {
+                throw std::runtime_error("Could not open " + script);
+            }
+            std::ostringstream contents;
+            contents << in.rdbuf();
+            io->feed(contents.str());
+            io->end_input();
+        }
+
+        std::unique_ptr<VirtualMachine> vm(new VirtualMachine(ProgramImage(program), io));
+        vm->set_profiling(true);
+        try
+        {
+            vm->run();
+        }
+        catch (std::exception const& ex)
+        {
+            std::cerr << "The program stopped with: " << ex.what() << std::endl;
+        }
+
+        executed.assign(0x8000, false);
+        for (std::size_t address = 0; address < executed.size(); ++address)
+        {
+            executed[address] = vm->profile().address_count(uint16_t(address)) > 0;
+        }
+
+        return vm;
+    }
+
+    // Adds entry points until every address that ran is covered, one at a
+    // time so that blocks are only split where they have to be.
+    Disassembler find_code(VirtualMachine const& vm, std::vector<bool> const& executed)
+    {
+        std::vector<uint16_t> entries;
+        std::vector<bool> tried(executed.size());
+        for (;;)
+        {
+            auto disassembler = vm.disassembler(entries);
+
+            auto uncovered = executed.size();
+            for (std::size_t address = 0; address < executed.size(); ++address)
+            {
+                // Code that has changed since it ran may not decode now.
+                if (executed[address] && !tried[address] && !disassembler.is_code(uint16_t(address)))
+                {
+                    uncovered = address;
+                    break;
+                }
+            }
+
+            if (uncovered == executed.size())
+            {
+                return disassembler;
+            }
+            tried[uncovered] = true;
+            entries.push_back(uint16_t(uncovered));
+        }
+    }
+
+    std::string value(uint16_t arg)
+    {
+        char text[16];
+        if (arg >= FirstRegister)
+        {
+            std::snprintf(text, sizeof(text), "r[%u]", unsigned(arg - FirstRegister));
+        }
+        else
+        {
+            std::snprintf(text, sizeof(text), "0x%04x", unsigned(arg));
+        }
+        return text;
+    }
+
+    std::string hex(unsigned number)
+    {
+        char text[16];
+        std::snprintf(text, sizeof(text), "0x%04x", number);
+        return text;
+    }
+
+    // Writes the block as one function. Each instruction that may have to
+    // go back to the interpreter first adds the instructions run so far.
+    void translate_block(std::ostream& out, Disassembler const& disassembler, Disassembler::Block const& block)
+    {
+        out << "static std::uint32_t block_" << hex(block.start) << "(NativeRuntime& rt)\n{\n";
+        out << "    auto r = rt.registers;\n";
+        out << "    (void)r;\n";
+
+        unsigned count = 0;
+        auto interpret = [&](uint16_t address)
+        {
+            std::ostringstream text;
+            text << "{ rt.instructions += " << count << "; return NativeRuntime::Interpret | " << hex(address) << "; }";
+            return text.str();
+        };
+        auto leave = [&](std::string const& to)
+        {
+            std::ostringstream text;
+            text << "{ rt.instructions += " << count + 1 << "; return " << to << "; }";
+            return text.str();
+        };
+
+        auto ended = false;
+        for (auto pc = block.start; pc < block.end && !ended; )
+        {
+            auto const& inst = disassembler.instruction(pc);
+            auto const& a = inst.args;
+            auto next = uint16_t(pc + inst.length);
+
+            switch (inst.opcode)
+            {
+                case 0:  // HALT
+                case 20: // IN
+                    out << "    " << interpret(pc) << "\n";
+                    ended = true;
+                    break;
+                case 1:
+                    out << "    " << value(a[0]) << " = " << value(a[1]) << ";\n";
+                    break;
+                case 2:
+                    out << "    if (!rt.push(" << value(a[0]) << ")) " << interpret(pc) << "\n";
+                    break;
+                case 3:
+                    out << "    if (!rt.pop(" << value(a[0]) << ")) " << interpret(pc) << "\n";
+                    break;
+                case 4:
+                    out << "    " << value(a[0]) << " = " << value(a[1]) << " == " << value(a[2]) << ";\n";
+                    break;
+                case 5:
+                    out << "    " << value(a[0]) << " = " << value(a[1]) << " > " << value(a[2]) << ";\n";
+                    break;
+                case 6:
+                    out << "    " << leave(value(a[0])) << "\n";
+                    ended = true;
+                    break;
+                case 7:
+                    out << "    if (" << value(a[0]) << " != 0) " << leave(value(a[1])) << "\n";
+                    break;
+                case 8:
+                    out << "    if (" << value(a[0]) << " == 0) " << leave(value(a[1])) << "\n";
+                    break;
+                case 9:
+                    out << "    " << value(a[0]) << " = (" << value(a[1]) << " + " << value(a[2]) << ") % 32768;\n";
+                    break;
+                case 10:
+                    out << "    " << value(a[0]) << " = std::uint32_t(" << value(a[1]) << ") * " << value(a[2]) << " % 32768;\n";
+                    break;
+                case 11:
+                    // The interpreter fails on a zero divisor.
+                    out << "    if (" << value(a[2]) << " == 0) " << interpret(pc) << "\n";
+                    out << "    " << value(a[0]) << " = " << value(a[1]) << " % " << value(a[2]) << ";\n";
+                    break;
+                case 12:
+                    out << "    " << value(a[0]) << " = " << value(a[1]) << " & " << value(a[2]) << ";\n";
+                    break;
+                case 13:
+                    out << "    " << value(a[0]) << " = " << value(a[1]) << " | " << value(a[2]) << ";\n";
+                    break;
+                case 14:
+                    out << "    " << value(a[0]) << " = 0x7fff & ~" << value(a[1]) << ";\n";
+                    break;
+                case 15:
+                    if (a[1] >= FirstRegister)
+                    {
+                        out << "    if (" << value(a[1]) << " > 32767) " << interpret(pc) << "\n";
+                    }
+                    out << "    " << value(a[0]) << " = rt.memory[" << value(a[1]) << "];\n";
+                    break;
+                case 16:
+                    // The write may change this very block, so it ends here.
+                    if (a[0] >= FirstRegister)
+                    {
+                        out << "    if (" << value(a[0]) << " > 32767) " << interpret(pc) << "\n";
+                    }
+                    out << "    rt.write(" << value(a[0]) << ", " << value(a[1]) << ");\n";
+                    out << "    " << leave(hex(next)) << "\n";
+                    ended = true;
+                    break;
+                case 17:
+                    out << "    if (!rt.calls_allowed || !rt.push(" << hex(next) << ")) " << interpret(pc) << "\n";
+                    out << "    " << leave(value(a[0])) << "\n";
+                    ended = true;
+                    break;
+                case 18:
+                    out << "    std::uint16_t to;\n";
+                    out << "    if (!rt.pop(to)) " << interpret(pc) << "\n";
+                    out << "    " << leave("to") << "\n";
+                    ended = true;
+                    break;
+                case 19:
+                    out << "    rt.out(" << value(a[0]) << ");\n";
+                    break;
+                default:
+                    break;
+            }
+
+            ++count;
+            pc = next;
+            if (!ended && pc >= block.end)
+            {
+                out << "    rt.instructions += " << count << ";\n";
+                out << "    return " << hex(pc) << ";\n";
+            }
+        }
+
+        out << "}\n\n";
+    }
+
+    void translate(std::ostream& out, VirtualMachine const& vm, Disassembler const& disassembler,
+            std::string const& program)
+    {
+        out << "// Translated from " << program << " by synaot. Do not edit.\n\n";
+        out << "#include \"native.h\"\n\n";
+        out << "using Backend::NativeRuntime;\n\n";
+        out << "namespace\n{\n";
+
+        out << "const std::uint16_t words[0x8000] = {";
+        for (std::size_t address = 0; address < 0x8000; ++address)
+        {
+            out << (address % 12 == 0 ? "\n    " : " ") << vm.memory_value(uint16_t(address)) << ",";
+        }
+        out << "\n};\n\n";
+
+        // Translated blocks also end after a CALL or WMEM, since the guest
+        // carries on from the next instruction. Blocks that overlap an
+        // earlier one are left to the interpreter.
+        std::vector<Disassembler::Block> blocks;
+        for (auto const& entry : disassembler.blocks())
+        {
+            auto const& block = entry.second;
+            if (!blocks.empty() && block.start < blocks.back().end)
+            {
+                continue;
+            }
+
+            Disassembler::Block part;
+            part.start = block.start;
+            for (auto pc = block.start; pc < block.end; )
+            {
+                auto const& inst = disassembler.instruction(pc);
+                pc = uint16_t(pc + inst.length);
+                if (inst.opcode == 16 || inst.opcode == 17 || pc >= block.end)
+                {
+                    part.end = pc;
+                    blocks.push_back(part);
+                    part.start = pc;
+                }
+            }
+        }
+
+        for (auto const& block : blocks)
+        {
+            translate_block(out, disassembler, block);
+        }
+
+        out << "const Backend::NativeBlockEntry blocks[] = {\n";
+        for (auto const& block : blocks)
+        {
+            out << "    { " << hex(block.start) << ", " << hex(block.end) << ", block_" << hex(block.start) << " },\n";
+        }
+        out << "};\n";
+        out << "}\n\n";
+
+        out << "extern Backend::NativeProgram const translated_program = {\n";
+        out << "    words, blocks, sizeof(blocks) / sizeof(blocks[0])\n";
+        out << "};\n";
+
+        std::cerr << "Translated " << blocks.size() << " blocks from " << program << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cout << "Specify a program, the C++ file to write and, optionally, an input script to run "
+            "before translating" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        std::string program = argv[1];
+        std::vector<bool> executed;
+        auto vm = run_program(program, argc > 3 ? argv[3] : "", executed);
+        auto disassembler = find_code(*vm, executed);
+
+        std::ostringstream text;
+        translate(text, *vm, disassembler, program);
+
+        std::ofstream out(argv[2], std::ofstream::binary);
+        out << text.str();
+        if (!out)
+        {
+            throw std::runtime_error(std::string("Could not write ") + argv[2]);
+        }
+    }
+    catch (std::exception const& ex)
+    {
+        std::cerr << "Error: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,498 @@
+#include "disasm.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+
+using namespace Backend;
+using std::uint16_t;
+
+namespace
+{
+    struct Opcode
+    {
+        char const* name;
+        int operands;
+        // Whether the first operand is the register the result goes to.
+        bool writes_register;
+    };
+
+    const Opcode Opcodes[] = {
+        { "HALT", 0, false }, { "SET",  2, true  }, { "PUSH", 1, false }, { "POP",  1, true  },
+        { "EQ",   3, true  }, { "GT",   3, true  }, { "JMP",  1, false }, { "JT",   2, false },
+        { "JF",   2, false }, { "ADD",  3, true  }, { "MULT", 3, true  }, { "MOD",  3, true  },
+        { "AND",  3, true  }, { "OR",   3, true  }, { "NOT",  2, true  }, { "RMEM", 2, true  },
+        { "WMEM", 2, false }, { "CALL", 1, false }, { "RET",  0, false }, { "OUT",  1, false },
+        { "IN",   1, true  }, { "NOOP", 0, false }
+    };
+
+    const std::size_t OpcodeCount = sizeof(Opcodes) / sizeof(Opcodes[0]);
+    const uint16_t FirstRegister = 32768;
+    const uint16_t MaxValue = 32775;
+    const std::size_t DataRow = 8;
+
+    bool is_register(uint16_t value)
+    {
+        return value >= FirstRegister;
+    }
+
+    bool ends_block(std::uint8_t opcode)
+    {
+        return opcode == 0 || opcode == 6 || opcode == 7 || opcode == 8 || opcode == 18;
+    }
+
+    // Appends printf-style formatted text.
+    void append(std::string& text, char const* format, ...)
+    {
+        char buffer[256];
+        va_list args;
+        va_start(args, format);
+        auto length = std::vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        text.append(buffer, std::min<std::size_t>(std::size_t(std::max(length, 0)), sizeof(buffer) - 1));
+    }
+
+    void append_escaped(std::string& text, uint16_t c)
+    {
+        switch (c)
+        {
+            case '\n': text += "\\n"; break;
+            case '"':  text += "\\\""; break;
+            case '\\': text += "\\\\"; break;
+            default:
+                if (c >= 32 && c < 127)
+                {
+                    text += char(c);
+                }
+                else
+                {
+                    append(text, "\\x%02x", c);
+                }
+        }
+    }
+
+    void append_addresses(std::string& text, std::set<uint16_t> const& addresses)
+    {
+        auto first = true;
+        for (auto address : addresses)
+        {
+            append(text, first ? "0x%04x" : ", 0x%04x", address);
+            first = false;
+        }
+    }
+}
+
+Disassembler::Disassembler(uint16_t const* memory, std::size_t size, std::vector<uint16_t> const& entries) :
+    memory(memory, memory + size),
+    code(size),
+    starts(size),
+    targets(size, -1),
+    operands(size),
+    leaders(size)
+{
+    trace(entries);
+    build_blocks();
+    build_call_graph();
+}
+
+bool Disassembler::is_code(uint16_t address) const
+{
+    return address < memory.size() && (starts[address] || operands[address]);
+}
+
+Disassembler::Instruction const& Disassembler::instruction(uint16_t address) const
+{
+    return code.at(address);
+}
+
+std::map<uint16_t, Disassembler::Block> const& Disassembler::blocks() const
+{
+    return block_map;
+}
+
+std::map<uint16_t, std::set<uint16_t>> const& Disassembler::call_graph() const
+{
+    return callees;
+}
+
+bool Disassembler::decode(uint16_t address, Instruction& inst) const
+{
+    if (address >= memory.size() || memory[address] >= OpcodeCount)
+    {
+        return false;
+    }
+
+    auto const& opcode = Opcodes[memory[address]];
+    if (std::size_t(address) + opcode.operands >= memory.size())
+    {
+        return false;
+    }
+
+    inst.opcode = std::uint8_t(memory[address]);
+    inst.length = std::uint8_t(1 + opcode.operands);
+    inst.args.fill(0);
+    for (auto i = 0; i < opcode.operands; ++i)
+    {
+        auto arg = memory[address + 1 + i];
+        if (arg > MaxValue || (i == 0 && opcode.writes_register && !is_register(arg)))
+        {
+            return false;
+        }
+        inst.args[i] = arg;
+    }
+
+    return true;
+}
+
+void Disassembler::trace(std::vector<uint16_t> const& entries)
+{
+    std::vector<uint16_t> pending;
+    for (auto entry : entries)
+    {
+        if (entry < memory.size())
+        {
+            pending.push_back(entry);
+            leaders[entry] = true;
+            routine_entries.insert(entry);
+        }
+    }
+
+    // Each path runs until it leaves for somewhere already traced, or
+    // for somewhere it cannot follow.
+    while (!pending.empty())
+    {
+        std::size_t address = pending.back();
+        pending.pop_back();
+
+        // Registers set to a constant earlier on this path, so that a SET
+        // followed by a jump or call through the register can be followed.
+        std::array<std::int32_t, 8> constants;
+        constants.fill(-1);
+        auto resolve = [&constants](uint16_t value)
+        {
+            return is_register(value) ? constants[value - FirstRegister] : std::int32_t(value);
+        };
+
+        Instruction inst;
+        while (address < memory.size() && !starts[address] && decode(uint16_t(address), inst))
+        {
+            code[address] = inst;
+            starts[address] = true;
+            for (auto i = 1; i < inst.length; ++i)
+            {
+                operands[address + i] = true;
+            }
+
+            auto next = address + inst.length;
+            if (inst.opcode == 6 || inst.opcode == 7 || inst.opcode == 8)
+            {
+                auto target = resolve(inst.opcode == 6 ? inst.args[0] : inst.args[1]);
+                if (target >= 0 && std::size_t(target) < memory.size())
+                {
+                    targets[address] = target;
+                    leaders[target] = true;
+                    pending.push_back(uint16_t(target));
+                }
+                if (next < memory.size())
+                {
+                    leaders[next] = true;
+                }
+            }
+            else if (inst.opcode == 17)
+            {
+                auto target = resolve(inst.args[0]);
+                if (target >= 0 && std::size_t(target) < memory.size())
+                {
+                    targets[address] = target;
+                    leaders[target] = true;
+                    routine_entries.insert(uint16_t(target));
+                    pending.push_back(uint16_t(target));
+                }
+
+                // The callee may change any register.
+                constants.fill(-1);
+            }
+            else if (Opcodes[inst.opcode].writes_register)
+            {
+                auto& written = constants[inst.args[0] - FirstRegister];
+                written = inst.opcode == 1 ? resolve(inst.args[1]) : -1;
+            }
+
+            if (inst.opcode == 0 || inst.opcode == 6 || inst.opcode == 18)
+            {
+                break;
+            }
+            address = next;
+        }
+    }
+}
+
+void Disassembler::build_blocks()
+{
+    Block* current = nullptr;
+    for (std::size_t address = 0; address < memory.size(); ++address)
+    {
+        if (!starts[address])
+        {
+            continue;
+        }
+
+        if (current == nullptr || current->end != address || leaders[address])
+        {
+            Block block;
+            block.start = uint16_t(address);
+            block.end = uint16_t(address);
+            current = &(block_map[block.start] = block);
+        }
+
+        auto const& inst = code[address];
+        auto next = address + inst.length;
+        current->end = uint16_t(next);
+
+        if (ends_block(inst.opcode) || next >= memory.size() || leaders[next] || !starts[next])
+        {
+            if (targets[address] >= 0 && inst.opcode != 17)
+            {
+                current->successors.push_back(uint16_t(targets[address]));
+            }
+            if (inst.opcode != 0 && inst.opcode != 6 && inst.opcode != 18 && next < memory.size() && starts[next])
+            {
+                current->successors.push_back(uint16_t(next));
+            }
+            current = nullptr;
+        }
+    }
+}
+
+void Disassembler::build_call_graph()
+{
+    for (auto entry : routine_entries)
+    {
+        auto& calls = callees[entry];
+        if (block_map.count(entry) == 0)
+        {
+            continue;
+        }
+
+        // Every block the routine reaches without a call is part of it.
+        std::set<uint16_t> seen;
+        std::vector<uint16_t> pending(1, entry);
+        while (!pending.empty())
+        {
+            auto start = pending.back();
+            pending.pop_back();
+            if (!seen.insert(start).second)
+            {
+                continue;
+            }
+
+            auto const& block = block_map.at(start);
+            for (std::size_t address = block.start; address < block.end; address += code[address].length)
+            {
+                auto const& inst = code[address];
+                if (inst.opcode != 17)
+                {
+                    continue;
+                }
+
+                auto target = targets[address];
+                if (target < 0)
+                {
+                    indirect_callers.insert(entry);
+                }
+                else
+                {
+                    calls.insert(uint16_t(target));
+                    callers[uint16_t(target)].insert(entry);
+                }
+            }
+
+            for (auto successor : block.successors)
+            {
+                if (block_map.count(successor) > 0)
+                {
+                    pending.push_back(successor);
+                }
+            }
+        }
+    }
+}
+
+void Disassembler::format_instruction(uint16_t address, std::string& line) const
+{
+    auto const& inst = code[address];
+    auto const& opcode = Opcodes[inst.opcode];
+    append(line, "0x%04x  %-4s", unsigned(address), opcode.name);
+
+    for (auto i = 0; i < opcode.operands; ++i)
+    {
+        auto arg = inst.args[i];
+        line += i == 0 ? "  " : ", ";
+        if (is_register(arg))
+        {
+            append(line, "r%u", unsigned(arg - FirstRegister));
+        }
+        else if (inst.opcode == 19)
+        {
+            line += '\'';
+            append_escaped(line, arg);
+            line += '\'';
+        }
+        else
+        {
+            append(line, "0x%04x", unsigned(arg));
+        }
+    }
+}
+
+std::string Disassembler::out_string(uint16_t address, uint16_t end, uint16_t& run_end) const
+{
+    std::string text;
+    run_end = address;
+    while (run_end < end && code[run_end].opcode == 19 && !is_register(code[run_end].args[0]))
+    {
+        append_escaped(text, code[run_end].args[0]);
+        run_end = uint16_t(run_end + code[run_end].length);
+    }
+    return text;
+}
+
+void Disassembler::write_listing(std::ostream& out) const
+{
+    std::size_t instructions = std::count(starts.begin(), starts.end(), true);
+    std::size_t code_words = instructions + std::count(operands.begin(), operands.end(), true);
+
+    // Everything goes to out in one write.
+    std::string text;
+    text.reserve(memory.size() * 32);
+
+    append(text, "; %zu instructions in %zu blocks and %zu routines, %zu words of data\n",
+            instructions, block_map.size(), callees.size(), memory.size() - code_words);
+
+    std::size_t address = 0;
+    while (address < memory.size())
+    {
+        auto block = block_map.find(uint16_t(address));
+        if (block != block_map.end())
+        {
+            auto const& b = block->second;
+            if (callees.count(b.start) > 0)
+            {
+                append(text, "\n; Routine 0x%04x", unsigned(b.start));
+                auto found = callers.find(b.start);
+                if (found != callers.end())
+                {
+                    text += ", called by ";
+                    append_addresses(text, found->second);
+                }
+                text += '\n';
+            }
+
+            append(text, "\n0x%04x:", unsigned(b.start));
+            if (!b.successors.empty())
+            {
+                text += "  ; -> ";
+                append_addresses(text, std::set<uint16_t>(b.successors.begin(), b.successors.end()));
+            }
+            text += '\n';
+
+            for (auto pc = b.start; pc < b.end; )
+            {
+                // A run of OUTs is written as the one string it prints.
+                uint16_t run_end;
+                auto string = out_string(pc, b.end, run_end);
+                if (run_end > pc + code[pc].length)
+                {
+                    append(text, "    0x%04x  OUT   \"", unsigned(pc));
+                    text += string + "\"\n";
+                    pc = run_end;
+                    continue;
+                }
+
+                text += "    ";
+                format_instruction(pc, text);
+                text += '\n';
+                pc = uint16_t(pc + code[pc].length);
+            }
+
+            address = b.end;
+            continue;
+        }
+
+        if (is_code(uint16_t(address)))
+        {
+            // An operand that another path also decoded from.
+            ++address;
+            continue;
+        }
+
+        // A row of data stops at the next code.
+        auto row_end = address;
+        while (row_end < memory.size() && row_end - address < DataRow && !is_code(uint16_t(row_end)))
+        {
+            ++row_end;
+        }
+
+        std::string ascii;
+        append(text, "0x%04x  .data", unsigned(address));
+        for (auto a = address; a < row_end; ++a)
+        {
+            append(text, " 0x%04x", unsigned(memory[a]));
+            ascii += memory[a] >= 32 && memory[a] < 127 ? char(memory[a]) : '.';
+        }
+        text.append((DataRow - (row_end - address)) * 7, ' ');
+        text += "  |" + ascii + "|\n";
+
+        address = row_end;
+    }
+
+    out.write(text.data(), std::streamsize(text.size()));
+    out.flush();
+}
+
+void Disassembler::write_call_graph(std::ostream& out) const
+{
+    std::string text;
+    for (auto const& routine : callees)
+    {
+        append(text, "0x%04x", unsigned(routine.first));
+        if (!routine.second.empty())
+        {
+            text += " calls ";
+            append_addresses(text, routine.second);
+        }
+        if (indirect_callers.count(routine.first) > 0)
+        {
+            text += routine.second.empty() ? " calls" : ",";
+            text += " through registers";
+        }
+
+        auto found = callers.find(routine.first);
+        if (found != callers.end())
+        {
+            text += "; called by ";
+            append_addresses(text, found->second);
+        }
+        text += '\n';
+    }
+
+    out.write(text.data(), std::streamsize(text.size()));
+    out.flush();
+}
+
+void Disassembler::write_call_graph_dot(std::ostream& out) const
+{
+    std::string text = "digraph calls {\n    node [shape=box, fontname=monospace];\n";
+    for (auto const& routine : callees)
+    {
+        append(text, "    \"0x%04x\";\n", unsigned(routine.first));
+        for (auto callee : routine.second)
+        {
+            append(text, "    \"0x%04x\" -> \"0x%04x\";\n", unsigned(routine.first), unsigned(callee));
+        }
+    }
+    text += "}\n";
+
+    out.write(text.data(), std::streamsize(text.size()));
+    out.flush();
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace Backend
+{
+    // Separates code from data by following control flow from a set of
+    // entry points, and splits the code into basic blocks and routines.
+    // Any word that no path reaches as an instruction is data. Jumps and
+    // calls through a register are only followed if the same path set the
+    // register to a constant, so code that is only reached some other way
+    // shows up as data unless it is given as an entry.
+    class Disassembler
+    {
+    public:
+        struct Instruction
+        {
+            std::uint8_t opcode;
+            std::uint8_t length;
+            // Operands as they are in memory.
+            std::array<std::uint16_t, 3> args;
+        };
+
+        struct Block
+        {
+            std::uint16_t start;
+            // The address after the last instruction.
+            std::uint16_t end;
+            // Blocks control can go to next, not counting calls.
+            std::vector<std::uint16_t> successors;
+        };
+
+        Disassembler(std::uint16_t const* memory, std::size_t size,
+                std::vector<std::uint16_t> const& entries = std::vector<std::uint16_t>(1, 0));
+
+        bool is_code(std::uint16_t address) const;
+
+        // The instruction that starts at address. Only valid for the
+        // addresses of a block's instructions.
+        Instruction const& instruction(std::uint16_t address) const;
+
+        // Blocks by start address.
+        std::map<std::uint16_t, Block> const& blocks() const;
+
+        // Routines by entry point, each with the routines it calls. The
+        // entry points given to the constructor count as routines.
+        std::map<std::uint16_t, std::set<std::uint16_t>> const& call_graph() const;
+
+        // Writes code block by block and data in rows, with runs of OUT
+        // written out as strings.
+        void write_listing(std::ostream& out) const;
+
+        // Writes every routine with its callees and callers.
+        void write_call_graph(std::ostream& out) const;
+
+        // Writes the call graph in Graphviz DOT format.
+        void write_call_graph_dot(std::ostream& out) const;
+
+    private:
+        // Decodes the instruction at address, returning false if it is not
+        // a valid one.
+        bool decode(std::uint16_t address, Instruction& inst) const;
+        void trace(std::vector<std::uint16_t> const& entries);
+        void build_blocks();
+        void build_call_graph();
+
+        // Appends an instruction's operands as text.
+        void format_instruction(std::uint16_t address, std::string& line) const;
+        // Returns the text printed by the run of OUTs starting at address,
+        // and where the run ends.
+        std::string out_string(std::uint16_t address, std::uint16_t end, std::uint16_t& run_end) const;
+
+        std::vector<std::uint16_t> memory;
+        // The instruction starting at each address, if it is code.
+        std::vector<Instruction> code;
+        std::vector<bool> starts;
+        // Where the jump or call at each address goes, or -1 if that is
+        // not known.
+        std::vector<std::int32_t> targets;
+        // Words that are operands of an instruction.
+        std::vector<bool> operands;
+        std::vector<bool> leaders;
+        std::set<std::uint16_t> routine_entries;
+
+        std::map<std::uint16_t, Block> block_map;
+        std::map<std::uint16_t, std::set<std::uint16_t>> callees;
+        std::map<std::uint16_t, std::set<std::uint16_t>> callers;
+        // Routines that call through a register.
+        std::set<std::uint16_t> indirect_callers;
+    };
+}
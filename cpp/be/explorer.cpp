@@ -0,0 +1,402 @@
+#include "explorer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <sstream>
+#include <thread>
+
+using namespace Backend;
+using std::uint16_t;
+using std::uint64_t;
+
+namespace
+{
+    // How many commands run between merges. Every result holds a whole
+    // copy of guest memory until it is merged.
+    const std::size_t JobsPerMerge = 256;
+
+    const std::string Halted = "(halted)";
+
+    // FNV-1a over everything a state holds.
+    class StateHash
+    {
+    public:
+        StateHash() :
+            value(14695981039346656037ull)
+        {
+        }
+
+        void add(uint16_t word)
+        {
+            value = (value ^ (word & 0xff)) * 1099511628211ull;
+            value = (value ^ (word >> 8)) * 1099511628211ull;
+        }
+
+        template <typename Words>
+        void add_all(Words const& words)
+        {
+            for (auto word : words)
+            {
+                add(word);
+            }
+        }
+
+        uint64_t get() const
+        {
+            return value;
+        }
+
+    private:
+        uint64_t value;
+    };
+
+    uint64_t hash_of(VirtualMachine::State const& state)
+    {
+        StateHash hash;
+        hash.add_all(state.memory);
+        hash.add_all(state.registers);
+        hash.add(uint16_t(state.stack.size()));
+        hash.add_all(state.stack);
+        hash.add(state.program_counter);
+        hash.add(state.running ? 1 : 0);
+        return hash.get();
+    }
+
+    // The "- item" lines that follow the line starting with heading.
+    std::vector<std::string> list_after(std::string const& output, std::string const& heading)
+    {
+        std::vector<std::string> items;
+        std::istringstream lines(output);
+        std::string line;
+        auto listing = false;
+        while (std::getline(lines, line))
+        {
+            if (line.compare(0, heading.size(), heading) == 0)
+            {
+                listing = true;
+            }
+            else if (listing && line.compare(0, 2, "- ") == 0)
+            {
+                items.push_back(line.substr(2));
+            }
+            else
+            {
+                listing = false;
+            }
+        }
+        return items;
+    }
+
+    std::string quoted(std::string const& text)
+    {
+        std::string result = "\"";
+        for (auto c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                result += '\\';
+            }
+            result += c;
+        }
+        return result + "\"";
+    }
+}
+
+std::vector<std::string> Backend::adventure_commands(std::string const& output)
+{
+    std::vector<std::string> commands;
+    auto add = [&](std::string const& command)
+    {
+        if (std::find(commands.begin(), commands.end(), command) == commands.end())
+        {
+            commands.push_back(command);
+        }
+    };
+
+    for (auto const& exit : list_after(output, "There is 1 exit"))
+    {
+        add(exit);
+    }
+    for (auto const& exit : list_after(output, "There are "))
+    {
+        add(exit);
+    }
+    for (auto const& thing : list_after(output, "Things of interest here"))
+    {
+        add("take " + thing);
+    }
+    for (auto const& item : list_after(output, "Your inventory"))
+    {
+        add("use " + item);
+    }
+    return commands;
+}
+
+std::string Backend::adventure_place(std::string const& output)
+{
+    std::istringstream lines(output);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        if (line.size() > 6 && line.compare(0, 3, "== ") == 0 && line.compare(line.size() - 3, 3, " ==") == 0)
+        {
+            return line.substr(3, line.size() - 6);
+        }
+    }
+    return std::string();
+}
+
+Explorer::Options::Options() :
+    probe("look\ninv\n"),
+    commands(&adventure_commands),
+    place(&adventure_place),
+    max_states(10000),
+    max_depth(~0u),
+    threads(0)
+{
+}
+
+Explorer::Explorer(std::shared_ptr<ProgramImage const> image, Options const& options) :
+    image(image),
+    options(options),
+    thread_count(options.threads)
+{
+    if (thread_count == 0)
+    {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+std::size_t Explorer::explore(VirtualMachine::State const& start)
+{
+    graph.clear();
+    hits.clear();
+    known.clear();
+
+    std::vector<std::size_t> frontier;
+    std::vector<VirtualMachine::State> states;
+    Continuation first;
+    first.state = start;
+    first.halted = !start.running;
+    add(Node::NoParent, std::string(), first, frontier, states);
+
+    while (!frontier.empty())
+    {
+        // Look around in every state of this level, without changing it.
+        std::vector<std::vector<std::string>> commands(frontier.size());
+        std::vector<std::string> probes(frontier.size());
+        parallel(frontier.size(), [&](std::size_t i)
+        {
+            probes[i] = continue_from(*image, states[i], options.probe, options.configure).output;
+            commands[i] = options.commands(probes[i]);
+        });
+
+        for (std::size_t i = 0; i < frontier.size(); ++i)
+        {
+            graph[frontier[i]].place = options.place(probes[i]);
+            found_in(frontier[i], probes[i]);
+        }
+
+        if (graph[frontier.front()].depth >= options.max_depth)
+        {
+            break;
+        }
+
+        std::vector<std::pair<std::size_t, std::string>> jobs;
+        for (std::size_t i = 0; i < frontier.size(); ++i)
+        {
+            for (auto const& command : commands[i])
+            {
+                jobs.push_back(std::make_pair(i, command));
+            }
+        }
+
+        std::vector<std::size_t> next_frontier;
+        std::vector<VirtualMachine::State> next_states;
+        for (std::size_t begin = 0; begin < jobs.size() && graph.size() < options.max_states; begin += JobsPerMerge)
+        {
+            auto count = std::min(JobsPerMerge, jobs.size() - begin);
+            std::vector<Continuation> outcomes(count);
+            parallel(count, [&](std::size_t i)
+            {
+                auto const& job = jobs[begin + i];
+                outcomes[i] = continue_from(*image, states[job.first], job.second + "\n", options.configure);
+            });
+
+            for (std::size_t i = 0; i < count && graph.size() < options.max_states; ++i)
+            {
+                auto const& job = jobs[begin + i];
+                auto parent = frontier[job.first];
+                auto child = add(parent, job.second, outcomes[i], next_frontier, next_states);
+                graph[parent].edges.push_back(std::make_pair(job.second, child));
+            }
+        }
+
+        frontier.swap(next_frontier);
+        states.swap(next_states);
+    }
+
+    return graph.size();
+}
+
+std::size_t Explorer::add(std::size_t parent, std::string const& command, Continuation& outcome,
+        std::vector<std::size_t>& frontier, std::vector<VirtualMachine::State>& states)
+{
+    auto hash = hash_of(outcome.state);
+    auto found = known.find(hash);
+    if (found != known.end())
+    {
+        return found->second;
+    }
+
+    Node node;
+    node.parent = parent;
+    node.command = command;
+    node.depth = parent == Node::NoParent ? 0 : graph[parent].depth + 1;
+    node.hash = hash;
+    node.output.swap(outcome.output);
+    node.halted = outcome.halted;
+
+    auto index = graph.size();
+    graph.push_back(node);
+    known[hash] = index;
+    found_in(index, graph[index].output);
+
+    if (!outcome.halted)
+    {
+        frontier.push_back(index);
+        states.push_back(std::move(outcome.state));
+    }
+    return index;
+}
+
+void Explorer::found_in(std::size_t node, std::string const& output)
+{
+    if (!options.target.empty() && output.find(options.target) != std::string::npos
+        && std::find(hits.begin(), hits.end(), node) == hits.end())
+    {
+        hits.push_back(node);
+    }
+}
+
+void Explorer::parallel(std::size_t count, std::function<void(std::size_t)> const& work) const
+{
+    // Workers take the next job as they finish one, as in Runner.
+    std::atomic<std::size_t> next(0);
+    std::exception_ptr failure;
+    std::mutex failure_mutex;
+    auto worker = [&]()
+    {
+        try
+        {
+            for (auto i = next++; i < count; i = next++)
+            {
+                work(i);
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(failure_mutex);
+            failure = std::current_exception();
+            next = count;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < std::min<std::size_t>(thread_count, count); ++i)
+    {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers)
+    {
+        thread.join();
+    }
+
+    if (failure)
+    {
+        std::rethrow_exception(failure);
+    }
+}
+
+std::vector<Explorer::Node> const& Explorer::nodes() const
+{
+    return graph;
+}
+
+std::vector<std::size_t> const& Explorer::found() const
+{
+    return hits;
+}
+
+std::vector<std::string> Explorer::path_to(std::size_t node) const
+{
+    std::vector<std::string> path;
+    for (auto at = node; graph.at(at).parent != Node::NoParent; at = graph[at].parent)
+    {
+        path.push_back(graph[at].command);
+    }
+    std::reverse(path.begin(), path.end());
+    return path;
+}
+
+namespace
+{
+    std::string place_of(Explorer::Node const& node)
+    {
+        if (node.halted)
+        {
+            return Halted;
+        }
+        return node.place.empty() ? "?" : node.place;
+    }
+
+    // Every place, with each command that leaves it and where that went.
+    typedef std::map<std::string, std::set<std::pair<std::string, std::string>>> Places;
+
+    Places places_of(std::vector<Explorer::Node> const& graph)
+    {
+        Places places;
+        for (auto const& node : graph)
+        {
+            auto& exits = places[place_of(node)];
+            for (auto const& edge : node.edges)
+            {
+                exits.insert(std::make_pair(edge.first, place_of(graph[edge.second])));
+            }
+        }
+        return places;
+    }
+}
+
+void Explorer::write_places(std::ostream& out) const
+{
+    for (auto const& place : places_of(graph))
+    {
+        out << place.first << std::endl;
+        for (auto const& exit : place.second)
+        {
+            out << "    " << exit.first << " -> " << exit.second << std::endl;
+        }
+    }
+}
+
+void Explorer::write_dot(std::ostream& out) const
+{
+    out << "digraph places {" << std::endl;
+    for (auto const& place : places_of(graph))
+    {
+        out << "    " << quoted(place.first) << ";" << std::endl;
+        for (auto const& exit : place.second)
+        {
+            out << "    " << quoted(place.first) << " -> " << quoted(exit.second)
+                << " [label=" << quoted(exit.first) << "];" << std::endl;
+        }
+    }
+    out << "}" << std::endl;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "image.h"
+#include "runner.h"
+#include "vm.h"
+
+namespace Backend
+{
+    // Maps a text adventure by trying every command in every state it can
+    // reach, breadth first. Each state is a copy of the guest waiting at an
+    // IN. For each new state, a throwaway copy runs the probe (such as look
+    // and inv), and the output picks the commands worth trying. Each command
+    // then runs on a copy of its own, and the resulting states are told
+    // apart by a 64-bit hash of memory, registers, stack and PC. Explored
+    // states are not kept, so two states whose hashes collide are merged;
+    // at 2^-64 per pair, that needs billions of states. The copies of a
+    // level run on a pool of threads; merging their results happens in job
+    // order, so the graph does not depend on the thread count.
+    class Explorer
+    {
+    public:
+        // Picks commands to try from the output of the probe.
+        typedef std::function<std::vector<std::string>(std::string const& probe_output)> Commands;
+        // Names the place the guest is in from the probe's output, or
+        // returns an empty string if it cannot tell.
+        typedef std::function<std::string(std::string const& probe_output)> Place;
+
+        struct Options
+        {
+            // Explores an adventure in the challenge's format.
+            Options();
+
+            std::string probe;
+            Commands commands;
+            Place place;
+            // Output that marks a state as found. Empty finds nothing.
+            std::string target;
+            // Exploration stops once this many states are known, or at this
+            // many commands from the start.
+            std::size_t max_states;
+            unsigned max_depth;
+            // 0 uses one thread per hardware thread.
+            unsigned threads;
+            // Called on every VM before it runs.
+            Runner::Configure configure;
+        };
+
+        struct Node
+        {
+            static const std::size_t NoParent = ~std::size_t(0);
+
+            // How the shortest path from the start gets here.
+            std::size_t parent;
+            std::string command;
+            unsigned depth;
+            std::uint64_t hash;
+            // The output of that command, and where it left the guest.
+            std::string output;
+            std::string place;
+            // The guest halted or failed, so there is nothing to explore.
+            bool halted;
+            // Each command tried here, and the node it led to.
+            std::vector<std::pair<std::string, std::size_t>> edges;
+        };
+
+        Explorer(std::shared_ptr<ProgramImage const> image, Options const& options);
+
+        // Explores from a guest waiting for input, and returns how many
+        // states it found.
+        std::size_t explore(VirtualMachine::State const& start);
+
+        std::vector<Node> const& nodes() const;
+        // The nodes whose output contains the target, nearest first.
+        std::vector<std::size_t> const& found() const;
+        // The commands that lead from the start to node.
+        std::vector<std::string> path_to(std::size_t node) const;
+
+        // Lists every place with the commands that leave it and where they
+        // go, merging the states that are in the same place.
+        void write_places(std::ostream& out) const;
+        // The same, for Graphviz.
+        void write_dot(std::ostream& out) const;
+
+    private:
+        // Calls work(i) for every i below count, on the pool.
+        void parallel(std::size_t count, std::function<void(std::size_t)> const& work) const;
+        // Adds a node unless its state is already known, and returns it. New
+        // states the guest can go on from join the next frontier.
+        std::size_t add(std::size_t parent, std::string const& command, Continuation& outcome,
+                std::vector<std::size_t>& frontier, std::vector<VirtualMachine::State>& states);
+        void found_in(std::size_t node, std::string const& output);
+
+        std::shared_ptr<ProgramImage const> image;
+        Options options;
+        unsigned thread_count;
+
+        std::vector<Node> graph;
+        std::vector<std::size_t> hits;
+        // Every known state, by its hash. A collision merges two states.
+        std::unordered_map<std::uint64_t, std::size_t> known;
+    };
+
+    // The commands the challenge understands in the output of "look" and
+    // "inv": every exit, take for every thing of interest, and use for
+    // every item carried.
+    std::vector<std::string> adventure_commands(std::string const& output);
+    // The room title in that output, such as "Foothills".
+    std::string adventure_place(std::string const& output);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <unistd.h>
+
+namespace Backend
+{
+    // Closes a file descriptor when it goes out of scope.
+    class FileDescriptor
+    {
+    public:
+        explicit FileDescriptor(int fd) : fd(fd) {}
+        ~FileDescriptor()
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+
+        FileDescriptor(FileDescriptor const&) = delete;
+        FileDescriptor& operator=(FileDescriptor const&) = delete;
+
+        int get() const { return fd; }
+
+    private:
+        int fd;
+    };
+}
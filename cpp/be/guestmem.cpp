@@ -0,0 +1,61 @@
+#include "guestmem.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace Backend;
+using std::uint16_t;
+
+namespace
+{
+    const std::size_t Bytes = GuestMemory::Words * sizeof(uint16_t);
+
+    // Copies the pages of source that differ from target, so the pages of
+    // target that already match are never written.
+    void copy_changed_pages(uint16_t* target, uint16_t const* source)
+    {
+        auto page = std::min(Bytes, std::size_t(sysconf(_SC_PAGESIZE)));
+        auto to = reinterpret_cast<char*>(target);
+        auto from = reinterpret_cast<char const*>(source);
+        for (std::size_t offset = 0; offset < Bytes; offset += page)
+        {
+            auto size = std::min(page, Bytes - offset);
+            if (std::memcmp(to + offset, from + offset, size) != 0)
+            {
+                std::memcpy(to + offset, from + offset, size);
+            }
+        }
+    }
+}
+
+GuestMemory::GuestMemory()
+{
+    auto mapping = mmap(nullptr, Bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        throw std::runtime_error(std::string("Could not map guest memory: ") + strerror(errno));
+    }
+    words = static_cast<uint16_t*>(mapping);
+}
+
+GuestMemory::~GuestMemory()
+{
+    munmap(words, Bytes);
+}
+
+void GuestMemory::assign(uint16_t const* source)
+{
+    copy_changed_pages(words, source);
+}
+
+void GuestMemory::share(uint16_t* mapping)
+{
+    copy_changed_pages(mapping, words);
+    munmap(words, Bytes);
+    words = mapping;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+namespace Backend
+{
+    // The guest's 0x8000 words of memory, in a mapping of their own so
+    // their pages can come from different places. They start out zeroed and
+    // private; share() swaps in a copy-on-write mapping of a program image
+    // instead (see ProgramImage::map_memory()). assign() and share() only
+    // write the pages whose words differ, so pages still shared with the
+    // image stay shared.
+    class GuestMemory
+    {
+    public:
+        static const std::size_t Words = 0x8000;
+
+        GuestMemory();
+        ~GuestMemory();
+
+        GuestMemory(GuestMemory const&) = delete;
+        GuestMemory& operator=(GuestMemory const&) = delete;
+
+        std::uint16_t& operator[](std::size_t address)
+        {
+            return words[address];
+        }
+
+        std::uint16_t const& operator[](std::size_t address) const
+        {
+            return words[address];
+        }
+
+        // Throw std::out_of_range for an address past the end.
+        std::uint16_t& at(std::size_t address)
+        {
+            check(address);
+            return words[address];
+        }
+
+        std::uint16_t const& at(std::size_t address) const
+        {
+            check(address);
+            return words[address];
+        }
+
+        std::size_t size() const { return Words; }
+        std::uint16_t* data() { return words; }
+        std::uint16_t const* data() const { return words; }
+        std::uint16_t* begin() { return words; }
+        std::uint16_t* end() { return words + Words; }
+        std::uint16_t const* begin() const { return words; }
+        std::uint16_t const* end() const { return words + Words; }
+
+        // Copies all Words words from source.
+        void assign(std::uint16_t const* source);
+
+        // Takes over mapping, Words words from mmap(), and makes it hold what
+        // memory holds now.
+        void share(std::uint16_t* mapping);
+
+    private:
+        void check(std::size_t address) const
+        {
+            if (address >= Words)
+            {
+                throw std::out_of_range("Guest memory address out of range");
+            }
+        }
+
+        std::uint16_t* words;
+    };
+}
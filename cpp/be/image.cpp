@@ -0,0 +1,234 @@
+#include "image.h"
+
+#include "fd.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Backend;
+using std::uint16_t;
+
+namespace
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    const bool HostIsLittleEndian = false;
+#else
+    const bool HostIsLittleEndian = true;
+#endif
+
+    const uint16_t MaxWord = 32775;
+}
+
+ProgramImage::ProgramImage(std::string const& path) :
+    mapping(nullptr),
+    mapping_size(0),
+    file(-1),
+    first(nullptr),
+    count(0)
+{
+    FileDescriptor fd(open(path.c_str(), O_RDONLY));
+    if (fd.get() < 0)
+    {
+        throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+    }
+
+    struct stat info;
+    if (fstat(fd.get(), &info) < 0)
+    {
+        throw std::runtime_error("Could not stat " + path + ": " + strerror(errno));
+    }
+
+    auto file_size = std::size_t(info.st_size);
+    if (file_size % sizeof(uint16_t) != 0)
+    {
+        throw std::runtime_error(path + " does not hold a whole number of words");
+    }
+    if (file_size > MaxWords * sizeof(uint16_t))
+    {
+        throw std::runtime_error(path + " does not fit in memory");
+    }
+    if (file_size == 0)
+    {
+        return;
+    }
+
+    mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+    if (mapping == MAP_FAILED)
+    {
+        mapping = nullptr;
+        throw std::runtime_error("Could not map " + path + ": " + strerror(errno));
+    }
+    mapping_size = file_size;
+    count = file_size / sizeof(uint16_t);
+
+    auto words = static_cast<uint16_t const*>(mapping);
+    try
+    {
+        validate(words, count, path, HostIsLittleEndian ? nullptr : &copy);
+    }
+    catch (...)
+    {
+        release();
+        throw;
+    }
+
+    if (HostIsLittleEndian)
+    {
+        first = words;
+        // Kept for map_memory(); failing here only costs the sharing.
+        file = dup(fd.get());
+    }
+    else
+    {
+        // Nothing reads the mapping again.
+        release();
+        first = copy.data();
+    }
+}
+
+ProgramImage::ProgramImage(std::vector<uint16_t> words) :
+    mapping(nullptr),
+    mapping_size(0),
+    file(-1),
+    copy(std::move(words)),
+    first(copy.data()),
+    count(copy.size())
+{
+    if (count > MaxWords)
+    {
+        throw std::runtime_error("The program does not fit in memory");
+    }
+    validate(first, count, "The program", nullptr);
+}
+
+ProgramImage::~ProgramImage()
+{
+    release();
+}
+
+ProgramImage::ProgramImage(ProgramImage&& other) :
+    mapping(other.mapping),
+    mapping_size(other.mapping_size),
+    file(other.file),
+    copy(std::move(other.copy)),
+    first(other.first),
+    count(other.count)
+{
+    other.mapping = nullptr;
+    other.mapping_size = 0;
+    other.file = -1;
+    other.first = nullptr;
+    other.count = 0;
+}
+
+ProgramImage& ProgramImage::operator=(ProgramImage&& other)
+{
+    if (this != &other)
+    {
+        release();
+        mapping = other.mapping;
+        mapping_size = other.mapping_size;
+        file = other.file;
+        copy = std::move(other.copy);
+        first = other.first;
+        count = other.count;
+
+        other.mapping = nullptr;
+        other.mapping_size = 0;
+        other.file = -1;
+        other.first = nullptr;
+        other.count = 0;
+    }
+    return *this;
+}
+
+uint16_t const* ProgramImage::data() const
+{
+    return first;
+}
+
+std::size_t ProgramImage::size() const
+{
+    return count;
+}
+
+std::vector<uint16_t> ProgramImage::words() const
+{
+    return std::vector<uint16_t>(first, first + count);
+}
+
+uint16_t* ProgramImage::map_memory() const
+{
+    auto bytes = MaxWords * sizeof(uint16_t);
+    auto memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        throw std::runtime_error(std::string("Could not map guest memory: ") + strerror(errno));
+    }
+
+    auto words = static_cast<uint16_t*>(memory);
+    if (file >= 0 && count > 0)
+    {
+        // Replaces the pages the program covers. The rest of its last page
+        // lies past the end of the file, which reads as zeros.
+        if (mmap(memory, count * sizeof(uint16_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file, 0) == MAP_FAILED)
+        {
+            auto error = errno;
+            munmap(memory, bytes);
+            throw std::runtime_error(std::string("Could not map the program: ") + strerror(error));
+        }
+    }
+    else
+    {
+        std::copy(first, first + count, words);
+    }
+
+    return words;
+}
+
+void ProgramImage::release()
+{
+    if (mapping != nullptr)
+    {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+    }
+    if (file >= 0)
+    {
+        close(file);
+        file = -1;
+    }
+}
+
+void ProgramImage::validate(uint16_t const* words, std::size_t count, std::string const& name,
+        std::vector<uint16_t>* swapped)
+{
+    if (swapped != nullptr)
+    {
+        swapped->resize(count);
+    }
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        auto word = words[i];
+        if (swapped != nullptr)
+        {
+            word = uint16_t((word >> 8) | (word << 8));
+            (*swapped)[i] = word;
+        }
+
+        if (word > MaxWord)
+        {
+            throw std::runtime_error(name + " holds an invalid word at address " + std::to_string(i));
+        }
+    }
+}
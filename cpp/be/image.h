@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Backend
+{
+    // A program as it is loaded into guest memory. Program files are
+    // little-endian 16-bit words. On a little-endian host the words are
+    // used straight from a read-only mapping of the file; on others they
+    // are byte-swapped into a copy.
+    class ProgramImage
+    {
+    public:
+        static const std::size_t MaxWords = 0x8000;
+
+        // Throws std::runtime_error if the file cannot be read, does not
+        // hold a whole number of words, does not fit in memory, or holds a
+        // word above 32775.
+        explicit ProgramImage(std::string const& path);
+
+        // Throws the same way for words that could not have come from a
+        // valid file.
+        explicit ProgramImage(std::vector<std::uint16_t> words);
+
+        ~ProgramImage();
+
+        ProgramImage(ProgramImage&& other);
+        ProgramImage& operator=(ProgramImage&& other);
+        ProgramImage(ProgramImage const&) = delete;
+        ProgramImage& operator=(ProgramImage const&) = delete;
+
+        std::uint16_t const* data() const;
+        std::size_t size() const;
+
+        std::vector<std::uint16_t> words() const;
+
+        // Maps all MaxWords words of guest memory as the program starts:
+        // the program, then zeros. The mapping is private and copy-on-write,
+        // for GuestMemory::share(). When the words come from a file, the
+        // pages that are never written stay shared with the file's page
+        // cache, and so with every other VM and process mapping the same
+        // file; otherwise the mapping holds a copy. The file must not change
+        // while the mapping is in use.
+        std::uint16_t* map_memory() const;
+
+    private:
+        // Unmaps the file and closes it.
+        void release();
+
+        // Checks every word, and byte-swaps it first on big-endian hosts.
+        static void validate(std::uint16_t const* words, std::size_t count, std::string const& name,
+                std::vector<std::uint16_t>* swapped);
+
+        void* mapping;
+        std::size_t mapping_size;
+        // The file the words are used from, or -1.
+        int file;
+        // Holds the words when they are not used from the mapping.
+        std::vector<std::uint16_t> copy;
+        std::uint16_t const* first;
+        std::size_t count;
+    };
+}
@@ -0,0 +1,77 @@
+#include "intrinsics.h"
+
+#include <cstdint>
+
+using namespace Backend;
+using std::uint16_t;
+
+namespace
+{
+    const unsigned Modulus = 0x8000;
+
+    struct NamedIntrinsic
+    {
+        char const* name;
+        void (*fn)(VirtualMachine& vm);
+    };
+
+    const NamedIntrinsic Intrinsics[] = {
+        { "teleporter", &teleporter_confirmation }
+    };
+}
+
+void Backend::teleporter_confirmation(VirtualMachine& vm)
+{
+    auto a = unsigned(vm.register_value(0));
+    auto b = unsigned(vm.register_value(1));
+    auto c = unsigned(vm.register_value(7));
+
+    // Row a of f only depends on row a - 1, so two rows are enough. The
+    // rows before the last are needed in full, the last only up to b.
+    std::vector<uint16_t> previous(Modulus);
+    std::vector<uint16_t> current(Modulus);
+    for (unsigned i = 0; i < Modulus; ++i)
+    {
+        current[i] = uint16_t((i + 1) % Modulus);
+    }
+
+    for (unsigned row = 1; row <= a; ++row)
+    {
+        previous.swap(current);
+
+        auto last = row == a ? b : Modulus - 1;
+        current[0] = previous[c];
+        for (unsigned i = 1; i <= last; ++i)
+        {
+            current[i] = previous[current[i - 1]];
+        }
+    }
+
+    auto result = current[b];
+    vm.set_register_value(0, result);
+    vm.set_register_value(1, uint16_t((result + Modulus - 1) % Modulus));
+}
+
+VirtualMachine::Intrinsic Backend::find_intrinsic(std::string const& name)
+{
+    for (auto const& intrinsic : Intrinsics)
+    {
+        if (name == intrinsic.name)
+        {
+            return intrinsic.fn;
+        }
+    }
+
+    return VirtualMachine::Intrinsic();
+}
+
+std::vector<std::string> Backend::intrinsic_names()
+{
+    std::vector<std::string> names;
+    for (auto const& intrinsic : Intrinsics)
+    {
+        names.push_back(intrinsic.name);
+    }
+
+    return names;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "vm.h"
+
+namespace Backend
+{
+    // Host implementations of routines in challenge.bin, to register with
+    // VirtualMachine::register_intrinsic at the routine's address.
+
+    // The teleporter confirmation routine at 0x178b. With a in R0, b in R1
+    // and c in R7 it computes
+    //   f(0, b) = b + 1
+    //   f(a, 0) = f(a - 1, c)
+    //   f(a, b) = f(a - 1, f(a, b - 1))
+    // modulo 32768 into R0. It returns with R1 one less than R0, and the
+    // rest of the machine as it found it.
+    void teleporter_confirmation(VirtualMachine& vm);
+
+    // Returns the intrinsic with the given name, or an empty function if
+    // there is none.
+    VirtualMachine::Intrinsic find_intrinsic(std::string const& name);
+    std::vector<std::string> intrinsic_names();
+}
@@ -0,0 +1,154 @@
+#include "io.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <unistd.h>
+
+using namespace Backend;
+
+ConsoleIO::ConsoleIO(int input_fd) :
+    input_fd(input_fd)
+{
+}
+
+GuestIO::InputStatus ConsoleIO::read(char* buffer, std::size_t capacity, std::size_t& count)
+{
+    auto result = ::read(input_fd, buffer, capacity);
+    if (result > 0)
+    {
+        count = std::size_t(result);
+        return InputStatus::Ready;
+    }
+
+    // Our signal handlers interrupt the read; anything else ends input.
+    if (result < 0 && errno == EINTR)
+    {
+        return InputStatus::Interrupted;
+    }
+
+    return InputStatus::Ended;
+}
+
+void ConsoleIO::write(char const* data, std::size_t size)
+{
+    std::cout.write(data, size);
+    std::cout.flush();
+}
+
+MemoryInput::MemoryInput() :
+    position(0),
+    ended(false)
+{
+}
+
+MemoryInput::MemoryInput(std::string const& input) :
+    input(input),
+    position(0),
+    ended(false)
+{
+}
+
+void MemoryInput::feed(std::string const& more)
+{
+    if (ended)
+    {
+        throw std::logic_error("Cannot feed input after it has ended");
+    }
+
+    // Drop what has been read already rather than let the buffer grow.
+    input.erase(0, position);
+    position = 0;
+    input += more;
+}
+
+void MemoryInput::end_input()
+{
+    ended = true;
+}
+
+GuestIO::InputStatus MemoryInput::read(char* buffer, std::size_t capacity, std::size_t& count)
+{
+    if (position == input.size())
+    {
+        return ended ? InputStatus::Ended : InputStatus::NotYet;
+    }
+
+    count = std::min(capacity, input.size() - position);
+    std::memcpy(buffer, input.data() + position, count);
+    position += count;
+    return InputStatus::Ready;
+}
+
+StringIO::StringIO()
+{
+}
+
+StringIO::StringIO(std::string const& input) :
+    MemoryInput(input)
+{
+}
+
+void StringIO::write(char const* data, std::size_t size)
+{
+    collected.append(data, size);
+}
+
+std::string const& StringIO::output() const
+{
+    return collected;
+}
+
+void StringIO::clear_output()
+{
+    collected.clear();
+}
+
+RingIO::RingIO(std::size_t capacity, std::string const& input) :
+    MemoryInput(input),
+    ring(capacity),
+    total(0)
+{
+    if (capacity == 0)
+    {
+        throw std::invalid_argument("A RingIO needs room for at least one byte");
+    }
+}
+
+void RingIO::write(char const* data, std::size_t size)
+{
+    // Only the tail of a write larger than the ring can survive it.
+    if (size > ring.size())
+    {
+        total += size - ring.size();
+        data += size - ring.size();
+        size = ring.size();
+    }
+
+    auto start = total % ring.size();
+    auto first = std::min(size, ring.size() - start);
+    std::memcpy(ring.data() + start, data, first);
+    std::memcpy(ring.data(), data + first, size - first);
+    total += size;
+}
+
+std::string RingIO::output() const
+{
+    if (total < ring.size())
+    {
+        return std::string(ring.data(), total);
+    }
+
+    auto start = total % ring.size();
+    std::string oldest_first(ring.data() + start, ring.size() - start);
+    oldest_first.append(ring.data(), start);
+    return oldest_first;
+}
+
+std::size_t RingIO::total_output() const
+{
+    return total;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace Backend
+{
+    // Where a VM gets the guest's input and sends its output. A VM takes
+    // one at construction and uses it from whichever thread runs it.
+    class GuestIO
+    {
+    public:
+        enum class InputStatus
+        {
+            // count bytes were read.
+            Ready,
+            // There will never be more input; the VM halts.
+            Ended,
+            // There is no input right now; the VM suspends until run()
+            // is called again.
+            NotYet,
+            // A signal interrupted the read; the VM serves any requests it
+            // raised and reads again.
+            Interrupted
+        };
+
+        virtual ~GuestIO() {}
+
+        // Reads at most capacity bytes of input into buffer.
+        virtual InputStatus read(char* buffer, std::size_t capacity, std::size_t& count) = 0;
+
+        virtual void write(char const* data, std::size_t size) = 0;
+    };
+
+    // Reads input from a file descriptor, stdin by default, and writes
+    // output to std::cout. A read blocks until the user types something.
+    class ConsoleIO : public GuestIO
+    {
+    public:
+        explicit ConsoleIO(int input_fd = 0);
+
+        InputStatus read(char* buffer, std::size_t capacity, std::size_t& count) override;
+        void write(char const* data, std::size_t size) override;
+
+    private:
+        int input_fd;
+    };
+
+    // Input from memory. Until end_input() is called, running out of input
+    // suspends the VM rather than halting it, so more can be fed in.
+    class MemoryInput : public GuestIO
+    {
+    public:
+        MemoryInput();
+        explicit MemoryInput(std::string const& input);
+
+        void feed(std::string const& input);
+        void end_input();
+
+        InputStatus read(char* buffer, std::size_t capacity, std::size_t& count) override;
+
+    private:
+        std::string input;
+        std::size_t position;
+        bool ended;
+    };
+
+    // Memory input, with all output collected in a string.
+    class StringIO : public MemoryInput
+    {
+    public:
+        StringIO();
+        explicit StringIO(std::string const& input);
+
+        void write(char const* data, std::size_t size) override;
+
+        std::string const& output() const;
+        void clear_output();
+
+    private:
+        std::string collected;
+    };
+
+    // Memory input, keeping only the most recent output in a fixed-size
+    // ring.
+    class RingIO : public MemoryInput
+    {
+    public:
+        explicit RingIO(std::size_t capacity, std::string const& input = std::string());
+
+        void write(char const* data, std::size_t size) override;
+
+        // The last capacity bytes of output, oldest first.
+        std::string output() const;
+        // How much output there has been in all.
+        std::size_t total_output() const;
+
+    private:
+        std::vector<char> ring;
+        std::size_t total;
+    };
+}
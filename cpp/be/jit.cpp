@@ -0,0 +1,959 @@
+#include "jit.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+
+#include <sys/mman.h>
+
+using namespace Backend;
+using std::uint8_t;
+using std::uint16_t;
+using std::uint32_t;
+
+namespace
+{
+    const std::size_t CodeBufferSize = 4 * 1024 * 1024;
+    const int MaxBlockInstructions = 64;
+    // The most words a block can be translated from.
+    const std::size_t MaxBlockWords = MaxBlockInstructions * 4;
+
+    // Host register numbers, as encoded in ModRM and REX.
+    enum HostRegister : uint8_t
+    {
+        RAX = 0,
+        RCX = 1,
+        RDX = 2,
+        RBX = 3,
+        RSP = 4,
+        RBP = 5,
+        RSI = 6,
+        RDI = 7
+    };
+
+    // Guest register n lives in r(8 + n) while translated code runs. rbx
+    // holds the JitFrame, rbp the base of guest memory, rsi the stack depth
+    // and rdi the instructions completed; rax, rcx and rdx are scratch.
+    uint8_t host_register(uint16_t guest_register)
+    {
+        return uint8_t(8 + guest_register);
+    }
+
+    const int FrameRegisters = 0;
+    const int FrameMemory = 8;
+    const int FrameEntries = 16;
+    const int FrameRequests = 24;
+    const int FrameStack = 32;
+    const int FrameDepth = 40;
+    const int FrameCapacity = 48;
+    const int FrameHighWater = 56;
+    const int FrameInstructions = 64;
+    const int FrameVm = 72;
+    const int FrameWrite = 80;
+
+    static_assert(offsetof(JitFrame, entries) == FrameEntries, "JitFrame layout changed");
+    static_assert(offsetof(JitFrame, depth) == FrameDepth, "JitFrame layout changed");
+    static_assert(offsetof(JitFrame, instructions) == FrameInstructions, "JitFrame layout changed");
+    static_assert(offsetof(JitFrame, write) == FrameWrite, "JitFrame layout changed");
+
+    const int OperandCounts[] = { 0, 2, 1, 1, 3, 3, 1, 2, 2, 3, 3, 3, 3, 3, 2, 2, 2, 1, 0, 1, 1, 0 };
+
+    struct Operand
+    {
+        bool is_register;
+        uint16_t value;
+    };
+
+    struct GuestInstruction
+    {
+        uint16_t pc;
+        uint16_t next_pc;
+        uint16_t opcode;
+        Operand args[3];
+    };
+
+    bool decode_operand(uint16_t word, Operand& operand)
+    {
+        if (word < 32768)
+        {
+            operand.is_register = false;
+            operand.value = word;
+            return true;
+        }
+
+        if (word < 32776)
+        {
+            operand.is_register = true;
+            operand.value = word - 32768;
+            return true;
+        }
+
+        return false;
+    }
+
+    // Reads the instruction at pc if the JIT knows how to translate it.
+    // Anything that fails here is left to the interpreter, which also
+    // produces the proper error for invalid operands.
+    bool decode_guest(uint16_t pc, GuestMemory const& memory, bool calls, GuestInstruction& inst)
+    {
+        if (pc >= memory.size())
+        {
+            return false;
+        }
+
+        auto opcode = memory[pc];
+        if (opcode >= sizeof(OperandCounts) / sizeof(OperandCounts[0]))
+        {
+            return false;
+        }
+
+        auto count = OperandCounts[opcode];
+        if (std::size_t(pc) + count >= memory.size())
+        {
+            return false;
+        }
+
+        inst.pc = pc;
+        inst.next_pc = uint16_t(pc + 1 + count);
+        inst.opcode = opcode;
+        for (auto i = 0; i < count; ++i)
+        {
+            if (!decode_operand(memory[pc + 1 + i], inst.args[i]))
+            {
+                return false;
+            }
+        }
+
+        switch (opcode)
+        {
+            case 0:  // HALT
+            case 19: // OUT
+            case 20: // IN
+                return false;
+            case 17: // CALL
+                return calls;
+            case 2:  // PUSH
+            case 6:  // JMP
+            case 7:  // JT
+            case 8:  // JF
+            case 16: // WMEM
+            case 18: // RET
+            case 21: // NOOP
+                return true;
+            case 11: // MOD
+                if (!inst.args[2].is_register && inst.args[2].value == 0)
+                {
+                    return false;
+                }
+                return inst.args[0].is_register;
+            default:
+                // Everything else writes its result to the register in a.
+                return inst.args[0].is_register;
+        }
+    }
+
+    bool ends_block(uint16_t opcode)
+    {
+        return opcode == 6 || opcode == 7 || opcode == 8 || opcode == 17 || opcode == 18;
+    }
+
+    const uint8_t CondAboveOrEqual = 0x3;
+    const uint8_t CondEqual = 0x4;
+    const uint8_t CondNotEqual = 0x5;
+    const uint8_t CondBelowOrEqual = 0x6;
+    const uint8_t CondAbove = 0x7;
+    const uint8_t Always = 0xff;
+
+    class Emitter
+    {
+    public:
+        std::vector<uint8_t> bytes;
+
+        void byte(uint8_t b)
+        {
+            bytes.push_back(b);
+        }
+
+        void dword(uint32_t d)
+        {
+            for (auto i = 0; i < 4; ++i)
+            {
+                byte(uint8_t(d >> (8 * i)));
+            }
+        }
+
+        // Emits an optional REX prefix and opcode for a register-to-register
+        // instruction, followed by its ModRM byte.
+        void rr(std::initializer_list<uint8_t> opcode, uint8_t reg, uint8_t rm, bool wide = false)
+        {
+            auto rex = uint8_t(0x40 | (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+            if (rex != 0x40)
+            {
+                byte(rex);
+            }
+            for (auto b : opcode)
+            {
+                byte(b);
+            }
+            byte(uint8_t(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+        }
+
+        void mov_imm(uint8_t reg, uint32_t imm)
+        {
+            if (reg >= 8)
+            {
+                byte(0x41);
+            }
+            byte(uint8_t(0xb8 + (reg & 7)));
+            dword(imm);
+        }
+
+        void mov(uint8_t dst, uint8_t src)
+        {
+            rr({ 0x89 }, src, dst);
+        }
+
+        // Loads a guest operand into a scratch register.
+        void load(uint8_t dst, Operand const& operand)
+        {
+            if (operand.is_register)
+            {
+                mov(dst, host_register(operand.value));
+            }
+            else
+            {
+                mov_imm(dst, operand.value);
+            }
+        }
+
+        // eax = eax <op> operand, for the ALU ops that take a group-1
+        // immediate form (/digit) and a register form (opcode).
+        void alu(uint8_t opcode, uint8_t digit, Operand const& operand)
+        {
+            if (operand.is_register)
+            {
+                rr({ opcode }, host_register(operand.value), RAX);
+            }
+            else
+            {
+                byte(0x81);
+                byte(uint8_t(0xc0 | (digit << 3) | RAX));
+                dword(operand.value);
+            }
+        }
+
+        void add(Operand const& operand) { alu(0x01, 0, operand); }
+        void bit_or(Operand const& operand) { alu(0x09, 1, operand); }
+        void bit_and(Operand const& operand) { alu(0x21, 4, operand); }
+        void cmp(Operand const& operand) { alu(0x39, 7, operand); }
+
+        void imul(Operand const& operand)
+        {
+            if (operand.is_register)
+            {
+                rr({ 0x0f, 0xaf }, RAX, host_register(operand.value));
+            }
+            else
+            {
+                byte(0x69);
+                byte(0xc0);
+                dword(operand.value);
+            }
+        }
+
+        void and_eax_imm(uint32_t imm)
+        {
+            byte(0x25);
+            dword(imm);
+        }
+
+        void test(uint8_t reg)
+        {
+            rr({ 0x85 }, reg, reg);
+        }
+
+        // eax = (flags satisfy cc) ? 1 : 0
+        void setcc(uint8_t cc)
+        {
+            byte(0x0f);
+            byte(uint8_t(0x90 | cc));
+            byte(0xc0);
+            byte(0x0f);
+            byte(0xb6);
+            byte(0xc0);
+        }
+
+        // Stores eax into a guest register.
+        void store(uint16_t guest_register)
+        {
+            mov(host_register(guest_register), RAX);
+        }
+
+        // Emits a jcc/jmp rel32 and returns the offset of its displacement.
+        std::size_t jump(uint8_t cc)
+        {
+            if (cc == 0xff)
+            {
+                byte(0xe9);
+            }
+            else
+            {
+                byte(0x0f);
+                byte(uint8_t(0x80 | cc));
+            }
+            auto at = bytes.size();
+            dword(0);
+            return at;
+        }
+
+        void patch(std::size_t at, std::size_t target)
+        {
+            auto rel = uint32_t(std::int32_t(target) - std::int32_t(at + 4));
+            for (auto i = 0; i < 4; ++i)
+            {
+                bytes[at + i] = uint8_t(rel >> (8 * i));
+            }
+        }
+
+        // op r64, qword [rbx + offset], for the 0x8b (mov r64, m64), 0x89
+        // (mov m64, r64) and 0x3b (cmp r64, m64) forms.
+        void frame(uint8_t opcode, uint8_t reg, int offset)
+        {
+            byte(0x48); byte(opcode);
+            byte(uint8_t(0x43 | (reg << 3)));
+            byte(uint8_t(offset));
+        }
+
+        // add rdi, count
+        void count_instructions(uint32_t count)
+        {
+            if (count == 0)
+            {
+                return;
+            }
+            if (count < 0x80)
+            {
+                byte(0x48); byte(0x83); byte(0xc7); byte(uint8_t(count));
+            }
+            else
+            {
+                byte(0x48); byte(0x81); byte(0xc7);
+                dword(count);
+            }
+        }
+
+        // Sets the flags for whether requests are pending.
+        void check_requests()
+        {
+            frame(0x8b, RDX, FrameRequests);
+            // cmp dword [rdx], 0
+            byte(0x83); byte(0x3a); byte(0x00);
+        }
+
+        // Pushes ax onto the guest stack, or jumps to the returned
+        // displacement if the stack has to grow first.
+        std::size_t push_eax()
+        {
+            frame(0x3b, RSI, FrameCapacity);
+            auto full = jump(CondAboveOrEqual);
+            frame(0x8b, RCX, FrameStack);
+            // mov word [rcx + rsi*2], ax
+            byte(0x66); byte(0x89); byte(0x04); byte(0x71);
+            // inc rsi
+            byte(0x48); byte(0xff); byte(0xc6);
+            frame(0x3b, RSI, FrameHighWater);
+            auto lower = jump(CondBelowOrEqual);
+            frame(0x89, RSI, FrameHighWater);
+            patch(lower, bytes.size());
+            return full;
+        }
+
+        // Calls JitFrame::write, keeping the registers it may change.
+        void call_write(Operand const& address, Operand const& value)
+        {
+            byte(0x56); byte(0x57);
+            for (uint8_t r = 8; r < 12; ++r)
+            {
+                byte(0x41);
+                byte(uint8_t(0x50 + (r & 7)));
+            }
+            // Keeps the stack 16-byte aligned for the call.
+            byte(0x48); byte(0x83); byte(0xec); byte(0x08);
+            load(RSI, address);
+            load(RDX, value);
+            frame(0x8b, RDI, FrameVm);
+            // call [rbx + FrameWrite]
+            byte(0xff); byte(0x53); byte(uint8_t(FrameWrite));
+            byte(0x48); byte(0x83); byte(0xc4); byte(0x08);
+            for (uint8_t r = 12; r > 8; --r)
+            {
+                byte(0x41);
+                byte(uint8_t(0x58 + ((r - 1) & 7)));
+            }
+            byte(0x5f); byte(0x5e);
+        }
+
+        // Pops the guest stack into eax, or jumps to the returned
+        // displacement if it is empty.
+        std::size_t pop_eax()
+        {
+            // test rsi, rsi
+            byte(0x48); byte(0x85); byte(0xf6);
+            auto empty = jump(CondEqual);
+            // dec rsi
+            byte(0x48); byte(0xff); byte(0xce);
+            frame(0x8b, RCX, FrameStack);
+            // movzx eax, word [rcx + rsi*2]
+            byte(0x0f); byte(0xb7); byte(0x04); byte(0x71);
+            return empty;
+        }
+    };
+
+    uint32_t exit_code(Jit::Exit exit, uint16_t pc)
+    {
+        return (uint32_t(exit) << 16) | pc;
+    }
+
+    // Enters translated code as uint32_t(JitFrame* frame, void const* block)
+    // and leaves it when code jumps to the returned offset with the exit
+    // code in eax.
+    std::size_t emit_entry_and_exit(Emitter& e)
+    {
+        e.byte(0x53);
+        e.byte(0x55);
+        for (uint8_t r = 12; r < 16; ++r)
+        {
+            e.byte(0x41);
+            e.byte(uint8_t(0x50 + (r & 7)));
+        }
+        // mov rbx, rdi; mov rax, rsi
+        e.byte(0x48); e.byte(0x89); e.byte(0xfb);
+        e.byte(0x48); e.byte(0x89); e.byte(0xf0);
+        e.frame(0x8b, RBP, FrameMemory);
+        e.frame(0x8b, RCX, FrameRegisters);
+        for (uint8_t r = 0; r < 8; ++r)
+        {
+            // movzx r(8+n)d, word [rcx + 2n]
+            e.byte(0x44); e.byte(0x0f); e.byte(0xb7);
+            e.byte(uint8_t(0x41 | (r << 3)));
+            e.byte(uint8_t(2 * r));
+        }
+        e.frame(0x8b, RDI, FrameInstructions);
+        e.frame(0x8b, RSI, FrameDepth);
+        // jmp rax
+        e.byte(0xff); e.byte(0xe0);
+
+        auto leave = e.bytes.size();
+        e.frame(0x8b, RCX, FrameRegisters);
+        for (uint8_t r = 0; r < 8; ++r)
+        {
+            // mov word [rcx + 2n], r(8+n)w
+            e.byte(0x66); e.byte(0x44); e.byte(0x89);
+            e.byte(uint8_t(0x41 | (r << 3)));
+            e.byte(uint8_t(2 * r));
+        }
+        e.frame(0x89, RDI, FrameInstructions);
+        e.frame(0x89, RSI, FrameDepth);
+        for (uint8_t r = 16; r > 12; --r)
+        {
+            e.byte(0x41);
+            e.byte(uint8_t(0x58 + ((r - 1) & 7)));
+        }
+        e.byte(0x5d);
+        e.byte(0x5b);
+        e.byte(0xc3);
+        return leave;
+    }
+}
+
+Jit::Jit() :
+    code(nullptr),
+    code_size(CodeBufferSize),
+    code_used(0),
+    translate_calls(true),
+    entries(0x8000, nullptr),
+    states(0x8000, State::Unknown),
+    coverage(0x8000, 0)
+{
+    auto mapping = mmap(nullptr, code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        throw std::runtime_error(std::string("Could not map memory for the JIT: ") + strerror(errno));
+    }
+    code = static_cast<uint8_t*>(mapping);
+
+    Emitter e;
+    leave = emit_entry_and_exit(e);
+    std::memcpy(code, e.bytes.data(), e.bytes.size());
+    code_start = code_used = e.bytes.size();
+    set_writable(false);
+}
+
+Jit::~Jit()
+{
+    munmap(code, code_size);
+}
+
+void const* Jit::block_at(uint16_t address, GuestMemory const& memory)
+{
+    if (states[address] == State::Unknown)
+    {
+        translate(address, memory);
+    }
+    return entries[address];
+}
+
+std::uint32_t Jit::run(JitFrame& frame, void const* block) const
+{
+    typedef std::uint32_t (*EnterFn)(JitFrame* frame, void const* block);
+    return reinterpret_cast<EnterFn>(code)(&frame, block);
+}
+
+void const* const* Jit::entry_table() const
+{
+    return entries.data();
+}
+
+bool Jit::translated(uint16_t address) const
+{
+    return coverage[address] > 0;
+}
+
+void Jit::invalidate(uint16_t address)
+{
+    // The word may belong to an instruction that could not be translated
+    // before but can be now.
+    auto first = std::size_t(address < 3 ? 0 : address - 3);
+    for (auto i = first; i <= address; ++i)
+    {
+        if (states[i] == State::Untranslatable)
+        {
+            states[i] = State::Unknown;
+        }
+    }
+
+    if (coverage[address] == 0)
+    {
+        return;
+    }
+
+    // Only blocks starting this close can cover the word.
+    set_writable(true);
+    auto last = std::size_t(address);
+    auto first_start = last + 1 < MaxBlockWords ? 0 : last + 1 - MaxBlockWords;
+    for (auto start = first_start; start <= last && coverage[address] > 0; ++start)
+    {
+        auto found = blocks.find(uint16_t(start));
+        if (found != blocks.end() && address < found->second.end)
+        {
+            kill_block(uint16_t(start));
+        }
+    }
+    set_writable(false);
+}
+
+void Jit::set_translate_calls(bool translate)
+{
+    if (translate != translate_calls)
+    {
+        translate_calls = translate;
+        flush();
+    }
+}
+
+void Jit::flush()
+{
+    blocks.clear();
+    links.clear();
+    std::fill(entries.begin(), entries.end(), nullptr);
+    std::fill(states.begin(), states.end(), State::Unknown);
+    std::fill(coverage.begin(), coverage.end(), 0);
+    code_used = code_start;
+}
+
+void Jit::kill_block(uint16_t start)
+{
+    auto found = blocks.find(start);
+    auto const& block = found->second;
+    entries[start] = nullptr;
+    states[start] = State::Unknown;
+    for (auto i = start; i < block.end; ++i)
+    {
+        --coverage[i];
+    }
+
+    // Jumps here leave for the interpreter again, which translates the
+    // block anew.
+    auto incoming = links.find(start);
+    if (incoming != links.end())
+    {
+        for (auto const& link : incoming->second)
+        {
+            point_jump(link.site, link.exit);
+        }
+    }
+
+    // The block's own links go with it.
+    for (auto target : block.targets)
+    {
+        auto outgoing = links.find(target);
+        if (outgoing == links.end())
+        {
+            continue;
+        }
+
+        auto& list = outgoing->second;
+        list.erase(std::remove_if(list.begin(), list.end(), [&](Link const& link)
+        {
+            return link.site >= block.code_begin && link.site < block.code_end;
+        }), list.end());
+        if (list.empty())
+        {
+            links.erase(outgoing);
+        }
+    }
+
+    blocks.erase(found);
+}
+
+void Jit::point_jump(std::size_t site, std::size_t target)
+{
+    auto rel = uint32_t(std::int64_t(target) - std::int64_t(site + 4));
+    for (auto i = 0; i < 4; ++i)
+    {
+        code[site + i] = uint8_t(rel >> (8 * i));
+    }
+}
+
+void Jit::set_writable(bool writable)
+{
+    if (mprotect(code, code_size, PROT_READ | (writable ? PROT_WRITE : PROT_EXEC)) != 0)
+    {
+        throw std::runtime_error(std::string("Could not protect the JIT's code: ") + strerror(errno));
+    }
+}
+
+void Jit::translate(uint16_t address, GuestMemory const& memory)
+{
+    std::vector<GuestInstruction> insts;
+    auto pc = address;
+    while (insts.size() < std::size_t(MaxBlockInstructions))
+    {
+        GuestInstruction inst;
+        if (!decode_guest(pc, memory, translate_calls, inst))
+        {
+            break;
+        }
+
+        insts.push_back(inst);
+        pc = inst.next_pc;
+        if (ends_block(inst.opcode))
+        {
+            break;
+        }
+    }
+
+    if (insts.empty())
+    {
+        states[address] = State::Untranslatable;
+        return;
+    }
+
+    Emitter e;
+    // Jumps to the exit sequence, and jumps to other blocks along with the
+    // exits they take until linked, by offsets into e.bytes.
+    std::vector<std::size_t> to_leave;
+    struct Chain
+    {
+        std::size_t site;
+        std::size_t exit;
+        uint16_t target;
+    };
+    std::vector<Chain> chains;
+
+    // Every exit first accounts for the instructions completed on its path:
+    // all those before the current one, plus the current one unless the
+    // block is bailing out of it.
+    uint32_t completed = 0;
+
+    auto exit_with = [&](Jit::Exit exit, uint16_t exit_pc, uint32_t count)
+    {
+        e.count_instructions(count);
+        e.mov_imm(RAX, exit_code(exit, exit_pc));
+        to_leave.push_back(e.jump(Always));
+    };
+
+    auto bail_at = [&](std::size_t skip, uint16_t exit_pc)
+    {
+        auto over = e.jump(Always);
+        e.patch(skip, e.bytes.size());
+        exit_with(Exit::Interpret, exit_pc, completed);
+        e.patch(over, e.bytes.size());
+    };
+
+    auto bail_if = [&](uint8_t cc, uint16_t exit_pc)
+    {
+        auto skip = e.jump(uint8_t(cc ^ 1));
+        exit_with(Exit::Interpret, exit_pc, completed);
+        e.patch(skip, e.bytes.size());
+    };
+
+    // Goes on to the block at target, once there is one to link to.
+    auto go_to = [&](uint16_t target, uint32_t count)
+    {
+        if (target >= entries.size())
+        {
+            exit_with(Exit::Continue, target, count);
+            return;
+        }
+
+        e.count_instructions(count);
+        e.check_requests();
+        auto pending = e.jump(CondNotEqual);
+        Chain chain;
+        chain.site = e.jump(Always);
+        chain.exit = e.bytes.size();
+        chain.target = target;
+        chains.push_back(chain);
+        e.patch(pending, chain.exit);
+        e.patch(chain.site, chain.exit);
+        e.mov_imm(RAX, exit_code(Exit::Continue, target));
+        to_leave.push_back(e.jump(Always));
+    };
+
+    // Goes on to the block at the address in eax through the entry table.
+    auto go_to_eax = [&](uint32_t count)
+    {
+        e.count_instructions(count);
+        e.byte(0x3d);
+        e.dword(0x7fff);
+        auto outside = e.jump(CondAbove);
+        e.frame(0x8b, RCX, FrameEntries);
+        // mov rcx, [rcx + rax*8]
+        e.byte(0x48); e.byte(0x8b); e.byte(0x0c); e.byte(0xc1);
+        e.rr({ 0x85 }, RCX, RCX, true);
+        auto missing = e.jump(CondEqual);
+        e.check_requests();
+        auto pending = e.jump(CondNotEqual);
+        // jmp rcx
+        e.byte(0xff); e.byte(0xe1);
+        // eax already holds exit_code(Exit::Continue, target).
+        e.patch(outside, e.bytes.size());
+        e.patch(missing, e.bytes.size());
+        e.patch(pending, e.bytes.size());
+        to_leave.push_back(e.jump(Always));
+    };
+
+    // A jump to the address in an operand.
+    auto jump_to = [&](Operand const& target, uint32_t count)
+    {
+        if (target.is_register)
+        {
+            e.load(RAX, target);
+            go_to_eax(count);
+        }
+        else
+        {
+            go_to(target.value, count);
+        }
+    };
+
+    auto terminated = false;
+    for (auto const& inst : insts)
+    {
+        auto const& a = inst.args[0];
+        auto const& b = inst.args[1];
+        auto const& c = inst.args[2];
+
+        switch (inst.opcode)
+        {
+            case 1: // SET
+                e.load(RAX, b);
+                e.store(a.value);
+                break;
+            case 2: // PUSH
+                e.load(RAX, a);
+                bail_at(e.push_eax(), inst.pc);
+                break;
+            case 3: // POP
+                bail_at(e.pop_eax(), inst.pc);
+                e.store(a.value);
+                break;
+            case 4: // EQ
+            case 5: // GT
+                e.load(RAX, b);
+                e.cmp(c);
+                e.setcc(inst.opcode == 4 ? CondEqual : CondAbove);
+                e.store(a.value);
+                break;
+            case 6: // JMP
+                jump_to(a, completed + 1);
+                terminated = true;
+                break;
+            case 7: // JT
+            case 8: // JF
+            {
+                e.load(RAX, a);
+                e.test(RAX);
+                auto not_taken = e.jump(inst.opcode == 7 ? CondEqual : CondNotEqual);
+                jump_to(b, completed + 1);
+                e.patch(not_taken, e.bytes.size());
+                go_to(inst.next_pc, completed + 1);
+                terminated = true;
+                break;
+            }
+            case 9: // ADD
+                e.load(RAX, b);
+                e.add(c);
+                e.and_eax_imm(0x7fff);
+                e.store(a.value);
+                break;
+            case 10: // MULT
+                e.load(RAX, b);
+                e.imul(c);
+                e.and_eax_imm(0x7fff);
+                e.store(a.value);
+                break;
+            case 11: // MOD
+                e.load(RCX, c);
+                if (c.is_register)
+                {
+                    // The interpreter owns division by zero.
+                    e.test(RCX);
+                    bail_if(CondEqual, inst.pc);
+                }
+                e.load(RAX, b);
+                e.rr({ 0x31 }, RDX, RDX);
+                e.rr({ 0xf7 }, 6, RCX);
+                e.mov(RAX, RDX);
+                e.store(a.value);
+                break;
+            case 12: // AND
+                e.load(RAX, b);
+                e.bit_and(c);
+                e.store(a.value);
+                break;
+            case 13: // OR
+                e.load(RAX, b);
+                e.bit_or(c);
+                e.store(a.value);
+                break;
+            case 14: // NOT
+                e.load(RAX, b);
+                e.rr({ 0xf7 }, 2, RAX);
+                e.and_eax_imm(0x7fff);
+                e.store(a.value);
+                break;
+            case 15: // RMEM
+                e.load(RAX, b);
+                if (b.is_register)
+                {
+                    // Out-of-range addresses throw in the interpreter.
+                    e.byte(0x3d);
+                    e.dword(0x7fff);
+                    bail_if(CondAbove, inst.pc);
+                }
+                // movzx eax, word [rbp + rax*2]
+                e.byte(0x0f); e.byte(0xb7); e.byte(0x44); e.byte(0x45); e.byte(0x00);
+                e.store(a.value);
+                break;
+            case 16: // WMEM
+            {
+                if (a.is_register)
+                {
+                    // Out-of-range addresses throw in the interpreter.
+                    e.load(RAX, a);
+                    e.byte(0x3d);
+                    e.dword(0x7fff);
+                    bail_if(CondAbove, inst.pc);
+                }
+                e.call_write(a, b);
+                e.test(RAX);
+                auto same_code = e.jump(CondEqual);
+                exit_with(Exit::Continue, inst.next_pc, completed + 1);
+                e.patch(same_code, e.bytes.size());
+                break;
+            }
+            case 17: // CALL
+                e.mov_imm(RAX, inst.next_pc);
+                bail_at(e.push_eax(), inst.pc);
+                jump_to(a, completed + 1);
+                terminated = true;
+                break;
+            case 18: // RET
+            {
+                auto empty = e.pop_eax();
+                go_to_eax(completed + 1);
+                e.patch(empty, e.bytes.size());
+                exit_with(Exit::Halt, inst.pc, completed + 1);
+                terminated = true;
+                break;
+            }
+            case 21: // NOOP
+                break;
+        }
+
+        ++completed;
+    }
+
+    if (!terminated)
+    {
+        go_to(insts.back().next_pc, completed);
+    }
+
+    if (code_used + e.bytes.size() > code_size)
+    {
+        // Out of room; start over; only live blocks get translated again.
+        flush();
+    }
+
+    set_writable(true);
+    auto base = code_used;
+    std::memcpy(code + base, e.bytes.data(), e.bytes.size());
+    code_used += e.bytes.size();
+    for (auto at : to_leave)
+    {
+        point_jump(base + at, leave);
+    }
+
+    Block block;
+    block.end = pc;
+    block.code_begin = base;
+    block.code_end = code_used;
+    for (auto i = address; i < block.end; ++i)
+    {
+        ++coverage[i];
+    }
+
+    for (auto const& chain : chains)
+    {
+        Link link;
+        link.site = base + chain.site;
+        link.exit = base + chain.exit;
+        links[chain.target].push_back(link);
+        block.targets.push_back(chain.target);
+        if (entries[chain.target] != nullptr)
+        {
+            point_jump(link.site, std::size_t(static_cast<uint8_t const*>(entries[chain.target]) - code));
+        }
+    }
+
+    blocks[address] = block;
+    entries[address] = code + base;
+    states[address] = State::Translated;
+
+    // Including the block's own jumps back to its start.
+    auto incoming = links.find(address);
+    if (incoming != links.end())
+    {
+        for (auto const& link : incoming->second)
+        {
+            point_jump(link.site, base);
+        }
+    }
+    set_writable(false);
+}
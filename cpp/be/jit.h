@@ -0,0 +1,148 @@
+#pragma once
+
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "guestmem.h"
+
+namespace Backend
+{
+    class VirtualMachine;
+
+    // Everything translated code needs from the VM. Blocks address the
+    // fields by fixed offsets, so the layout must not change.
+    struct JitFrame
+    {
+        std::uint16_t* registers;
+        std::uint16_t const* memory;
+        // Jit::entry_table(), for jumps whose target is only known at run
+        // time.
+        void const* const* entries;
+        // The VM's requests_pending; blocks leave when it is raised.
+        volatile std::sig_atomic_t const* requests;
+
+        // The guest stack, which blocks push and pop directly: its words,
+        // how many are in use, how many fit before it has to grow, and the
+        // deepest it has been. Pushing past capacity leaves the push to the
+        // interpreter.
+        std::uint16_t* stack;
+        std::uint64_t depth;
+        std::uint64_t capacity;
+        std::uint64_t high_water;
+
+        // Blocks add the number of guest instructions they completed.
+        std::uint64_t instructions;
+
+        // Stores a word for WMEM, which has to tell every cache about it.
+        // Returns nonzero if the word was translated, so the block leaves.
+        VirtualMachine* vm;
+        std::uint32_t (*write)(VirtualMachine* vm, std::uint16_t address, std::uint16_t value);
+    };
+
+    // Translates guest basic blocks into x86-64 code and caches them by
+    // guest address. A block runs until a jump, CALL or RET, or until the
+    // next instruction is one it cannot translate. Guest registers stay in
+    // host registers from entering translated code until leaving it, so
+    // blocks go straight on to each other: a jump to a known address is
+    // linked to the target's block once that is translated, and RET and
+    // jumps to a register look the target up in entry_table(). Code only
+    // returns to the interpreter when the target has no block yet, for an
+    // instruction it cannot run, or when the VM has requests pending.
+    class Jit
+    {
+    public:
+        // What the interpreter has to do after translated code returns.
+        enum class Exit
+        {
+            // Continue at the returned PC.
+            Continue = 0,
+            // Interpret the single instruction at the returned PC; the block
+            // bailed out of it, normally because it is about to throw.
+            Interpret = 1,
+            // The guest halted.
+            Halt = 2
+        };
+
+        Jit();
+        ~Jit();
+
+        Jit(Jit const&) = delete;
+        Jit& operator=(Jit const&) = delete;
+
+        // Returns the block starting at address, translating it from memory
+        // first if needed. Returns nullptr if the instruction at address
+        // has to be run by the interpreter.
+        void const* block_at(std::uint16_t address, GuestMemory const& memory);
+
+        // Runs translated code from block until it has to leave, and returns
+        // (Exit << 16) | PC.
+        std::uint32_t run(JitFrame& frame, void const* block) const;
+
+        // The block for every guest address, or nullptr where there is none.
+        void const* const* entry_table() const;
+
+        // Whether any block was translated from address.
+        bool translated(std::uint16_t address) const;
+
+        // Drops every block that was translated from address.
+        void invalidate(std::uint16_t address);
+
+        // Drops every block.
+        void flush();
+
+        // Without CALL translation, blocks stop short of every CALL and
+        // leave it to the interpreter. Changing this drops every block.
+        void set_translate_calls(bool translate);
+
+    private:
+        enum class State : std::uint8_t
+        {
+            Unknown,
+            Translated,
+            Untranslatable
+        };
+
+        // A jump to another block, by offsets into the code buffer: the
+        // jump's displacement, and the exit it takes while unlinked.
+        struct Link
+        {
+            std::size_t site;
+            std::size_t exit;
+        };
+
+        struct Block
+        {
+            std::uint16_t end;
+            std::size_t code_begin;
+            std::size_t code_end;
+            // The addresses its links jump to.
+            std::vector<std::uint16_t> targets;
+        };
+
+        void translate(std::uint16_t address, GuestMemory const& memory);
+        void kill_block(std::uint16_t start);
+        void point_jump(std::size_t site, std::size_t target);
+        // The code is only writable while it changes.
+        void set_writable(bool writable);
+
+        std::uint8_t* code;
+        std::size_t code_size;
+        std::size_t code_used;
+        // Where translated code starts, after the entry and exit sequences.
+        std::size_t code_start;
+        std::size_t leave;
+        bool translate_calls;
+
+        // Live blocks by start address.
+        std::unordered_map<std::uint16_t, Block> blocks;
+        // Every link from a live block, by the address it jumps to.
+        std::unordered_map<std::uint16_t, std::vector<Link>> links;
+        std::vector<void const*> entries;
+        std::vector<State> states;
+        // How many live blocks were translated from each word.
+        std::vector<std::uint16_t> coverage;
+    };
+}
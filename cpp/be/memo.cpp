@@ -0,0 +1,221 @@
+#include "memo.h"
+
+#include <algorithm>
+#include <cstdio>
+
+using namespace Backend;
+using std::uint16_t;
+using std::uint64_t;
+
+std::size_t Memoizer::RegistersHash::operator()(Registers const& registers) const
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (auto value : registers)
+    {
+        hash = (hash ^ value) * 1099511628211ull;
+    }
+    return std::size_t(hash);
+}
+
+Memoizer::Memoizer(std::size_t capacity) :
+    max_entries(capacity),
+    entries(0),
+    generation(0),
+    dirty_below(0),
+    totals()
+{
+}
+
+std::size_t Memoizer::capacity() const
+{
+    return max_entries;
+}
+
+Memoizer::Routine& Memoizer::routine(uint16_t target)
+{
+    auto& routine = routines[target];
+    if (routine.generation != generation)
+    {
+        routine.purity = Purity::Unknown;
+        routine.generation = generation;
+    }
+    return routine;
+}
+
+bool Memoizer::call(uint16_t target, Registers& registers)
+{
+    auto& routine = this->routine(target);
+    if (routine.purity == Purity::Impure)
+    {
+        return false;
+    }
+
+    auto result = routine.results.find(registers);
+    if (result == routine.results.end())
+    {
+        ++routine.misses;
+        ++totals.misses;
+        return false;
+    }
+
+    registers = result->second;
+    ++routine.hits;
+    ++totals.hits;
+    return true;
+}
+
+void Memoizer::enter(uint16_t target, std::size_t depth, Registers const& registers)
+{
+    Frame frame;
+    frame.target = target;
+    frame.depth = depth;
+    frame.inputs = registers;
+    frame.clean = true;
+    frames.push_back(frame);
+}
+
+void Memoizer::ret(std::size_t depth, Registers const& registers)
+{
+    // Frames above depth lost their return address to a POP, which already
+    // made them unclean.
+    while (!frames.empty() && frames.back().depth > depth)
+    {
+        frames.pop_back();
+    }
+
+    // Otherwise this is a RET to an address the routine pushed itself,
+    // which is only a jump.
+    if (frames.empty() || frames.back().depth != depth)
+    {
+        return;
+    }
+
+    auto const& frame = frames.back();
+    auto& routine = this->routine(frame.target);
+    if (frame.clean && frames.size() > dirty_below)
+    {
+        if (routine.purity == Purity::Unknown)
+        {
+            routine.purity = Purity::Pure;
+        }
+        if (routine.purity == Purity::Pure)
+        {
+            store(routine, frame.inputs, registers);
+        }
+    }
+    else if (routine.purity != Purity::Impure)
+    {
+        entries -= routine.results.size();
+        routine.results.clear();
+        routine.purity = Purity::Impure;
+    }
+
+    frames.pop_back();
+    dirty_below = std::min(dirty_below, frames.size());
+}
+
+void Memoizer::pop(std::size_t depth)
+{
+    // Popping at or below a frame's return address reaches into its
+    // caller's part of the stack.
+    for (auto frame = frames.rbegin(); frame != frames.rend() && frame->depth >= depth; ++frame)
+    {
+        frame->clean = false;
+    }
+}
+
+void Memoizer::forget()
+{
+    side_effect();
+    ++generation;
+    if (entries > 0)
+    {
+        for (auto& entry : routines)
+        {
+            entry.second.results.clear();
+        }
+        entries = 0;
+    }
+}
+
+void Memoizer::reset()
+{
+    routines.clear();
+    entries = 0;
+    frames.clear();
+    dirty_below = 0;
+}
+
+void Memoizer::store(Routine& routine, Registers const& inputs, Registers const& outputs)
+{
+    if (max_entries == 0)
+    {
+        return;
+    }
+
+    if (entries >= max_entries)
+    {
+        for (auto& entry : routines)
+        {
+            entry.second.results.clear();
+        }
+        entries = 0;
+        ++totals.flushes;
+    }
+
+    if (routine.results.emplace(inputs, outputs).second)
+    {
+        ++entries;
+        ++totals.stores;
+    }
+}
+
+Memoizer::Stats Memoizer::stats() const
+{
+    auto stats = totals;
+    stats.entries = entries;
+    return stats;
+}
+
+void Memoizer::report(std::ostream& out, std::size_t shown) const
+{
+    auto totals = stats();
+    char line[128];
+
+    std::snprintf(line, sizeof(line), "Memoization: %llu hits, %llu misses, %llu stored, %llu flushes, %zu of %zu entries\n",
+            static_cast<unsigned long long>(totals.hits), static_cast<unsigned long long>(totals.misses),
+            static_cast<unsigned long long>(totals.stores), static_cast<unsigned long long>(totals.flushes),
+            totals.entries, max_entries);
+    out << line;
+
+    std::vector<std::pair<uint16_t, Routine const*>> called;
+    for (auto const& entry : routines)
+    {
+        if (entry.second.hits > 0 || entry.second.misses > 0)
+        {
+            called.emplace_back(entry.first, &entry.second);
+        }
+    }
+
+    shown = std::min(shown, called.size());
+    std::partial_sort(called.begin(), called.begin() + shown, called.end(),
+            [](std::pair<uint16_t, Routine const*> const& a, std::pair<uint16_t, Routine const*> const& b)
+    {
+        return a.second->hits > b.second->hits || (a.second->hits == b.second->hits && a.first < b.first);
+    });
+
+    if (shown > 0)
+    {
+        out << "\nRoutine            Hits          Misses   Entries\n";
+    }
+    for (std::size_t i = 0; i < shown; ++i)
+    {
+        auto const& routine = *called[i].second;
+        std::snprintf(line, sizeof(line), "0x%04x   %14llu  %14llu  %8zu\n", called[i].first,
+                static_cast<unsigned long long>(routine.hits), static_cast<unsigned long long>(routine.misses),
+                routine.results.size());
+        out << line;
+    }
+
+    out.flush();
+}
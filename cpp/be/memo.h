@@ -0,0 +1,121 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+namespace Backend
+{
+    // Caches the results of guest routines that behave as pure functions of
+    // the registers. The VM reports every CALL, RET, POP and anything that
+    // touches memory or I/O while the routine runs. A routine's invocation
+    // is clean if nothing it did, directly or through the routines it
+    // called, touched memory, I/O or the stack below its return address.
+    // A clean invocation makes a routine cacheable, and its result is
+    // stored against the registers it was called with; a routine with an
+    // invocation that is not clean is never cached.
+    class Memoizer
+    {
+    public:
+        typedef std::array<std::uint16_t, 8> Registers;
+
+        struct Stats
+        {
+            std::uint64_t hits;
+            std::uint64_t misses;
+            std::uint64_t stores;
+            // How often the cache was emptied because it was full.
+            std::uint64_t flushes;
+            std::size_t entries;
+        };
+
+        explicit Memoizer(std::size_t capacity);
+
+        std::size_t capacity() const;
+
+        // Before a CALL to target. Returns true, with registers set to the
+        // routine's results, if the call can be skipped.
+        bool call(std::uint16_t target, Registers& registers);
+
+        // After a CALL to target that was not skipped, with the stack depth
+        // after the return address was pushed.
+        void enter(std::uint16_t target, std::size_t depth, Registers const& registers);
+
+        // Before a RET at the given stack depth.
+        void ret(std::size_t depth, Registers const& registers);
+
+        // Before a POP at the given stack depth.
+        void pop(std::size_t depth);
+
+        // The guest touched memory or I/O.
+        void side_effect()
+        {
+            dirty_below = frames.size();
+        }
+
+        // Memory changed, so any routine may now behave differently.
+        void forget();
+
+        // The stack was replaced.
+        void reset();
+
+        Stats stats() const;
+
+        // Writes the totals and the routines with the most hits.
+        void report(std::ostream& out, std::size_t routines = 16) const;
+
+    private:
+        enum class Purity : std::uint8_t
+        {
+            Unknown,
+            Pure,
+            Impure
+        };
+
+        struct RegistersHash
+        {
+            std::size_t operator()(Registers const& registers) const;
+        };
+
+        struct Routine
+        {
+            Routine() : purity(Purity::Unknown), generation(0), hits(0), misses(0) {}
+
+            Purity purity;
+            // The purity is only known for the generation it was seen in.
+            std::uint64_t generation;
+            std::unordered_map<Registers, Registers, RegistersHash> results;
+            std::uint64_t hits;
+            std::uint64_t misses;
+        };
+
+        struct Frame
+        {
+            std::uint16_t target;
+            std::size_t depth;
+            Registers inputs;
+            bool clean;
+        };
+
+        // Returns the routine at target, as far as the current generation
+        // knows it.
+        Routine& routine(std::uint16_t target);
+        void store(Routine& routine, Registers const& inputs, Registers const& outputs);
+
+        std::size_t max_entries;
+        std::size_t entries;
+        std::unordered_map<std::uint16_t, Routine> routines;
+        // Bumped whenever memory changes.
+        std::uint64_t generation;
+
+        // The invocations in progress, innermost last. Every frame below
+        // dirty_below is unclean, so a side effect is O(1).
+        std::vector<Frame> frames;
+        std::size_t dirty_below;
+
+        Stats totals;
+    };
+}
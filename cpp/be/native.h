@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "stack.h"
+
+namespace Backend
+{
+    class VirtualMachine;
+
+    // The runtime that ahead-of-time translated code runs on. Translated
+    // blocks work on the VM's registers, memory and stack directly, and go
+    // through the VM for output and memory writes.
+    class NativeRuntime
+    {
+    public:
+        // Set in what a block returns when the interpreter has to run the
+        // instruction at the returned address.
+        static const std::uint32_t Interpret = 0x10000;
+
+        NativeRuntime(VirtualMachine& vm, std::uint16_t* registers, std::uint16_t const* memory,
+                GuestStack& stack, std::uint64_t& instructions, bool calls_allowed) :
+            registers(registers),
+            memory(memory),
+            instructions(instructions),
+            calls_allowed(calls_allowed),
+            vm(vm),
+            stack(stack)
+        {
+        }
+
+        bool push(std::uint16_t value)
+        {
+            return stack.try_push(value);
+        }
+
+        bool pop(std::uint16_t& value)
+        {
+            if (stack.empty())
+            {
+                return false;
+            }
+
+            value = stack.top();
+            stack.pop();
+            return true;
+        }
+
+        void out(std::uint16_t value);
+        void write(std::uint16_t address, std::uint16_t value);
+
+        std::uint16_t* const registers;
+        std::uint16_t const* const memory;
+        // Blocks add the instructions they ran before they return.
+        std::uint64_t& instructions;
+        // False while intrinsics are registered, since a CALL may have to
+        // run one.
+        bool const calls_allowed;
+
+    private:
+        VirtualMachine& vm;
+        GuestStack& stack;
+    };
+
+    // A translated block runs from its first instruction until it jumps,
+    // calls, returns or writes memory, and returns the guest address to
+    // carry on at. It stops early at an instruction it cannot run itself,
+    // such as IN, HALT or a POP from an empty stack, and returns that
+    // instruction's address with Interpret set so the interpreter runs it.
+    typedef std::uint32_t (*NativeBlock)(NativeRuntime& rt);
+
+    struct NativeBlockEntry
+    {
+        std::uint16_t start;
+        // The address after the block's last word.
+        std::uint16_t end;
+        NativeBlock fn;
+    };
+
+    // A program translated ahead of time. A block is only used while every
+    // word it covers holds what words held when it was translated, so code
+    // that changes at run time goes back to the interpreter.
+    struct NativeProgram
+    {
+        // All 0x8000 words of memory as they were translated.
+        std::uint16_t const* words;
+        NativeBlockEntry const* blocks;
+        std::size_t block_count;
+    };
+}
@@ -0,0 +1,111 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <numeric>
+
+using namespace Backend;
+using std::uint16_t;
+using std::uint64_t;
+
+namespace
+{
+    double percent(uint64_t count, uint64_t total)
+    {
+        return total > 0 ? 100.0 * count / total : 0.0;
+    }
+}
+
+Profile::Profile() :
+    address_counts(Addresses),
+    taken_counts(Addresses)
+{
+    opcode_counts.fill(0);
+}
+
+void Profile::clear()
+{
+    opcode_counts.fill(0);
+    std::fill(address_counts.begin(), address_counts.end(), 0);
+    std::fill(taken_counts.begin(), taken_counts.end(), 0);
+}
+
+uint64_t Profile::instructions() const
+{
+    return std::accumulate(opcode_counts.begin(), opcode_counts.end(), uint64_t(0));
+}
+
+uint64_t Profile::opcode_count(std::uint8_t opcode) const
+{
+    return opcode_counts.at(opcode);
+}
+
+uint64_t Profile::address_count(uint16_t address) const
+{
+    return address_counts.at(address);
+}
+
+uint64_t Profile::taken_count(uint16_t address) const
+{
+    return taken_counts.at(address);
+}
+
+void Profile::report(std::ostream& out, std::vector<std::string> const& opcode_names,
+        uint16_t const* memory, std::size_t hot_addresses) const
+{
+    auto total = instructions();
+    char line[128];
+
+    std::snprintf(line, sizeof(line), "Profile: %llu instructions\n", static_cast<unsigned long long>(total));
+    out << line;
+
+    std::vector<std::size_t> opcodes(Opcodes);
+    std::iota(opcodes.begin(), opcodes.end(), 0);
+    std::stable_sort(opcodes.begin(), opcodes.end(), [this](std::size_t a, std::size_t b)
+    {
+        return opcode_counts[a] > opcode_counts[b];
+    });
+
+    out << "\nOpcode            Count       %\n";
+    for (auto opcode : opcodes)
+    {
+        if (opcode_counts[opcode] == 0)
+        {
+            break;
+        }
+
+        std::snprintf(line, sizeof(line), "%-6s %14llu  %6.2f\n", opcode_names.at(opcode).c_str(),
+                static_cast<unsigned long long>(opcode_counts[opcode]), percent(opcode_counts[opcode], total));
+        out << line;
+    }
+
+    std::vector<uint16_t> addresses;
+    for (std::size_t address = 0; address < Addresses; ++address)
+    {
+        if (address_counts[address] > 0)
+        {
+            addresses.push_back(uint16_t(address));
+        }
+    }
+
+    auto shown = std::min(hot_addresses, addresses.size());
+    std::partial_sort(addresses.begin(), addresses.begin() + shown, addresses.end(), [this](uint16_t a, uint16_t b)
+    {
+        return address_counts[a] > address_counts[b] || (address_counts[a] == address_counts[b] && a < b);
+    });
+
+    out << "\nAddress  Inst            Count       %           Taken\n";
+    for (std::size_t i = 0; i < shown; ++i)
+    {
+        auto address = addresses[i];
+        auto word = memory[address];
+        auto name = word < opcode_names.size() ? opcode_names[word].c_str() : "?";
+
+        std::snprintf(line, sizeof(line), "0x%04x   %-6s %14llu  %6.2f  %14llu\n", address, name,
+                static_cast<unsigned long long>(address_counts[address]), percent(address_counts[address], total),
+                static_cast<unsigned long long>(taken_counts[address]));
+        out << line;
+    }
+
+    out.flush();
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace Backend
+{
+    // Execution counts gathered while the VM runs with profiling on. The
+    // counters are flat arrays indexed by opcode or by guest address, so
+    // recording an instruction costs two increments.
+    class Profile
+    {
+    public:
+        static const std::size_t Opcodes = 22;
+        static const std::size_t Addresses = 0x8000;
+
+        Profile();
+
+        void record(std::uint16_t address, std::uint8_t opcode)
+        {
+            ++opcode_counts[opcode];
+            ++address_counts[address];
+        }
+
+        // The branch at address went somewhere other than the next
+        // instruction.
+        void record_taken(std::uint16_t address)
+        {
+            ++taken_counts[address];
+        }
+
+        void clear();
+
+        std::uint64_t instructions() const;
+        std::uint64_t opcode_count(std::uint8_t opcode) const;
+        std::uint64_t address_count(std::uint16_t address) const;
+        std::uint64_t taken_count(std::uint16_t address) const;
+
+        // Writes every opcode that ran and the hottest addresses, each
+        // sorted from the most executed down. Addresses are labelled with
+        // the instruction memory holds there now.
+        void report(std::ostream& out, std::vector<std::string> const& opcode_names,
+                std::uint16_t const* memory, std::size_t hot_addresses = 32) const;
+
+    private:
+        std::array<std::uint64_t, Opcodes> opcode_counts;
+        std::vector<std::uint64_t> address_counts;
+        std::vector<std::uint64_t> taken_counts;
+    };
+}
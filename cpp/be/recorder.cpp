@@ -0,0 +1,152 @@
+#include "recorder.h"
+
+#include <stdexcept>
+
+using namespace Backend;
+using std::uint16_t;
+using std::uint64_t;
+
+namespace
+{
+    std::size_t round_up(std::size_t capacity)
+    {
+        std::size_t size = 1;
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+        return size;
+    }
+}
+
+Recorder::Recorder(std::size_t capacity) :
+    requested(capacity),
+    ring(round_up(capacity)),
+    mask(ring.size() - 1),
+    oldest(0),
+    cursor(0),
+    newest(0),
+    step_start(0),
+    step_truncated(false),
+    undoable(0),
+    redoable(0)
+{
+    if (capacity == 0)
+    {
+        throw std::invalid_argument("A recording needs room for at least one delta");
+    }
+}
+
+std::size_t Recorder::capacity() const
+{
+    return requested;
+}
+
+void Recorder::forget_truncated()
+{
+    oldest = cursor;
+    undoable = 0;
+    step_truncated = false;
+}
+
+void Recorder::abandon()
+{
+    if (step_truncated)
+    {
+        clear();
+        return;
+    }
+
+    if (cursor != step_start)
+    {
+        // The instruction may have overwritten what could have been redone.
+        cursor = step_start;
+        newest = cursor;
+        redoable = 0;
+    }
+}
+
+void Recorder::clear()
+{
+    oldest = 0;
+    cursor = 0;
+    newest = 0;
+    step_start = 0;
+    step_truncated = false;
+    undoable = 0;
+    redoable = 0;
+}
+
+uint64_t Recorder::steps_back() const
+{
+    return undoable;
+}
+
+uint64_t Recorder::steps_forward() const
+{
+    return redoable;
+}
+
+bool Recorder::back(std::vector<Delta>& deltas)
+{
+    if (undoable == 0)
+    {
+        return false;
+    }
+
+    deltas.clear();
+    auto position = cursor - 1;
+    deltas.push_back(at(position));
+    while (position > oldest && at(position - 1).kind != Delta::Kind::Step)
+    {
+        --position;
+        deltas.push_back(at(position));
+    }
+
+    cursor = position;
+    step_start = cursor;
+    --undoable;
+    ++redoable;
+    return true;
+}
+
+bool Recorder::forward(std::vector<Delta>& deltas)
+{
+    if (redoable == 0)
+    {
+        return false;
+    }
+
+    deltas.clear();
+    auto position = cursor;
+    while (at(position).kind != Delta::Kind::Step)
+    {
+        deltas.push_back(at(position));
+        ++position;
+    }
+    deltas.push_back(at(position));
+
+    cursor = position + 1;
+    step_start = cursor;
+    ++undoable;
+    --redoable;
+    return true;
+}
+
+void Recorder::drop_oldest()
+{
+    if (oldest >= step_start)
+    {
+        // The instruction being recorded has filled the whole buffer.
+        ++oldest;
+        step_truncated = true;
+        return;
+    }
+
+    while (at(oldest).kind != Delta::Kind::Step)
+    {
+        ++oldest;
+    }
+    ++oldest;
+    --undoable;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Backend
+{
+    // Records how each instruction changed the guest, so the VM can undo
+    // and redo instructions without running them. The VM reports every
+    // memory write, push and pop, a jump if the instruction did not carry
+    // on with the next one and a halt, and then ends the instruction with where
+    // it began and the register it wrote. Most instructions take a single
+    // delta. Everything goes into a ring buffer of a fixed number of
+    // deltas; once it is full, the oldest instructions are forgotten to make
+    // room.
+    class Recorder
+    {
+    public:
+        struct Delta
+        {
+            enum class Kind : std::uint8_t
+            {
+                // Ends an instruction that began at address, and wrote the
+                // register index unless that is NoRegister.
+                Step,
+                Register,
+                Memory,
+                Push,
+                Pop,
+                // The PC went to address.
+                Jump,
+                // The guest halted, which IN and RET can do as well as HALT.
+                Halt
+            };
+
+            static const std::uint8_t NoRegister = 8;
+
+            Kind kind;
+            // The register, for Step and Register.
+            std::uint8_t index;
+            std::uint16_t address;
+            // What was there before, or the value popped.
+            std::uint16_t old_value;
+            // What is there now, or the value pushed.
+            std::uint16_t new_value;
+        };
+
+        explicit Recorder(std::size_t capacity);
+
+        // How many deltas the buffer holds at least. It is rounded up to a
+        // power of two.
+        std::size_t capacity() const;
+
+        void register_written(unsigned index, std::uint16_t old_value, std::uint16_t value)
+        {
+            append(Delta::Kind::Register, std::uint8_t(index), 0, old_value, value);
+        }
+
+        void memory_written(std::uint16_t address, std::uint16_t old_value, std::uint16_t value)
+        {
+            append(Delta::Kind::Memory, 0, address, old_value, value);
+        }
+
+        void pushed(std::uint16_t value)
+        {
+            append(Delta::Kind::Push, 0, 0, 0, value);
+        }
+
+        void popped(std::uint16_t value)
+        {
+            append(Delta::Kind::Pop, 0, 0, value, 0);
+        }
+
+        void jumped(std::uint16_t to)
+        {
+            append(Delta::Kind::Jump, 0, to, 0, 0);
+        }
+
+        void halted()
+        {
+            append(Delta::Kind::Halt, 0, 0, 0, 0);
+        }
+
+        // Ends the instruction that began at from, and wrote value to the
+        // register index unless that is NoRegister. Anything that had been
+        // undone before it is gone for good.
+        void stepped(std::uint16_t from, unsigned index, std::uint16_t old_value, std::uint16_t value)
+        {
+            append(Delta::Kind::Step, std::uint8_t(index), from, old_value, value);
+            if (step_truncated)
+            {
+                forget_truncated();
+            }
+            else
+            {
+                ++undoable;
+            }
+
+            newest = cursor;
+            step_start = cursor;
+            redoable = 0;
+        }
+
+        // Drops the deltas of an instruction that did not finish.
+        void abandon();
+
+        // Forgets everything, for when the guest changed in a way that was
+        // not recorded.
+        void clear();
+
+        // How many instructions can be undone and redone from here.
+        std::uint64_t steps_back() const;
+        std::uint64_t steps_forward() const;
+
+        // Move over one instruction, filling deltas with its changes in
+        // the order they have to be applied: last first when going back,
+        // ending with the Step either way. Return false if there is no
+        // instruction to move over.
+        bool back(std::vector<Delta>& deltas);
+        bool forward(std::vector<Delta>& deltas);
+
+    private:
+        void append(Delta::Kind kind, std::uint8_t index, std::uint16_t address,
+                std::uint16_t old_value, std::uint16_t new_value)
+        {
+            if (cursor - oldest == ring.size())
+            {
+                drop_oldest();
+            }
+
+            auto& delta = ring[cursor & mask];
+            delta.kind = kind;
+            delta.index = index;
+            delta.address = address;
+            delta.old_value = old_value;
+            delta.new_value = new_value;
+            ++cursor;
+        }
+
+        // Forgets the oldest instruction.
+        void drop_oldest();
+        // Forgets an instruction that lost deltas, and everything before it.
+        void forget_truncated();
+
+        Delta const& at(std::uint64_t position) const
+        {
+            return ring[position & mask];
+        }
+
+        std::size_t requested;
+        std::vector<Delta> ring;
+        std::uint64_t mask;
+        // Positions count every delta ever written. The buffer holds
+        // [oldest, newest); the VM's state is the one at cursor, which is
+        // past newest while an instruction is being recorded.
+        std::uint64_t oldest;
+        std::uint64_t cursor;
+        std::uint64_t newest;
+        // Where the instruction being recorded began, and whether it has
+        // already lost deltas to the buffer filling up.
+        std::uint64_t step_start;
+        bool step_truncated;
+        std::uint64_t undoable;
+        std::uint64_t redoable;
+    };
+}
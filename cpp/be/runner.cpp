@@ -0,0 +1,150 @@
+#include "runner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+using namespace Backend;
+using std::uint16_t;
+
+Runner::Runner(std::vector<uint16_t> const& program, unsigned threads) :
+    Runner(std::make_shared<ProgramImage const>(program), threads)
+{
+}
+
+Runner::Runner(std::shared_ptr<ProgramImage const> image, unsigned threads) :
+    image(image),
+    thread_count(threads),
+    shared_memory(false)
+{
+    if (thread_count == 0)
+    {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+unsigned Runner::threads() const
+{
+    return thread_count;
+}
+
+void Runner::set_configure(Configure configure)
+{
+    this->configure = configure;
+}
+
+void Runner::set_shared_memory(bool shared)
+{
+    shared_memory = shared;
+}
+
+std::vector<Runner::Result> Runner::run(std::vector<Job> const& jobs) const
+{
+    std::vector<Result> results(jobs.size());
+
+    // Workers take the next job as they finish one, so a few long jobs
+    // do not hold up the rest.
+    std::atomic<std::size_t> next(0);
+    auto worker = [&]()
+    {
+        for (auto i = next++; i < jobs.size(); i = next++)
+        {
+            results[i] = run_job(jobs[i]);
+        }
+    };
+
+    auto count = std::min<std::size_t>(thread_count, jobs.size());
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < count; ++i)
+    {
+        workers.emplace_back(worker);
+    }
+
+    // The calling thread works too.
+    worker();
+
+    for (auto& thread : workers)
+    {
+        thread.join();
+    }
+
+    return results;
+}
+
+Runner::Result Runner::run_job(Job const& job) const
+{
+    Result result;
+    result.instructions = 0;
+    result.waiting_for_input = false;
+
+    try
+    {
+        // VMs are too big for a worker's stack.
+        std::unique_ptr<VirtualMachine> vm(new VirtualMachine(*image, job.io));
+        if (shared_memory)
+        {
+            vm->share_memory(*image);
+        }
+        if (configure)
+        {
+            configure(*vm);
+        }
+
+        try
+        {
+            vm->run();
+        }
+        catch (std::exception const& ex)
+        {
+            result.error = ex.what();
+        }
+
+        result.instructions = vm->instructions_executed();
+        result.waiting_for_input = vm->waiting_for_input();
+    }
+    catch (std::exception const& ex)
+    {
+        result.error = ex.what();
+    }
+
+    return result;
+}
+
+Continuation Backend::continue_from(ProgramImage const& image, VirtualMachine::State const& state,
+        std::string const& input, Runner::Configure const& configure)
+{
+    Continuation result;
+    result.halted = true;
+
+    auto io = std::make_shared<StringIO>(input);
+    try
+    {
+        std::unique_ptr<VirtualMachine> vm(new VirtualMachine(image, io));
+        if (configure)
+        {
+            configure(*vm);
+        }
+        vm->restore_state(state);
+
+        std::string error;
+        try
+        {
+            vm->run();
+        }
+        catch (std::exception const& ex)
+        {
+            error = ex.what();
+        }
+
+        result.output = io->output() + error;
+        result.halted = !vm->is_running() || !error.empty();
+        result.state = vm->capture_state();
+    }
+    catch (std::exception const& ex)
+    {
+        result.output = io->output() + ex.what();
+    }
+
+    return result;
+}
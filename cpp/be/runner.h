@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "vm.h"
+
+namespace Backend
+{
+    // Runs one program under many inputs at once, each job on a VM of its
+    // own, spread across a pool of worker threads.
+    class Runner
+    {
+    public:
+        struct Job
+        {
+            // The job's VM does all its I/O through this, on whichever thread
+            // runs the job.
+            std::shared_ptr<GuestIO> io;
+        };
+
+        struct Result
+        {
+            std::uint64_t instructions;
+            // Whether the VM stopped for input its GuestIO did not have.
+            bool waiting_for_input;
+            // What stopped the VM if the guest failed, empty otherwise.
+            std::string error;
+        };
+
+        typedef std::function<void(VirtualMachine& vm)> Configure;
+
+        // A thread count of 0 uses one thread per hardware thread. Every VM
+        // is loaded from the same image.
+        explicit Runner(std::vector<std::uint16_t> const& program, unsigned threads = 0);
+        explicit Runner(std::shared_ptr<ProgramImage const> image, unsigned threads = 0);
+
+        unsigned threads() const;
+
+        // Called on every VM before it runs, on the VM's worker thread.
+        void set_configure(Configure configure);
+
+        // Whether VMs share the image's pages copy-on-write (see
+        // VirtualMachine::share_memory()). Off by default.
+        void set_shared_memory(bool shared);
+
+        // Runs every job and returns the results in the same order.
+        std::vector<Result> run(std::vector<Job> const& jobs) const;
+
+    private:
+        Result run_job(Job const& job) const;
+
+        std::shared_ptr<ProgramImage const> image;
+        unsigned thread_count;
+        Configure configure;
+        bool shared_memory;
+    };
+
+    // What became of a guest that was given more input.
+    struct Continuation
+    {
+        VirtualMachine::State state;
+        std::string output;
+        // The guest halted or failed, and then output ends with the error.
+        bool halted;
+    };
+
+    // Carries on a guest from state with the given input, on a VM of its own
+    // loaded from image, until it halts or wants more input.
+    Continuation continue_from(ProgramImage const& image, VirtualMachine::State const& state,
+            std::string const& input, Runner::Configure const& configure = Runner::Configure());
+}
@@ -0,0 +1,194 @@
+#include "search.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <regex>
+#include <stdexcept>
+#include <thread>
+
+using namespace Backend;
+using std::uint64_t;
+
+struct InputSearch::Checkpoint
+{
+    // Null for the start.
+    std::shared_ptr<Checkpoint const> parent;
+    std::size_t action;
+    std::size_t length;
+    // Which actions the prefix has used.
+    uint64_t used;
+    VirtualMachine::State state;
+};
+
+struct InputSearch::Task
+{
+    std::shared_ptr<Checkpoint const> from;
+    std::size_t action;
+};
+
+InputSearch::Options::Options() :
+    ordered(true),
+    min_length(0),
+    max_length(0),
+    threads(0)
+{
+}
+
+InputSearch::InputSearch(std::shared_ptr<ProgramImage const> image, Options const& options) :
+    image(image),
+    options(options),
+    thread_count(options.threads)
+{
+    if (thread_count == 0)
+    {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+InputSearch::Result InputSearch::search(VirtualMachine::State const& start) const
+{
+    auto count = options.actions.size();
+    if (count == 0 || count > 64)
+    {
+        throw std::invalid_argument("A search needs between 1 and 64 actions");
+    }
+
+    auto max_length = options.max_length == 0 ? count : std::min(options.max_length, count);
+    auto min_length = std::max<std::size_t>(options.min_length, 1);
+    if (min_length > max_length)
+    {
+        throw std::invalid_argument("The shortest sequence is longer than the longest");
+    }
+    std::regex success(options.success);
+
+    Result result;
+    result.found = false;
+    result.runs = 0;
+    result.unshared_runs = 0;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<Task> tasks;
+    // Tasks taken but not finished; none left and nothing to take means
+    // the trie has been walked.
+    unsigned busy = 0;
+    auto done = false;
+    std::exception_ptr failure;
+
+    // Pushed last first, so the first action is tried first.
+    auto add_children = [&](std::shared_ptr<Checkpoint const> const& from)
+    {
+        if (from->length == max_length)
+        {
+            return;
+        }
+
+        for (auto action = count; action-- > 0; )
+        {
+            auto taken = (from->used >> action) & 1;
+            auto in_order = options.ordered || from->length == 0 || action > from->action;
+            if (!taken && in_order)
+            {
+                tasks.push_back(Task{from, action});
+            }
+        }
+    };
+
+    auto root = std::make_shared<Checkpoint>();
+    root->action = 0;
+    root->length = 0;
+    root->used = 0;
+    root->state = start;
+    add_children(root);
+    root.reset();
+
+    auto worker = [&]()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            changed.wait(lock, [&]() { return done || !tasks.empty() || busy == 0; });
+            if (done || tasks.empty())
+            {
+                break;
+            }
+
+            auto task = std::move(tasks.back());
+            tasks.pop_back();
+            ++busy;
+            lock.unlock();
+
+            std::shared_ptr<Checkpoint> child;
+            auto matched = false;
+            Continuation outcome;
+            try
+            {
+                outcome = continue_from(*image, task.from->state, options.actions[task.action] + "\n",
+                    options.configure);
+                child = std::make_shared<Checkpoint>();
+                child->parent = task.from;
+                child->action = task.action;
+                child->length = task.from->length + 1;
+                child->used = task.from->used | (uint64_t(1) << task.action);
+                matched = child->length >= min_length && std::regex_search(outcome.output, success);
+                if (!outcome.halted)
+                {
+                    child->state = std::move(outcome.state);
+                }
+            }
+            catch (...)
+            {
+                lock.lock();
+                failure = std::current_exception();
+                done = true;
+                --busy;
+                changed.notify_all();
+                break;
+            }
+            task.from.reset();
+
+            lock.lock();
+            --busy;
+            ++result.runs;
+            if (child->length >= min_length)
+            {
+                result.unshared_runs += child->length;
+            }
+            if (matched && !done)
+            {
+                done = true;
+                result.found = true;
+                result.output = outcome.output;
+                for (std::shared_ptr<Checkpoint const> at = child; at->parent; at = at->parent)
+                {
+                    result.actions.push_back(options.actions[at->action]);
+                }
+                std::reverse(result.actions.begin(), result.actions.end());
+            }
+            else if (!outcome.halted && !done)
+            {
+                add_children(child);
+            }
+            changed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < thread_count; ++i)
+    {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers)
+    {
+        thread.join();
+    }
+
+    if (failure)
+    {
+        std::rethrow_exception(failure);
+    }
+    return result;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "runner.h"
+#include "vm.h"
+
+namespace Backend
+{
+    // Finds an order of actions that makes the guest print a success
+    // pattern, by trying them against the real program. Sequences use each
+    // action at most once: every ordering of every choice of actions, or
+    // with ordered off, every choice in the order the actions were given.
+    //
+    // Sequences that share a prefix share its work. The search walks a trie
+    // whose nodes are checkpoints of the guest after a prefix, and running
+    // one more action from a checkpoint makes a child. A checkpoint lives as
+    // long as anything below it still has to run. Idle threads take the
+    // newest child from a shared stack, so the trie is walked depth first
+    // and only a few checkpoints per level are alive at once. The search
+    // stops at the first sequence whose last action printed the pattern;
+    // with one thread, that is the first one in depth-first order.
+    class InputSearch
+    {
+    public:
+        struct Options
+        {
+            Options();
+
+            std::vector<std::string> actions;
+            bool ordered;
+            // How many actions a sequence has; max_length 0 means all of
+            // them.
+            std::size_t min_length;
+            std::size_t max_length;
+            // An ECMAScript regular expression.
+            std::string success;
+            // 0 uses one thread per hardware thread.
+            unsigned threads;
+            Runner::Configure configure;
+        };
+
+        struct Result
+        {
+            bool found;
+            // The actions, in order.
+            std::vector<std::string> actions;
+            // What the last of them printed.
+            std::string output;
+            // How many actions ran, and how many would have if every
+            // sequence tried had run from the start.
+            std::uint64_t runs;
+            std::uint64_t unshared_runs;
+        };
+
+        InputSearch(std::shared_ptr<ProgramImage const> image, Options const& options);
+
+        // Searches from a guest waiting for input. Throws
+        // std::invalid_argument for bad options.
+        Result search(VirtualMachine::State const& start) const;
+
+    private:
+        struct Checkpoint;
+        struct Task;
+
+        std::shared_ptr<ProgramImage const> image;
+        Options options;
+        unsigned thread_count;
+    };
+}
@@ -0,0 +1,99 @@
+#include "signals.h"
+
+#include "vm.h"
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+
+#include <string.h>
+
+using namespace Backend;
+
+namespace
+{
+    // Lock-free, so the handler can read it safely.
+    std::atomic<VirtualMachine*> g_target(nullptr);
+
+    void vm_signal_handler(int signum)
+    {
+        auto vm = g_target.load();
+        if (vm == nullptr)
+        {
+            return;
+        }
+
+        // Only raise flags here; the VM does the work on its own thread.
+        if (signum == SIGUSR1 && vm->profiling())
+        {
+            vm->request_profile_report();
+        }
+        else if (signum == SIGUSR1)
+        {
+            vm->request_debug_toggle();
+        }
+        else if (signum == SIGUSR2)
+        {
+            vm->request_code_7_override();
+        }
+        else if (signum == SIGHUP)
+        {
+            vm->request_snapshot();
+        }
+        else if (signum == SIGINT)
+        {
+            vm->request_stop();
+        }
+    }
+
+    void trap(int signum, char const* name, struct sigaction* previous)
+    {
+        struct sigaction act;
+        act.sa_handler = &vm_signal_handler;
+        bzero(&act.sa_mask, sizeof(act.sa_mask));
+        act.sa_flags = 0;
+
+        if (sigaction(signum, &act, previous) < 0)
+        {
+            throw std::runtime_error(std::string("Could not trap ") + name + ": sigaction retval < 0");
+        }
+    }
+}
+
+SignalRouter::SignalRouter(VirtualMachine& vm, bool interrupt) :
+    interrupt(interrupt)
+{
+    VirtualMachine* expected = nullptr;
+    if (!g_target.compare_exchange_strong(expected, &vm))
+    {
+        throw std::logic_error("Signals are already routed to another VM");
+    }
+
+    try
+    {
+        trap(SIGUSR1, "SIGUSR1", &previous_usr1);
+        trap(SIGUSR2, "SIGUSR2", &previous_usr2);
+        trap(SIGHUP, "SIGHUP", &previous_hup);
+        if (interrupt)
+        {
+            trap(SIGINT, "SIGINT", &previous_int);
+        }
+    }
+    catch (...)
+    {
+        g_target = nullptr;
+        throw;
+    }
+}
+
+SignalRouter::~SignalRouter()
+{
+    sigaction(SIGUSR1, &previous_usr1, nullptr);
+    sigaction(SIGUSR2, &previous_usr2, nullptr);
+    sigaction(SIGHUP, &previous_hup, nullptr);
+    if (interrupt)
+    {
+        sigaction(SIGINT, &previous_int, nullptr);
+    }
+    g_target = nullptr;
+}
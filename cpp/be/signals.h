@@ -0,0 +1,31 @@
+#pragma once
+
+#include <signal.h>
+
+namespace Backend
+{
+    class VirtualMachine;
+
+    // Routes signals to one VM for as long as the router exists:
+    // SIGUSR1 toggles debugging, or asks for a profile report while the VM
+    // is profiling; SIGUSR2 asks for the code 7 override; SIGHUP asks for a
+    // snapshot; and, if interrupt is set, SIGINT stops the guest as a
+    // breakpoint would. Signal handlers belong to the whole process, so only
+    // one router can exist at a time.
+    class SignalRouter
+    {
+    public:
+        explicit SignalRouter(VirtualMachine& vm, bool interrupt = false);
+        ~SignalRouter();
+
+        SignalRouter(SignalRouter const&) = delete;
+        SignalRouter& operator=(SignalRouter const&) = delete;
+
+    private:
+        struct sigaction previous_usr1;
+        struct sigaction previous_usr2;
+        struct sigaction previous_hup;
+        bool interrupt;
+        struct sigaction previous_int;
+    };
+}
@@ -0,0 +1,267 @@
+#include "vm.h"
+
+#include "fd.h"
+#include "jit.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Backend;
+using std::uint16_t;
+
+namespace
+{
+    void write_all(int fd, void const* data, std::size_t size, std::string const& path)
+    {
+        auto bytes = static_cast<char const*>(data);
+        while (size > 0)
+        {
+            auto count = write(fd, bytes, size);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::runtime_error("Could not write snapshot " + path + ": " + strerror(errno));
+            }
+            bytes += count;
+            size -= std::size_t(count);
+        }
+    }
+}
+
+void VirtualMachine::save_snapshot(std::string const& path) const
+{
+    write_snapshot(path, program_counter);
+}
+
+void VirtualMachine::write_snapshot(std::string const& path, uint16_t pc) const
+{
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, SnapshotMagic, sizeof(header.magic));
+    header.version = SnapshotHeader::CurrentVersion;
+    header.byte_order = SnapshotHeader::ByteOrderMark;
+    header.stack_depth = std::uint32_t(stack.size());
+    header.program_counter = pc;
+    header.running = running ? 1 : 0;
+    std::copy(registers.begin(), registers.end(), header.registers);
+
+    // Write to a temporary file first, so an interrupted save never leaves
+    // a truncated snapshot behind.
+    auto temp_path = path + ".tmp";
+    {
+        FileDescriptor fd(open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        if (fd.get() < 0)
+        {
+            throw std::runtime_error("Could not create snapshot " + temp_path + ": " + strerror(errno));
+        }
+
+        write_all(fd.get(), &header, sizeof(header), temp_path);
+        write_all(fd.get(), memory.data(), memory.size() * sizeof(uint16_t), temp_path);
+        write_all(fd.get(), stack.data(), stack.size() * sizeof(uint16_t), temp_path);
+    }
+
+    if (rename(temp_path.c_str(), path.c_str()) < 0)
+    {
+        throw std::runtime_error("Could not rename snapshot to " + path + ": " + strerror(errno));
+    }
+}
+
+void VirtualMachine::restore_snapshot(std::string const& path)
+{
+    FileDescriptor fd(open(path.c_str(), O_RDONLY));
+    if (fd.get() < 0)
+    {
+        throw std::runtime_error("Could not open snapshot " + path + ": " + strerror(errno));
+    }
+
+    struct stat info;
+    if (fstat(fd.get(), &info) < 0)
+    {
+        throw std::runtime_error("Could not stat snapshot " + path + ": " + strerror(errno));
+    }
+
+    auto file_size = std::size_t(info.st_size);
+    auto fixed_size = sizeof(SnapshotHeader) + memory.size() * sizeof(uint16_t);
+    if (file_size < fixed_size)
+    {
+        throw std::runtime_error("Snapshot " + path + " is truncated");
+    }
+
+    auto mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+    if (mapping == MAP_FAILED)
+    {
+        throw std::runtime_error("Could not map snapshot " + path + ": " + strerror(errno));
+    }
+
+    auto base = static_cast<char const*>(mapping);
+    auto header = reinterpret_cast<SnapshotHeader const*>(base);
+    auto mem = reinterpret_cast<uint16_t const*>(base + sizeof(SnapshotHeader));
+    auto stack_words = mem + memory.size();
+
+    std::string problem;
+    if (std::memcmp(header->magic, SnapshotMagic, sizeof(header->magic)) != 0)
+    {
+        problem = "is not a snapshot";
+    }
+    else if (header->byte_order != SnapshotHeader::ByteOrderMark)
+    {
+        problem = "was written on a host with a different byte order";
+    }
+    else if (header->version != SnapshotHeader::CurrentVersion)
+    {
+        problem = "has unsupported version " + std::to_string(header->version);
+    }
+    else if (file_size != fixed_size + header->stack_depth * sizeof(uint16_t))
+    {
+        problem = "has the wrong size for its stack depth";
+    }
+    else if (std::any_of(header->registers, header->registers + registers.size(),
+            [](uint16_t value) { return value > 32767; }))
+    {
+        problem = "holds an invalid register value";
+    }
+    else if (header->program_counter > 0x7fff)
+    {
+        problem = "holds an invalid program counter";
+    }
+
+    if (problem.empty())
+    {
+        try
+        {
+            std::array<uint16_t, 8> values;
+            std::copy(header->registers, header->registers + values.size(), values.begin());
+            replace_state(mem, values, stack_words, header->stack_depth, header->program_counter,
+                    header->running != 0);
+        }
+        catch (std::exception const& ex)
+        {
+            problem = std::string("does not fit: ") + ex.what();
+        }
+    }
+
+    munmap(mapping, file_size);
+
+    if (!problem.empty())
+    {
+        throw std::runtime_error("Snapshot " + path + " " + problem);
+    }
+}
+
+VirtualMachine::State VirtualMachine::capture_state() const
+{
+    State state;
+    state.memory.assign(memory.begin(), memory.end());
+    state.registers = registers;
+    state.stack.assign(stack.data(), stack.data() + stack.size());
+    state.program_counter = program_counter;
+    state.running = running;
+    return state;
+}
+
+void VirtualMachine::restore_state(State const& state)
+{
+    if (state.memory.size() != memory.size())
+    {
+        throw std::invalid_argument("The state has the wrong amount of memory");
+    }
+
+    replace_state(state.memory.data(), state.registers, state.stack.data(), state.stack.size(),
+            state.program_counter, state.running);
+}
+
+void VirtualMachine::replace_state(uint16_t const* words, std::array<uint16_t, 8> const& values,
+        uint16_t const* stack_words, std::size_t depth, uint16_t pc, bool is_running)
+{
+    // Nothing changes until the stack is known to fit. The limit is only
+    // checked as the stack grows, and it may already have room.
+    if (stack.limit() != GuestStack::Unlimited && depth > stack.limit())
+    {
+        throw std::overflow_error("Stack overflow: the guest stack is limited to " +
+                std::to_string(stack.limit()) + " entries");
+    }
+    auto replacement = stack;
+    replacement.assign(stack_words, depth);
+
+    stack = std::move(replacement);
+    memory.assign(words);
+    registers = values;
+    program_counter = pc;
+    running = is_running;
+    suspended = false;
+    stop.reason = Stop::Reason::None;
+    input_pos = 0;
+    input_end = 0;
+
+    memory_replaced();
+}
+
+void VirtualMachine::share_memory(ProgramImage const& image)
+{
+    // Memory keeps its contents, so nothing derived from it changes.
+    memory.share(image.map_memory());
+}
+
+void VirtualMachine::memory_replaced()
+{
+    // Nothing decoded or translated from the old memory is valid now.
+    clear_decoded();
+    if (jit)
+    {
+        jit->flush();
+    }
+    if (recorder)
+    {
+        recorder->clear();
+    }
+    if (memo)
+    {
+        memo->reset();
+    }
+    check_native_blocks();
+}
+
+void VirtualMachine::set_snapshot_path(std::string const& path)
+{
+    snapshot_path = path;
+}
+
+void VirtualMachine::set_snapshot_line(std::uint64_t line)
+{
+    snapshot_line = line;
+}
+
+void VirtualMachine::request_snapshot()
+{
+    snapshot_requested = true;
+}
+
+void VirtualMachine::save_requested_snapshot()
+{
+    snapshot_requested = false;
+    snapshot_line = NoSnapshotLine;
+
+    if (snapshot_path.empty())
+    {
+        std::cerr << "Snapshot requested, but no snapshot path is set" << std::endl;
+        return;
+    }
+
+    // This runs inside IN, after the PC has moved past it. Restoring must
+    // run the IN again, so the snapshot points at it.
+    write_snapshot(snapshot_path, uint16_t(program_counter - 2));
+    std::cerr << "Saved snapshot to " << snapshot_path << " before input line " << input_lines << std::endl;
+}
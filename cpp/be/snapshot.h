@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+
+namespace Backend
+{
+    // On-disk layout of a VM snapshot. The header is followed by the whole
+    // of guest memory (0x8000 words) and then by the stack, bottom first.
+    // Everything is stored in host byte order at fixed offsets, so a mapped
+    // snapshot can be used in place.
+    struct SnapshotHeader
+    {
+        static const std::uint32_t CurrentVersion = 1;
+        static const std::uint32_t ByteOrderMark = 0x01020304;
+
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;
+        std::uint32_t stack_depth;
+        std::uint16_t program_counter;
+        std::uint16_t running;
+        std::uint16_t registers[8];
+        std::uint8_t reserved[24];
+    };
+
+    static_assert(sizeof(SnapshotHeader) == 64, "SnapshotHeader must stay 64 bytes");
+
+    const char SnapshotMagic[8] = { 'S', 'Y', 'N', 'S', 'N', 'A', 'P', '\0' };
+}
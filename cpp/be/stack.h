@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Backend
+{
+    // The guest stack: one contiguous block of words that grows
+    // geometrically up to an optional maximum depth.
+    class GuestStack
+    {
+    public:
+        static const std::size_t DefaultCapacity = 4096;
+        static const std::size_t Unlimited = 0;
+
+        GuestStack() :
+            words(DefaultCapacity),
+            depth(0),
+            max_depth(Unlimited),
+            high_water(0)
+        {
+        }
+
+        bool empty() const
+        {
+            return depth == 0;
+        }
+
+        std::size_t size() const
+        {
+            return depth;
+        }
+
+        std::uint16_t top() const
+        {
+            return words[depth - 1];
+        }
+
+        // Throws std::overflow_error if the stack is at its maximum depth.
+        void push(std::uint16_t value)
+        {
+            if (!try_push(value))
+            {
+                throw std::overflow_error("Stack overflow: the guest stack is limited to " +
+                        std::to_string(max_depth) + " entries");
+            }
+        }
+
+        // Returns false instead of throwing if the stack is full.
+        bool try_push(std::uint16_t value)
+        {
+            if (depth == words.size() && !grow())
+            {
+                return false;
+            }
+
+            words[depth++] = value;
+            if (depth > high_water)
+            {
+                high_water = depth;
+            }
+
+            return true;
+        }
+
+        void pop()
+        {
+            --depth;
+        }
+
+        void clear()
+        {
+            depth = 0;
+        }
+
+        // The entries from the bottom of the stack up.
+        std::uint16_t const* data() const
+        {
+            return words.data();
+        }
+
+        // Replaces the contents with count entries, bottom first. Throws
+        // std::overflow_error if they do not fit under the limit.
+        void assign(std::uint16_t const* values, std::size_t count)
+        {
+            clear();
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                push(values[i]);
+            }
+        }
+
+        // For code that pushes and pops in place: the words, and how many fit
+        // before the stack has to grow. Such code then hands back the depth
+        // and the deepest it went.
+        std::uint16_t* buffer()
+        {
+            return words.data();
+        }
+
+        std::size_t capacity() const
+        {
+            return words.size();
+        }
+
+        void set_size(std::size_t size, std::size_t deepest)
+        {
+            depth = size;
+            if (deepest > high_water)
+            {
+                high_water = deepest;
+            }
+        }
+
+        std::size_t limit() const
+        {
+            return max_depth;
+        }
+
+        // A limit of Unlimited lets the stack grow until allocation fails.
+        // Entries already above a new, lower limit stay where they are.
+        void set_limit(std::size_t limit)
+        {
+            max_depth = limit;
+
+            // The limit is only checked when the stack grows, so drop any
+            // capacity beyond it.
+            if (max_depth != Unlimited && words.size() > max_depth)
+            {
+                words.resize(depth > max_depth ? depth : max_depth);
+            }
+        }
+
+        // The deepest the stack has been since it was created.
+        std::size_t high_water_mark() const
+        {
+            return high_water;
+        }
+
+    private:
+        bool grow()
+        {
+            if (max_depth != Unlimited && words.size() >= max_depth)
+            {
+                return false;
+            }
+
+            auto capacity = words.size() * 2;
+            if (max_depth != Unlimited && capacity > max_depth)
+            {
+                capacity = max_depth;
+            }
+
+            words.resize(capacity);
+            return true;
+        }
+
+        std::vector<std::uint16_t> words;
+        std::size_t depth;
+        std::size_t max_depth;
+        std::size_t high_water;
+    };
+}
@@ -1,312 +1,2005 @@
 #include "vm.h"
 
+#include "intrinsics.h"
+#include "jit.h"
+
 #include <cassert>
 #include <cstdio>
 #include <algorithm>
-#include <iomanip>
 #include <iostream>
 #include <stdexcept>
 
-#include <signal.h>
-#include <string.h>
-#include <sys/select.h>
+#define CALL_MEMBER_FN(object,ptrToMember)  ((object)->*(ptrToMember))
+
+// Handlers are still reachable through the instruction table, but the switch
+// engine calls them directly and needs them expanded in place.
+#if defined(__GNUC__)
+#define VM_HANDLER inline __attribute__((always_inline))
+#else
+#define VM_HANDLER inline
+#endif
+
+// The eight register masks of one opcode's verified handlers, in the order
+// handlerTable stores them.
+#define VERIFIED_HANDLERS(op) \
+    &VirtualMachine::verified_fn<op, 0>, &VirtualMachine::verified_fn<op, 1>, \
+    &VirtualMachine::verified_fn<op, 2>, &VirtualMachine::verified_fn<op, 3>, \
+    &VirtualMachine::verified_fn<op, 4>, &VirtualMachine::verified_fn<op, 5>, \
+    &VirtualMachine::verified_fn<op, 6>, &VirtualMachine::verified_fn<op, 7>
+
+#define VERIFIED_CASES(op) \
+    case VerifiedHandlers + op * 8 + 0: running = verified_fn<op, 0>(); break; \
+    case VerifiedHandlers + op * 8 + 1: running = verified_fn<op, 1>(); break; \
+    case VerifiedHandlers + op * 8 + 2: running = verified_fn<op, 2>(); break; \
+    case VerifiedHandlers + op * 8 + 3: running = verified_fn<op, 3>(); break; \
+    case VerifiedHandlers + op * 8 + 4: running = verified_fn<op, 4>(); break; \
+    case VerifiedHandlers + op * 8 + 5: running = verified_fn<op, 5>(); break; \
+    case VerifiedHandlers + op * 8 + 6: running = verified_fn<op, 6>(); break; \
+    case VerifiedHandlers + op * 8 + 7: running = verified_fn<op, 7>(); break
+
+// Likewise for the compare-and-branch handlers of one pair of opcodes. Bit 0
+// of Registers is the compare's destination, which is always a register.
+#define COMPARE_BRANCH_HANDLERS(cmp, branch) \
+    &VirtualMachine::compare_branch_fn<cmp, branch, 1>,  &VirtualMachine::compare_branch_fn<cmp, branch, 3>, \
+    &VirtualMachine::compare_branch_fn<cmp, branch, 5>,  &VirtualMachine::compare_branch_fn<cmp, branch, 7>, \
+    &VirtualMachine::compare_branch_fn<cmp, branch, 9>,  &VirtualMachine::compare_branch_fn<cmp, branch, 11>, \
+    &VirtualMachine::compare_branch_fn<cmp, branch, 13>, &VirtualMachine::compare_branch_fn<cmp, branch, 15>
+
+#define COMPARE_BRANCH_CASES(cmp, branch) \
+    case CompareBranchHandlers + ((cmp - 4) * 2 + branch - 7) * 8 + 0: running = compare_branch_fn<cmp, branch, 1>(); break; \
+    case CompareBranchHandlers + ((cmp - 4) * 2 + branch - 7) * 8 + 1: running = compare_branch_fn<cmp, branch, 3>(); break; \
+    case CompareBranchHandlers + ((cmp - 4) * 2 + branch - 7) * 8 + 2: running = compare_branch_fn<cmp, branch, 5>(); break; \
+    case CompareBranchHandlers + ((cmp - 4) * 2 + branch - 7) * 8 + 3: running = compare_branch_fn<cmp, branch, 7>(); break; \
+    case CompareBranchHandlers + ((cmp - 4) * 2 + branch - 7) * 8 + 4: running = compare_branch_fn<cmp, branch, 9>(); break; \
+    case CompareBranchHandlers + ((cmp - 4) * 2 + branch - 7) * 8 + 5: running = compare_branch_fn<cmp, branch, 11>(); break; \
+    case CompareBranchHandlers + ((cmp - 4) * 2 + branch - 7) * 8 + 6: running = compare_branch_fn<cmp, branch, 13>(); break; \
+    case CompareBranchHandlers + ((cmp - 4) * 2 + branch - 7) * 8 + 7: running = compare_branch_fn<cmp, branch, 15>(); break
+
+using namespace Backend;
+using std::uint16_t;
+
+// Passed by reference to std::vector::assign, so it needs a definition.
+const uint16_t VirtualMachine::NoNativeBlock;
+
+VirtualMachine::VirtualMachine(std::vector<uint16_t> const& init_mem, std::shared_ptr<GuestIO> io) :
+    VirtualMachine(init_mem.data(), init_mem.size(), io)
+{
+}
+
+VirtualMachine::VirtualMachine(ProgramImage const& image, std::shared_ptr<GuestIO> io) :
+    VirtualMachine(image.data(), image.size(), io)
+{
+}
+
+VirtualMachine::VirtualMachine(uint16_t const* program, std::size_t size, std::shared_ptr<GuestIO> io) :
+    running(true),
+    paused(false),
+    active_engine(Engine::Classic),
+    instruction_count(0),
+    arguments(nullptr),
+    verified(false),
+    fusion(false),
+    fusion_active(false),
+    fused_words(0x8000),
+    program_counter(0),
+    guest_io(io ? io : std::make_shared<ConsoleIO>()),
+    suspended(false),
+    output_limit(4096),
+    debug_mode(false),
+    profile_enabled(false),
+    requests_pending(0),
+    profile_report_requested(0),
+    debug_toggle_requested(0),
+    override_requested(0),
+    stop_requested(0),
+    next_watch(1),
+    ignore_stops(false),
+    native_program(nullptr),
+    input_buffer(4096),
+    input_pos(0),
+    input_end(0),
+    input_lines(0),
+    snapshot_line(NoSnapshotLine),
+    snapshot_requested(0)
+{
+    if (size > memory.size())
+    {
+        throw std::out_of_range("The program does not fit in memory");
+    }
+
+    registers.fill(0);
+    // The rest of memory starts out zeroed.
+    std::copy(program, program + size, memory.begin());
+
+    add_instruction(0,  "HALT", 0, false, &VirtualMachine::halt_fn);
+    add_instruction(1,  "SET",  2, true,  &VirtualMachine::set_fn);
+    add_instruction(2,  "PUSH", 1, false, &VirtualMachine::push_fn);
+    add_instruction(3,  "POP",  1, true,  &VirtualMachine::pop_fn);
+    add_instruction(4,  "EQ",   3, true,  &VirtualMachine::eq_fn);
+    add_instruction(5,  "GT",   3, true,  &VirtualMachine::gt_fn);
+    add_instruction(6,  "JMP",  1, false, &VirtualMachine::jmp_fn);
+    add_instruction(7,  "JT",   2, false, &VirtualMachine::jt_fn);
+    add_instruction(8,  "JF",   2, false, &VirtualMachine::jf_fn);
+    add_instruction(9,  "ADD",  3, true,  &VirtualMachine::add_fn);
+    add_instruction(10, "MULT", 3, true,  &VirtualMachine::mult_fn);
+    add_instruction(11, "MOD",  3, true,  &VirtualMachine::mod_fn);
+    add_instruction(12, "AND",  3, true,  &VirtualMachine::and_fn);
+    add_instruction(13, "OR",   3, true,  &VirtualMachine::or_fn);
+    add_instruction(14, "NOT",  2, true,  &VirtualMachine::not_fn);
+    add_instruction(15, "RMEM", 2, true,  &VirtualMachine::rmem_fn);
+    add_instruction(16, "WMEM", 2, false, &VirtualMachine::wmem_fn);
+    add_instruction(17, "CALL", 1, false, &VirtualMachine::call_fn);
+    add_instruction(18, "RET",  0, false, &VirtualMachine::ret_fn);
+    add_instruction(19, "OUT",  1, false, &VirtualMachine::out_fn);
+    add_instruction(20, "IN",   1, true,  &VirtualMachine::in_fn);
+    add_instruction(21, "NOOP", 0, false, &VirtualMachine::nop_fn);
+
+    register_writers = 0;
+    for (auto const& inst : instructionTable)
+    {
+        if (inst.writesRegister)
+        {
+            register_writers |= 1u << inst.opcode;
+        }
+    }
+
+    InstructionFn verifiedHandlers[] = {
+        VERIFIED_HANDLERS(0),  VERIFIED_HANDLERS(1),  VERIFIED_HANDLERS(2),
+        VERIFIED_HANDLERS(3),  VERIFIED_HANDLERS(4),  VERIFIED_HANDLERS(5),
+        VERIFIED_HANDLERS(6),  VERIFIED_HANDLERS(7),  VERIFIED_HANDLERS(8),
+        VERIFIED_HANDLERS(9),  VERIFIED_HANDLERS(10), VERIFIED_HANDLERS(11),
+        VERIFIED_HANDLERS(12), VERIFIED_HANDLERS(13), VERIFIED_HANDLERS(14),
+        VERIFIED_HANDLERS(15), VERIFIED_HANDLERS(16), VERIFIED_HANDLERS(17),
+        VERIFIED_HANDLERS(18), VERIFIED_HANDLERS(19), VERIFIED_HANDLERS(20),
+        VERIFIED_HANDLERS(21)
+    };
+    assert(handlerTable.size() == VerifiedHandlers);
+    handlerTable.insert(handlerTable.end(), std::begin(verifiedHandlers), std::end(verifiedHandlers));
+
+    InstructionFn fusedHandlers[] = {
+        COMPARE_BRANCH_HANDLERS(4, 7), COMPARE_BRANCH_HANDLERS(4, 8),
+        COMPARE_BRANCH_HANDLERS(5, 7), COMPARE_BRANCH_HANDLERS(5, 8),
+        &VirtualMachine::add_read_fn<1>, &VirtualMachine::add_read_fn<3>,
+        &VirtualMachine::add_read_fn<5>, &VirtualMachine::add_read_fn<7>,
+        &VirtualMachine::call_prologue_fn<0>, &VirtualMachine::call_prologue_fn<1>,
+        &VirtualMachine::call_prologue_fn<2>, &VirtualMachine::call_prologue_fn<3>,
+        &VirtualMachine::call_prologue_fn<4>, &VirtualMachine::call_prologue_fn<5>,
+        &VirtualMachine::call_prologue_fn<6>, &VirtualMachine::call_prologue_fn<7>,
+        &VirtualMachine::out_run_fn
+    };
+    assert(handlerTable.size() == CompareBranchHandlers);
+    handlerTable.insert(handlerTable.end(), std::begin(fusedHandlers), std::end(fusedHandlers));
+
+    assert(handlerTable.size() == BreakpointHandler);
+    handlerTable.push_back(&VirtualMachine::breakpoint_fn);
+    handlerTable.push_back(&VirtualMachine::watched_rmem_fn);
+    handlerTable.push_back(&VirtualMachine::watched_wmem_fn);
+
+    stop.reason = Stop::Reason::None;
+    stop.address = 0;
+
+    fusion_runs.fill(0);
+    fusion_instructions.fill(0);
+    clear_decoded();
+
+    output_buffer.reserve(output_limit);
+
+}
+
+VirtualMachine::~VirtualMachine()
+{
+    try
+    {
+        flush_output();
+        write_input_log();
+    }
+    catch (...)
+    {
+    }
+}
+
+void VirtualMachine::run()
+{
+    if (!running)
+    {
+        throw std::logic_error("The VM is halted");
+    }
+
+    suspended = false;
+    auto resuming = stop.reason != Stop::Reason::None;
+    stop.reason = Stop::Reason::None;
+
+    try
+    {
+        if (resuming)
+        {
+            // Whatever stopped the guest must not stop it again.
+            step_instruction();
+        }
+
+        if (!suspended && stop.reason == Stop::Reason::None)
+        {
+            do
+            {
+                if (paused)
+                {
+                    paused = false;
+                    running = true;
+                }
+
+                serve_requests();
+                dispatch();
+            }
+            while (paused);
+        }
+
+        if (suspended || stop.reason != Stop::Reason::None)
+        {
+            running = true;
+        }
+    }
+    catch (...)
+    {
+        // Whatever the guest printed before the error still belongs in
+        // front of it.
+        flush_output();
+        throw;
+    }
+
+    flush_output();
+}
+
+void VirtualMachine::dispatch()
+{
+    // A fused sequence would hide its instructions from the profile, the
+    // memoizer, the recorder and the debug dump.
+    auto fuse = fusion && verified && !debug_mode && !memo && !recorder && !profile_enabled;
+    if (fuse != fusion_active)
+    {
+        fusion_active = fuse;
+        clear_decoded();
+    }
+
+    if (debug_mode)
+    {
+        run_debug();
+        return;
+    }
+
+    if (memo || recorder)
+    {
+        run_watched();
+        return;
+    }
+
+    switch (active_engine)
+    {
+        case Engine::Switch:
+            profile_enabled ? run_switch<true>() : run_switch<false>();
+            break;
+        case Engine::Jit:
+            // Translated blocks cannot count individual instructions, or
+            // stop at breakpoints.
+            profile_enabled ? run_switch<true>() : (break_at.empty() && watches.empty()) ? run_jit() : run_switch<false>();
+            break;
+        case Engine::Native:
+            profile_enabled ? run_switch<true>() : (break_at.empty() && watches.empty()) ? run_native() : run_switch<false>();
+            break;
+        default:
+            profile_enabled ? run_classic<true>() : run_classic<false>();
+    }
+}
+
+void VirtualMachine::serve_requests()
+{
+    requests_pending = 0;
+
+    if (debug_toggle_requested)
+    {
+        debug_toggle_requested = 0;
+        if (debug_mode)
+        {
+            stop_debugging();
+        }
+        else
+        {
+            start_debugging();
+        }
+    }
+
+    if (override_requested)
+    {
+        override_requested = 0;
+        code_7_override();
+    }
+
+    if (stop_requested)
+    {
+        stop_requested = 0;
+        if (running)
+        {
+            stop.reason = Stop::Reason::Request;
+            stop.address = program_counter;
+            running = false;
+        }
+    }
+
+    if (profile_report_requested)
+    {
+        profile_report_requested = 0;
+        if (profile_data)
+        {
+            report_profile(std::cerr);
+        }
+    }
+}
+
+bool VirtualMachine::is_running() const
+{
+    return running;
+}
+
+bool VirtualMachine::waiting_for_input() const
+{
+    return suspended;
+}
+
+GuestIO& VirtualMachine::io() const
+{
+    return *guest_io;
+}
+
+std::uint64_t VirtualMachine::instructions_executed() const
+{
+    return instruction_count;
+}
+
+VirtualMachine::Engine VirtualMachine::engine() const
+{
+    return active_engine;
+}
+
+void VirtualMachine::set_engine(Engine engine)
+{
+#if !defined(__x86_64__)
+    if (engine == Engine::Jit)
+    {
+        throw std::runtime_error("The JIT engine needs an x86-64 host");
+    }
+#endif
+
+    active_engine = engine;
+}
+
+std::size_t VirtualMachine::stack_limit() const
+{
+    return stack.limit();
+}
+
+void VirtualMachine::set_stack_limit(std::size_t max_depth)
+{
+    stack.set_limit(max_depth);
+}
+
+std::size_t VirtualMachine::stack_high_water_mark() const
+{
+    return stack.high_water_mark();
+}
+
+std::size_t VirtualMachine::output_buffer_size() const
+{
+    return output_limit;
+}
+
+void VirtualMachine::set_output_buffer_size(std::size_t size)
+{
+    output_limit = size;
+    if (output_buffer.size() >= output_limit)
+    {
+        flush_output();
+    }
+}
+
+void VirtualMachine::flush_output()
+{
+    if (output_buffer.empty())
+    {
+        return;
+    }
+
+    // Output that fails to write is still consumed, so it is never
+    // delivered twice.
+    try
+    {
+        guest_io->write(output_buffer.data(), output_buffer.size());
+    }
+    catch (...)
+    {
+        output_buffer.clear();
+        throw;
+    }
+
+    output_buffer.clear();
+}
+
+void VirtualMachine::set_input_log_path(std::string const& path)
+{
+    write_input_log();
+    input_log.close();
+    input_log_path = path;
+}
+
+bool VirtualMachine::verified_mode() const
+{
+    return verified;
+}
+
+void VirtualMachine::set_verified_mode(bool verified)
+{
+    this->verified = verified;
+
+    // Everything decoded so far was decoded for the other mode.
+    clear_decoded();
+}
+
+template <bool Profiled>
+inline void VirtualMachine::step()
+{
+    auto address = program_counter;
+    auto const& decoded = decode(address);
+    arguments = decoded.args.data();
+    program_counter += decoded.length;
+    ++instruction_count;
+
+    if (Profiled)
+    {
+        profile_data->record(address, decoded.opcode);
+        auto next = program_counter;
+        running = CALL_MEMBER_FN(this, handlerTable[decoded.handler])();
+        if (program_counter != next && !suspended && stop.reason == Stop::Reason::None)
+        {
+            profile_data->record_taken(address);
+        }
+        return;
+    }
+
+    running = CALL_MEMBER_FN(this, handlerTable[decoded.handler])();
+}
+
+template <bool Profiled>
+void VirtualMachine::run_classic()
+{
+    while (running)
+    {
+        step<Profiled>();
+    }
+}
+
+template <bool Profiled>
+void VirtualMachine::run_switch()
+{
+    // The handlers are called directly rather than through the instruction
+    // table, so the compiler can inline every one of them into this loop.
+    // Only HALT, IN and the jumps can stop the loop, so only their results
+    // are checked.
+    auto profile = profile_data.get();
+    while (running)
+    {
+        auto address = program_counter;
+        auto const& decoded = decode(address);
+        arguments = decoded.args.data();
+        program_counter += decoded.length;
+        ++instruction_count;
+
+        auto next = program_counter;
+        if (Profiled)
+        {
+            profile->record(address, decoded.opcode);
+        }
+
+        switch (decoded.handler)
+        {
+            case 0:  running = halt_fn(); break;
+            case 1:  set_fn();  break;
+            case 2:  push_fn(); break;
+            case 3:  pop_fn();  break;
+            case 4:  eq_fn();   break;
+            case 5:  gt_fn();   break;
+            case 6:  running = jmp_fn(); break;
+            case 7:  running = jt_fn();  break;
+            case 8:  running = jf_fn();  break;
+            case 9:  add_fn();  break;
+            case 10: mult_fn(); break;
+            case 11: mod_fn();  break;
+            case 12: and_fn();  break;
+            case 13: or_fn();   break;
+            case 14: not_fn();  break;
+            case 15: rmem_fn(); break;
+            case 16: wmem_fn(); break;
+            case 17: running = call_fn(); break;
+            case 18: running = ret_fn(); break;
+            case 19: out_fn();  break;
+            case 20: running = in_fn(); break;
+            case 21: nop_fn();  break;
+            VERIFIED_CASES(0);  VERIFIED_CASES(1);  VERIFIED_CASES(2);
+            VERIFIED_CASES(3);  VERIFIED_CASES(4);  VERIFIED_CASES(5);
+            VERIFIED_CASES(6);  VERIFIED_CASES(7);  VERIFIED_CASES(8);
+            VERIFIED_CASES(9);  VERIFIED_CASES(10); VERIFIED_CASES(11);
+            VERIFIED_CASES(12); VERIFIED_CASES(13); VERIFIED_CASES(14);
+            VERIFIED_CASES(15); VERIFIED_CASES(16); VERIFIED_CASES(17);
+            VERIFIED_CASES(18); VERIFIED_CASES(19); VERIFIED_CASES(20);
+            VERIFIED_CASES(21);
+            COMPARE_BRANCH_CASES(4, 7); COMPARE_BRANCH_CASES(4, 8);
+            COMPARE_BRANCH_CASES(5, 7); COMPARE_BRANCH_CASES(5, 8);
+            case AddReadHandlers + 0: add_read_fn<1>(); break;
+            case AddReadHandlers + 1: add_read_fn<3>(); break;
+            case AddReadHandlers + 2: add_read_fn<5>(); break;
+            case AddReadHandlers + 3: add_read_fn<7>(); break;
+            case CallPrologueHandlers + 0: running = call_prologue_fn<0>(); break;
+            case CallPrologueHandlers + 1: running = call_prologue_fn<1>(); break;
+            case CallPrologueHandlers + 2: running = call_prologue_fn<2>(); break;
+            case CallPrologueHandlers + 3: running = call_prologue_fn<3>(); break;
+            case CallPrologueHandlers + 4: running = call_prologue_fn<4>(); break;
+            case CallPrologueHandlers + 5: running = call_prologue_fn<5>(); break;
+            case CallPrologueHandlers + 6: running = call_prologue_fn<6>(); break;
+            case CallPrologueHandlers + 7: running = call_prologue_fn<7>(); break;
+            case OutRunHandler: out_run_fn(); break;
+            case BreakpointHandler: running = breakpoint_fn(); break;
+            case WatchedReadHandler: running = watched_rmem_fn(); break;
+            case WatchedWriteHandler: running = watched_wmem_fn(); break;
+        }
+
+        if (Profiled && program_counter != next && !suspended && stop.reason == Stop::Reason::None)
+        {
+            profile->record_taken(address);
+        }
+    }
+}
+
+void VirtualMachine::run_jit()
+{
+#if defined(__x86_64__)
+    if (!jit)
+    {
+        jit.reset(new Jit());
+    }
+
+    JitFrame frame;
+    frame.registers = registers.data();
+    frame.requests = &requests_pending;
+    frame.vm = this;
+    frame.write = &VirtualMachine::jit_write;
+
+    jit->set_translate_calls(intrinsics.empty());
+
+    while (running)
+    {
+        // Anything outside guest memory goes through the interpreter, which
+        // throws as usual.
+        if (program_counter >= memory.size())
+        {
+            step<false>();
+            continue;
+        }
+
+        auto block = jit->block_at(program_counter, memory);
+        if (block == nullptr)
+        {
+            step<false>();
+            continue;
+        }
+
+        // The interpreter may have moved memory or grown the stack since
+        // the last block ran.
+        frame.memory = memory.data();
+        frame.entries = jit->entry_table();
+        frame.stack = stack.buffer();
+        frame.depth = stack.size();
+        frame.capacity = stack.capacity();
+        frame.high_water = stack.high_water_mark();
+        frame.instructions = 0;
+
+        auto result = jit->run(frame, block);
+        stack.set_size(std::size_t(frame.depth), std::size_t(frame.high_water));
+        program_counter = uint16_t(result & 0xffff);
+        instruction_count += frame.instructions;
+        switch (Jit::Exit(result >> 16))
+        {
+            case Jit::Exit::Interpret:
+                step<false>();
+                break;
+            case Jit::Exit::Halt:
+                running = false;
+                break;
+            default:
+                break;
+        }
+
+        // Translated code leaves at a jump when requests are pending, so
+        // this stands in for the check the interpreter makes in
+        // jump_pc_to().
+        if (running && requests_pending)
+        {
+            paused = true;
+            running = false;
+        }
+    }
+#else
+    run_classic<false>();
+#endif
+}
+
+void VirtualMachine::run_native()
+{
+    if (native_program == nullptr)
+    {
+        run_switch<false>();
+        return;
+    }
+
+    NativeRuntime rt(*this, registers.data(), memory.data(), stack, instruction_count, intrinsics.empty());
+    while (running)
+    {
+        auto block = program_counter < memory.size() ? native_blocks[program_counter] : nullptr;
+        if (block == nullptr)
+        {
+            step<false>();
+            continue;
+        }
+
+        auto next = block(rt);
+        program_counter = uint16_t(next);
+        if (next & NativeRuntime::Interpret)
+        {
+            step<false>();
+        }
+
+        // Blocks end at jumps, so this stands in for the check the
+        // interpreter makes in jump_pc_to().
+        if (running && requests_pending)
+        {
+            paused = true;
+            running = false;
+        }
+    }
+}
+
+void VirtualMachine::set_native_program(NativeProgram const* program)
+{
+    native_program = program;
+    if (program == nullptr)
+    {
+        native_blocks.clear();
+        native_translated.clear();
+        native_block_at.clear();
+        native_mismatches.clear();
+        return;
+    }
+
+    native_translated.assign(memory.size(), nullptr);
+    native_block_at.assign(memory.size(), NoNativeBlock);
+    for (std::size_t i = 0; i < program->block_count; ++i)
+    {
+        auto const& block = program->blocks[i];
+        if (block.start >= block.end || block.end > memory.size())
+        {
+            throw std::invalid_argument("A native block does not fit in memory");
+        }
+
+        native_translated[block.start] = block.fn;
+        for (auto address = block.start; address < block.end; ++address)
+        {
+            if (native_block_at[address] != NoNativeBlock)
+            {
+                throw std::invalid_argument("Native blocks overlap");
+            }
+            native_block_at[address] = block.start;
+        }
+    }
+
+    check_native_blocks();
+}
+
+void VirtualMachine::check_native_blocks()
+{
+    if (native_program == nullptr)
+    {
+        return;
+    }
+
+    native_mismatches.assign(memory.size(), 0);
+    for (std::size_t address = 0; address < memory.size(); ++address)
+    {
+        auto start = native_block_at[address];
+        if (start != NoNativeBlock && memory[address] != native_program->words[address])
+        {
+            ++native_mismatches[start];
+        }
+    }
+
+    native_blocks.assign(memory.size(), nullptr);
+    for (std::size_t address = 0; address < memory.size(); ++address)
+    {
+        if (native_translated[address] != nullptr && native_mismatches[address] == 0)
+        {
+            native_blocks[address] = native_translated[address];
+        }
+    }
+}
+
+inline void VirtualMachine::native_word_changed(uint16_t address, uint16_t old_value)
+{
+    auto start = native_block_at[address];
+    if (start == NoNativeBlock)
+    {
+        return;
+    }
+
+    auto expected = native_program->words[address];
+    auto was_expected = old_value == expected;
+    auto is_expected = memory[address] == expected;
+    if (was_expected && !is_expected && native_mismatches[start]++ == 0)
+    {
+        native_blocks[start] = nullptr;
+    }
+    else if (!was_expected && is_expected && --native_mismatches[start] == 0)
+    {
+        native_blocks[start] = native_translated[start];
+    }
+}
+
+void NativeRuntime::out(uint16_t value)
+{
+    vm.write_output(char(value));
+}
+
+void NativeRuntime::write(uint16_t address, uint16_t value)
+{
+    vm.write_memory(address, value);
+}
+
+void VirtualMachine::run_watched()
+{
+    while (running)
+    {
+        step_watched();
+    }
+}
+
+void VirtualMachine::run_debug()
+{
+    // The engines' loops never look at debug_mode; run() picks this loop
+    // instead while debugging.
+    while (running)
+    {
+        dump();
+        step_watched();
+    }
+}
+
+void VirtualMachine::step_watched()
+{
+    if (!recorder)
+    {
+        if (!memo || !memoize())
+        {
+            profile_enabled ? step<true>() : step<false>();
+        }
+        return;
+    }
+
+    // Only the register an instruction names as its result can change,
+    // unless the memoizer answered a CALL. Memory writes are recorded as
+    // they happen, and the stack is compared afterwards.
+    auto from = program_counter;
+    auto const& decoded = decode(from);
+    auto next = uint16_t(from + decoded.length);
+    unsigned written = Recorder::Delta::NoRegister;
+    if (register_writers & (1u << decoded.opcode))
+    {
+        auto word = memory[from + 1];
+        written = word >= 32768 && word < 32776 ? word - 32768u : written;
+    }
+    auto old_value = written < 8 ? registers[written] : uint16_t(0);
+    Memoizer::Registers before;
+    if (memo)
+    {
+        before = registers;
+    }
+    auto depth = stack.size();
+    auto top = stack.empty() ? uint16_t(0) : stack.top();
+    auto intrinsic = !intrinsics.empty() && calls_intrinsic(from);
+    auto skipped = false;
+
+    try
+    {
+        skipped = memo && memoize();
+        if (!skipped)
+        {
+            profile_enabled ? step<true>() : step<false>();
+        }
+    }
+    catch (...)
+    {
+        // The PC stays on the instruction that failed, and the record ends
+        // just before it.
+        recorder->abandon();
+        program_counter = from;
+        throw;
+    }
+
+    if (suspended || stop.reason != Stop::Reason::None)
+    {
+        // The instruction has not run yet.
+        recorder->abandon();
+        return;
+    }
+
+    if (intrinsic)
+    {
+        // Intrinsics change whatever they like.
+        recorder->clear();
+        return;
+    }
+
+    if (skipped)
+    {
+        for (auto i = 0u; i < registers.size(); ++i)
+        {
+            if (registers[i] != before[i])
+            {
+                recorder->register_written(i, before[i], registers[i]);
+            }
+        }
+    }
+    if (stack.size() > depth)
+    {
+        recorder->pushed(stack.top());
+    }
+    else if (stack.size() < depth)
+    {
+        recorder->popped(top);
+    }
+    if (program_counter != next)
+    {
+        recorder->jumped(program_counter);
+    }
+    if (!running)
+    {
+        recorder->halted();
+    }
+    recorder->stepped(from, written, old_value, written < 8 ? registers[written] : uint16_t(0));
+}
+
+bool VirtualMachine::calls_intrinsic(uint16_t address) const
+{
+    if (address + 1u >= memory.size() || memory[address] != 17)
+    {
+        return false;
+    }
+
+    auto target = memory[address + 1];
+    if (target >= 32768 && target < 32776)
+    {
+        target = registers[target - 32768];
+    }
+    return intrinsics.count(target) > 0;
+}
+
+bool VirtualMachine::memoize()
+{
+    auto address = program_counter;
+    auto const& decoded = decode(address);
+    if (decoded.handler == BreakpointHandler && breaks_at(address))
+    {
+        // The instruction is not going to run yet.
+        return false;
+    }
+
+    switch (decoded.opcode)
+    {
+        case 0:
+        case 15:
+        case 16:
+        case 19:
+        case 20:
+            memo->side_effect();
+            break;
+        case 3:
+            memo->pop(stack.size());
+            break;
+        case 18:
+            memo->ret(stack.size(), registers);
+            break;
+        case 17:
+        {
+            auto target = lookup_value(memory[address + 1]);
+            if (!intrinsics.empty() && intrinsics.count(target) > 0)
+            {
+                // Intrinsics may do anything.
+                memo->side_effect();
+                break;
+            }
+
+            // A breakpoint inside the function must not be skipped.
+            if (break_at.empty() && memo->call(target, registers))
+            {
+                program_counter += decoded.length;
+                ++instruction_count;
+                if (profile_enabled)
+                {
+                    profile_data->record(address, decoded.opcode);
+                }
+                return true;
+            }
+
+            // The CALL is about to push its return address.
+            memo->enter(target, stack.size() + 1, registers);
+            break;
+        }
+    }
+
+    return false;
+}
+
+std::uint32_t VirtualMachine::jit_write(VirtualMachine* vm, uint16_t address, uint16_t value)
+{
+    auto translated = vm->jit->translated(address);
+    vm->write_memory(address, value);
+    return translated ? 1 : 0;
+}
+
+bool VirtualMachine::profiling() const
+{
+    return profile_enabled;
+}
+
+void VirtualMachine::set_profiling(bool enabled)
+{
+    if (enabled && !profile_data)
+    {
+        profile_data.reset(new Profile());
+    }
+
+    profile_enabled = enabled;
+}
+
+Profile const& VirtualMachine::profile() const
+{
+    if (!profile_data)
+    {
+        throw std::logic_error("Profiling has never been turned on");
+    }
+
+    return *profile_data;
+}
+
+void VirtualMachine::report_profile(std::ostream& out) const
+{
+    std::vector<std::string> names;
+    for (auto const& inst : instructionTable)
+    {
+        names.push_back(inst.name);
+    }
+
+    profile().report(out, names, memory.data());
+}
+
+bool VirtualMachine::memoizing() const
+{
+    return bool(memo);
+}
+
+void VirtualMachine::set_memoization(std::size_t capacity)
+{
+    if (capacity == 0)
+    {
+        memo.reset();
+    }
+    else if (!memo || memo->capacity() != capacity)
+    {
+        memo.reset(new Memoizer(capacity));
+    }
+}
+
+Memoizer::Stats VirtualMachine::memoization_stats() const
+{
+    if (!memo)
+    {
+        throw std::logic_error("Memoization is off");
+    }
+
+    return memo->stats();
+}
+
+void VirtualMachine::report_memoization(std::ostream& out) const
+{
+    if (!memo)
+    {
+        throw std::logic_error("Memoization is off");
+    }
+
+    memo->report(out);
+}
+
+bool VirtualMachine::recording() const
+{
+    return bool(recorder);
+}
+
+void VirtualMachine::set_recording(std::size_t capacity)
+{
+    if (capacity == 0)
+    {
+        recorder.reset();
+    }
+    else if (!recorder || recorder->capacity() != capacity)
+    {
+        recorder.reset(new Recorder(capacity));
+    }
+}
+
+uint64_t VirtualMachine::step_back(uint64_t count)
+{
+    if (!recorder)
+    {
+        throw std::logic_error("Recording is off");
+    }
+
+    uint64_t steps = 0;
+    while (steps < count && recorder->back(replayed))
+    {
+        for (auto const& delta : replayed)
+        {
+            replay(delta, false);
+        }
+        --instruction_count;
+        running = true;
+        ++steps;
+    }
+    return steps;
+}
+
+uint64_t VirtualMachine::step_forward(uint64_t count)
+{
+    if (!recorder)
+    {
+        throw std::logic_error("Recording is off");
+    }
+
+    uint64_t steps = 0;
+    while (steps < count && recorder->forward(replayed))
+    {
+        // Unless the instruction jumped, the PC moves on to the next one,
+        // which has to be found before the instruction's own writes are
+        // replayed.
+        auto from = replayed.back().address;
+        auto inst = find_instruction(memory[from]);
+        program_counter = uint16_t(from + 1 + (inst != nullptr ? inst->numArguments : 0));
+        running = true;
+        for (auto const& delta : replayed)
+        {
+            replay(delta, true);
+        }
+        ++instruction_count;
+        ++steps;
+    }
+    return steps;
+}
+
+uint64_t VirtualMachine::undoable_steps() const
+{
+    return recorder ? recorder->steps_back() : 0;
+}
+
+uint64_t VirtualMachine::redoable_steps() const
+{
+    return recorder ? recorder->steps_forward() : 0;
+}
+
+void VirtualMachine::replay(Recorder::Delta const& delta, bool forward)
+{
+    auto value = forward ? delta.new_value : delta.old_value;
+    switch (delta.kind)
+    {
+        case Recorder::Delta::Kind::Step:
+            if (!forward)
+            {
+                program_counter = delta.address;
+            }
+            if (delta.index != Recorder::Delta::NoRegister)
+            {
+                registers[delta.index] = value;
+            }
+            break;
+        case Recorder::Delta::Kind::Jump:
+            if (forward)
+            {
+                program_counter = delta.address;
+            }
+            break;
+        case Recorder::Delta::Kind::Halt:
+            if (forward)
+            {
+                running = false;
+            }
+            break;
+        case Recorder::Delta::Kind::Register:
+            registers[delta.index] = value;
+            break;
+        case Recorder::Delta::Kind::Memory:
+            store_memory(delta.address, value);
+            break;
+        case Recorder::Delta::Kind::Push:
+            if (forward)
+            {
+                stack.push(delta.new_value);
+            }
+            else
+            {
+                stack.pop();
+            }
+            break;
+        case Recorder::Delta::Kind::Pop:
+            if (forward)
+            {
+                stack.pop();
+            }
+            else
+            {
+                stack.push(delta.old_value);
+            }
+            break;
+    }
+}
+
+bool VirtualMachine::fusing() const
+{
+    return fusion;
+}
+
+void VirtualMachine::set_fusion(bool enabled)
+{
+    fusion = enabled;
+}
+
+std::uint64_t VirtualMachine::fused_runs(Fusion kind) const
+{
+    return fusion_runs.at(std::size_t(kind));
+}
+
+std::uint64_t VirtualMachine::fused_instructions(Fusion kind) const
+{
+    return fusion_instructions.at(std::size_t(kind));
+}
+
+void VirtualMachine::report_fusion(std::ostream& out) const
+{
+    static char const* const names[FusionKinds] = { "compare-branch", "add-read", "call-prologue", "out-run" };
+    char line[128];
+
+    std::uint64_t fused = 0;
+    for (auto count : fusion_instructions)
+    {
+        fused += count;
+    }
+    std::snprintf(line, sizeof(line), "Fusion: %llu of %llu instructions ran fused\n",
+            static_cast<unsigned long long>(fused), static_cast<unsigned long long>(instruction_count));
+    out << line;
+
+    out << "\nSequence                   Runs    Instructions\n";
+    for (std::size_t i = 0; i < FusionKinds; ++i)
+    {
+        std::snprintf(line, sizeof(line), "%-16s %14llu  %14llu\n", names[i],
+                static_cast<unsigned long long>(fusion_runs[i]), static_cast<unsigned long long>(fusion_instructions[i]));
+        out << line;
+    }
+
+    out.flush();
+}
+
+void VirtualMachine::set_breakpoint(uint16_t address, Condition condition)
+{
+    check_memory_address(address);
+    if (condition.reg >= registers.size())
+    {
+        throw std::out_of_range("Invalid register in breakpoint condition");
+    }
+
+    break_at[address] = condition;
+    invalidate_decoded(address);
+}
+
+void VirtualMachine::clear_breakpoint(uint16_t address)
+{
+    if (break_at.erase(address) > 0)
+    {
+        invalidate_decoded(address);
+    }
+}
+
+std::map<uint16_t, VirtualMachine::Condition> const& VirtualMachine::breakpoints() const
+{
+    return break_at;
+}
+
+unsigned VirtualMachine::set_watchpoint(Watchpoint const& watchpoint)
+{
+    check_memory_address(watchpoint.first);
+    check_memory_address(watchpoint.last);
+    if (watchpoint.first > watchpoint.last)
+    {
+        throw std::invalid_argument("A watchpoint has to end after it starts");
+    }
+    if (watchpoint.condition.reg >= registers.size())
+    {
+        throw std::out_of_range("Invalid register in watchpoint condition");
+    }
+
+    if (watches.empty())
+    {
+        // Every RMEM and WMEM has to be decoded again to check for it.
+        clear_decoded();
+    }
+
+    auto id = next_watch++;
+    watches[id] = watchpoint;
+    return id;
+}
+
+bool VirtualMachine::clear_watchpoint(unsigned id)
+{
+    if (watches.erase(id) == 0)
+    {
+        return false;
+    }
+    if (watches.empty())
+    {
+        clear_decoded();
+    }
+    return true;
+}
+
+std::map<unsigned, VirtualMachine::Watchpoint> const& VirtualMachine::watchpoints() const
+{
+    return watches;
+}
+
+VirtualMachine::Stop VirtualMachine::stopped() const
+{
+    return stop;
+}
+
+void VirtualMachine::step_instruction()
+{
+    if (!running)
+    {
+        throw std::logic_error("The VM is halted");
+    }
+
+    suspended = false;
+    stop.reason = Stop::Reason::None;
+    ignore_stops = true;
+    try
+    {
+        step_watched();
+    }
+    catch (...)
+    {
+        ignore_stops = false;
+        throw;
+    }
+    ignore_stops = false;
+
+    if (paused)
+    {
+        // A jump noticed a request, which run() serves.
+        paused = false;
+        running = true;
+    }
+    if (suspended || stop.reason != Stop::Reason::None)
+    {
+        running = true;
+    }
+}
+
+void VirtualMachine::request_profile_report()
+{
+    profile_report_requested = 1;
+    requests_pending = 1;
+}
+
+void VirtualMachine::request_stop()
+{
+    stop_requested = 1;
+    requests_pending = 1;
+}
+
+void VirtualMachine::request_debug_toggle()
+{
+    debug_toggle_requested = 1;
+    requests_pending = 1;
+}
+
+bool VirtualMachine::debugging() const
+{
+    return debug_mode;
+}
+
+void VirtualMachine::start_debugging()
+{
+    debug_mode = true;
+    std::cerr << "Started debugging" << std::endl;
+
+    // A running VM has to leave its engine's loop for the debug loop.
+    requests_pending = 1;
+}
+
+void VirtualMachine::stop_debugging()
+{
+    debug_mode = false;
+    std::cerr << "Stopped debugging" << std::endl;
+    requests_pending = 1;
+}
+
+void VirtualMachine::dump() const
+{
+    auto word = memory.at(program_counter);
+    std::fprintf(stderr, "PC = 0x%04x -> 0x%04x", program_counter, word);
+    auto pcInst = find_instruction(word);
+    if (pcInst != nullptr)
+    {
+        std::fprintf(stderr, " (%s, %d args)", pcInst->name.c_str(), pcInst->numArguments);
+    }
+    std::fprintf(stderr, "\n");
+    std::fprintf(stderr, "R0 = 0x%04x, R1 = 0x%04x, R2 = 0x%04x, R3 = 0x%04x\n",
+            registers.at(0), registers.at(1), registers.at(2), registers.at(3));
+    std::fprintf(stderr, "R4 = 0x%04x, R5 = 0x%04x, R6 = 0x%04x, R7 = 0x%04x\n",
+            registers.at(4), registers.at(5), registers.at(6), registers.at(7));
+    std::fprintf(stderr, "\n");
+}
+
+void VirtualMachine::code_7_override()
+{
+    // Set R7 to 25734
+    std::cerr << "Override: set reg 7 to 25734" << std::endl;
+    registers.at(7) = 25734;
+    if (recorder)
+    {
+        recorder->clear();
+    }
+
+    // The guest checks R7 with a routine that would take years to finish
+    std::cerr << "Override: run the confirmation routine at 0x178b natively" << std::endl;
+    register_intrinsic(0x178b, find_intrinsic("teleporter"));
+}
+
+void VirtualMachine::register_intrinsic(uint16_t address, Intrinsic intrinsic)
+{
+    check_memory_address(address);
+    if (!intrinsic)
+    {
+        throw std::invalid_argument("An intrinsic needs a function to run");
+    }
+
+    intrinsics[address] = intrinsic;
+
+    // Only the interpreter looks for intrinsics.
+    if (jit)
+    {
+        jit->set_translate_calls(false);
+    }
+}
+
+void VirtualMachine::unregister_intrinsic(uint16_t address)
+{
+    intrinsics.erase(address);
+    if (jit && intrinsics.empty())
+    {
+        jit->set_translate_calls(true);
+    }
+}
+
+bool VirtualMachine::call_intrinsic(uint16_t address)
+{
+    auto found = intrinsics.find(address);
+    if (found == intrinsics.end())
+    {
+        return false;
+    }
+
+    found->second(*this);
+    return true;
+}
+
+uint16_t VirtualMachine::register_value(unsigned index) const
+{
+    return registers.at(index);
+}
+
+void VirtualMachine::set_register_value(unsigned index, uint16_t value)
+{
+    if (value > 32767)
+    {
+        throw std::out_of_range("Register values must be in [0,32767]");
+    }
+
+    registers.at(index) = value;
+    if (recorder)
+    {
+        recorder->clear();
+    }
+}
+
+uint16_t VirtualMachine::memory_value(uint16_t address) const
+{
+    return memory.at(address);
+}
+
+void VirtualMachine::set_memory_value(uint16_t address, uint16_t value)
+{
+    write_memory(check_memory_address(address), value);
+}
+
+void VirtualMachine::push_value(uint16_t value)
+{
+    stack.push(value);
+}
+
+uint16_t VirtualMachine::pop_value()
+{
+    if (stack.empty())
+    {
+        throw std::logic_error("Cannot pop off of an empty stack");
+    }
+
+    auto value = stack.top();
+    stack.pop();
+    return value;
+}
+
+void VirtualMachine::request_code_7_override()
+{
+    override_requested = 1;
+    requests_pending = 1;
+}
+
+Disassembler VirtualMachine::disassembler(std::vector<uint16_t> const& entries) const
+{
+    std::vector<uint16_t> all(1, 0);
+    all.push_back(program_counter);
+    all.insert(all.end(), entries.begin(), entries.end());
+
+    return Disassembler(memory.data(), memory.size(), all);
+}
+
+void VirtualMachine::disassemble_to_file(std::string const& filename) const
+{
+    std::ofstream file_out(filename);
+    if (!file_out)
+    {
+        throw std::runtime_error("Could not open " + filename);
+    }
+
+    disassembler().write_listing(file_out);
+}
+
+VirtualMachine::OperandKind VirtualMachine::operand_kind(uint16_t value)
+{
+    if (value < 32768)
+    {
+        return OperandKind::Literal;
+    }
+
+    if (value < 32776)
+    {
+        return OperandKind::Register;
+    }
+
+    return OperandKind::Invalid;
+}
+
+inline VirtualMachine::DecodedInstruction const& VirtualMachine::decode(uint16_t address)
+{
+    auto& decoded = decode_cache.at(address);
+    if (decoded.opcode != DecodedInstruction::NotDecoded)
+    {
+        return decoded;
+    }
+
+    auto word = memory.at(address);
+    auto inst = find_instruction(word);
+    if (inst == nullptr)
+    {
+        throw std::out_of_range("Unknown opcode encountered");
+    }
+
+    if (std::size_t(address) + inst->numArguments >= memory.size())
+    {
+        throw std::out_of_range("Instruction runs past the end of memory");
+    }
+
+    decode_operands(*inst, address, decoded);
+    if (!patch_stops(address, decoded, true) && fusion_active)
+    {
+        fuse(address, decoded);
+    }
+
+    return decoded;
+}
+
+void VirtualMachine::decode_operands(Instruction const& inst, std::size_t address, DecodedInstruction& decoded) const
+{
+    auto word = inst.opcode;
+
+    decoded.kinds.fill(OperandKind::Invalid);
+    decoded.args.fill(0);
+    for (auto i = 0; i < inst.numArguments; ++i)
+    {
+        auto arg = memory[address + 1 + i];
+        decoded.kinds[i] = operand_kind(arg);
+        decoded.args[i] = arg;
+    }
+    decoded.length = std::uint8_t(1 + inst.numArguments);
+    decoded.handler = std::uint8_t(word);
+
+    if (verified && operands_valid(inst, decoded))
+    {
+        auto mask = 0u;
+        for (auto i = 0; i < inst.numArguments; ++i)
+        {
+            if (decoded.kinds[i] == OperandKind::Register)
+            {
+                mask |= 1u << i;
+                decoded.args[i] -= 32768;
+            }
+        }
+        decoded.handler = std::uint8_t(VerifiedHandlers + word * 8 + mask);
+    }
+
+    decoded.opcode = std::uint8_t(word);
+}
+
+bool VirtualMachine::patch_stops(uint16_t address, DecodedInstruction& decoded, bool breakpoints) const
+{
+    if (breakpoints && break_at.count(address) > 0)
+    {
+        decoded.handler = BreakpointHandler;
+        decoded.args[0] = address;
+        return true;
+    }
+
+    if (!watches.empty() && (decoded.opcode == 15 || decoded.opcode == 16))
+    {
+        decoded.handler = decoded.opcode == 15 ? WatchedReadHandler : WatchedWriteHandler;
+        decoded.args[0] = memory[address + 1];
+        decoded.args[1] = memory[address + 2];
+        return true;
+    }
+
+    return false;
+}
+
+bool VirtualMachine::holds(Condition const& condition) const
+{
+    auto value = registers[condition.reg];
+    switch (condition.test)
+    {
+        case Condition::Test::Equal:
+            return value == condition.value;
+        case Condition::Test::NotEqual:
+            return value != condition.value;
+        case Condition::Test::Less:
+            return value < condition.value;
+        case Condition::Test::Greater:
+            return value > condition.value;
+        default:
+            return true;
+    }
+}
+
+bool VirtualMachine::breaks_at(uint16_t address) const
+{
+    if (ignore_stops)
+    {
+        return false;
+    }
+
+    auto found = break_at.find(address);
+    return found != break_at.end() && holds(found->second);
+}
+
+bool VirtualMachine::watch_hit(uint16_t address, bool write) const
+{
+    if (ignore_stops)
+    {
+        return false;
+    }
+
+    for (auto const& watch : watches)
+    {
+        auto const& watchpoint = watch.second;
+        if (address >= watchpoint.first && address <= watchpoint.last
+            && (write ? watchpoint.write : watchpoint.read) && holds(watchpoint.condition))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool VirtualMachine::stop_at(uint16_t address, Stop::Reason reason, uint16_t data_address)
+{
+    program_counter = address;
+    --instruction_count;
+    stop.reason = reason;
+    stop.address = data_address;
+    return false;
+}
+
+bool VirtualMachine::peek_verified(std::size_t address, DecodedInstruction& decoded) const
+{
+    if (address >= memory.size())
+    {
+        return false;
+    }
+
+    auto inst = find_instruction(memory[address]);
+    if (inst == nullptr || address + inst->numArguments >= memory.size())
+    {
+        return false;
+    }
+
+    decode_operands(*inst, address, decoded);
+    return decoded.handler >= VerifiedHandlers;
+}
+
+void VirtualMachine::fuse(uint16_t address, DecodedInstruction& decoded)
+{
+    if (decoded.handler < VerifiedHandlers)
+    {
+        return;
+    }
+
+    auto mask = unsigned(decoded.handler - VerifiedHandlers) % 8;
+    auto next_address = std::size_t(address) + decoded.length;
+    DecodedInstruction next;
+    DecodedInstruction last;
+    std::uint8_t handler;
+    std::uint16_t count = 0;
+
+    switch (decoded.opcode)
+    {
+        case 4:
+        case 5:
+            // EQ/GT a b c, then JT/JF a target
+            if (!peek_verified(next_address, next) || (next.opcode != 7 && next.opcode != 8) ||
+                next.kinds[0] != OperandKind::Register || next.args[0] != decoded.args[0])
+            {
+                return;
+            }
+            handler = std::uint8_t(CompareBranchHandlers + ((decoded.opcode - 4) * 2 + next.opcode - 7) * 8 +
+                    (mask >> 1) + (next.kinds[1] == OperandKind::Register ? 4 : 0));
+            break;
+        case 9:
+            // ADD a b c, then RMEM d a, unless RMEMs are being watched
+            if (!watches.empty() || !peek_verified(next_address, next) || next.opcode != 15 ||
+                next.kinds[1] != OperandKind::Register || next.args[1] != decoded.args[0])
+            {
+                return;
+            }
+            handler = std::uint8_t(AddReadHandlers + (mask >> 1));
+            break;
+        case 2:
+            // PUSH a, PUSH b, CALL c
+            if (!peek_verified(next_address, next) || next.opcode != 2 ||
+                !peek_verified(next_address + next.length, last) || last.opcode != 17)
+            {
+                return;
+            }
+            handler = std::uint8_t(CallPrologueHandlers + mask +
+                    (next.kinds[0] == OperandKind::Register ? 2 : 0) + (last.kinds[0] == OperandKind::Register ? 4 : 0));
+            next.length += last.length;
+            break;
+        case 19:
+        {
+            // OUT of a literal, repeated; the head counts the run in its
+            // second argument.
+            if (mask != 0)
+            {
+                return;
+            }
+            count = 1;
+            while (count < MaxOutRun && peek_verified(std::size_t(address) + count * 2, next) &&
+                next.opcode == 19 && next.kinds[0] == OperandKind::Literal)
+            {
+                ++count;
+            }
+            if (count == 1)
+            {
+                return;
+            }
+            handler = OutRunHandler;
+            next.length = std::uint8_t((count - 1) * 2);
+            break;
+        }
+        default:
+            return;
+    }
+
+    auto length = decoded.length + next.length;
 
-#define CALL_MEMBER_FN(object,ptrToMember)  ((object)->*(ptrToMember))
+    // The guest has to stop at a breakpoint inside the sequence.
+    auto breakpoint = break_at.upper_bound(address);
+    if (breakpoint != break_at.end() && breakpoint->first < address + length)
+    {
+        return;
+    }
 
-using namespace Backend;
-using std::uint16_t;
+    decoded.handler = handler;
+    decoded.length = std::uint8_t(length);
+    if (handler == OutRunHandler)
+    {
+        decoded.args[1] = count;
+    }
+    for (auto i = 0u; i < decoded.length; ++i)
+    {
+        fused_words[address + i] = true;
+    }
+}
 
-namespace
+void VirtualMachine::invalidate_decoded(uint16_t address)
 {
-    VirtualMachine* g_vm = nullptr;
-
-    void vm_signal_handler(int signum)
+    // An instruction is at most four words long, so a write can only land
+    // in the instructions that start up to three words before it.
+    auto first = std::size_t(address < 3 ? 0 : address - 3);
+    for (auto i = first; i <= address && i < decode_cache.size(); ++i)
     {
-        if (signum != SIGUSR1 && signum != SIGUSR2)
-        {
-            return;
-        }
+        decode_cache[i].opcode = DecodedInstruction::NotDecoded;
+    }
 
-        if (g_vm != nullptr)
+    // Fused sequences reach further back.
+    if (fused_words[address])
+    {
+        first = std::size_t(address < MaxFusedLength ? 0 : address - MaxFusedLength + 1);
+        for (auto i = first; i < address; ++i)
         {
-            if (signum == SIGUSR1)
-            {
-                if (!g_vm->debugging())
-                {                    
-                    g_vm->start_debugging();
-                    g_vm->dump();
-                }
-                else
-                {
-                    g_vm->stop_debugging();
-                }
-            }
-            else
+            auto& decoded = decode_cache[i];
+            if (decoded.opcode != DecodedInstruction::NotDecoded && decoded.handler >= CompareBranchHandlers &&
+                i + decoded.length > address)
             {
-                g_vm->code_7_override();
+                decoded.opcode = DecodedInstruction::NotDecoded;
             }
         }
     }
+}
 
-    void setup_usr1_signal()
-    {
-        struct sigaction act;
-        act.sa_handler = &vm_signal_handler;
-        bzero(&act.sa_mask, sizeof(act.sa_mask));
-        act.sa_flags = 0;
+void VirtualMachine::clear_decoded()
+{
+    DecodedInstruction undecoded;
+    undecoded.opcode = DecodedInstruction::NotDecoded;
+    decode_cache.fill(undecoded);
+    std::fill(fused_words.begin(), fused_words.end(), false);
+}
 
-        if (sigaction(SIGUSR1, &act, nullptr) < 0)
-        {
-            throw std::runtime_error("Could not trap SIGUSR1: sigaction retval < 0");
-        }
-        
-        if (sigaction(SIGUSR2, &act, nullptr) < 0)
+bool VirtualMachine::operands_valid(Instruction const& inst, DecodedInstruction const& decoded)
+{
+    for (auto i = 0; i < inst.numArguments; ++i)
+    {
+        auto kind = decoded.kinds[i];
+        if (kind == OperandKind::Invalid || (i == 0 && inst.writesRegister && kind != OperandKind::Register))
         {
-            throw std::runtime_error("Could not trap SIGUSR2: sigaction retval < 0");
+            return false;
         }
     }
+
+    return true;
 }
 
-VirtualMachine::VirtualMachine(std::vector<uint16_t> const& init_mem) :
-    running(true),
-    expectation(Expectation::Instruction),
-    instruction(nullptr),
-    program_counter(0),
-    input_log("input.log"),
-    debug_mode(false)
+VirtualMachine::Instruction const* VirtualMachine::find_instruction(uint16_t opcode) const
 {
-    registers.fill(0);
-    memory.fill(0);
-
-    add_instruction(0,  "HALT", 0, &VirtualMachine::halt_fn);
-    add_instruction(1,  "SET",  2, &VirtualMachine::set_fn);
-    add_instruction(2,  "PUSH", 1, &VirtualMachine::push_fn);
-    add_instruction(3,  "POP",  1, &VirtualMachine::pop_fn);
-    add_instruction(4,  "EQ",   3, &VirtualMachine::eq_fn);
-    add_instruction(5,  "GT",   3, &VirtualMachine::gt_fn);
-    add_instruction(6,  "JMP",  1, &VirtualMachine::jmp_fn);
-    add_instruction(7,  "JT",   2, &VirtualMachine::jt_fn);
-    add_instruction(8,  "JF",   2, &VirtualMachine::jf_fn);
-    add_instruction(9,  "ADD",  3, &VirtualMachine::add_fn);
-    add_instruction(10, "MULT", 3, &VirtualMachine::mult_fn);
-    add_instruction(11, "MOD",  3, &VirtualMachine::mod_fn);
-    add_instruction(12, "AND",  3, &VirtualMachine::and_fn);
-    add_instruction(13, "OR",   3, &VirtualMachine::or_fn);
-    add_instruction(14, "NOT",  2, &VirtualMachine::not_fn);
-    add_instruction(15, "RMEM", 2, &VirtualMachine::rmem_fn);
-    add_instruction(16, "WMEM", 2, &VirtualMachine::wmem_fn);
-    add_instruction(17, "CALL", 1, &VirtualMachine::call_fn);
-    add_instruction(18, "RET",  0, &VirtualMachine::ret_fn);
-    add_instruction(19, "OUT",  1, &VirtualMachine::out_fn);
-    add_instruction(20, "IN",   1, &VirtualMachine::in_fn);
-    add_instruction(21, "NOOP", 0, &VirtualMachine::nop_fn);
-
-    std::copy(init_mem.cbegin(), init_mem.cend(), memory.begin());
-
-    g_vm = this;
-    setup_usr1_signal();
+    if (opcode >= instructionTable.size())
+    {
+        return nullptr;
+    }
+
+    return &instructionTable[opcode];
 }
 
-VirtualMachine::~VirtualMachine()
+void VirtualMachine::add_instruction(uint16_t opcode, std::string name, int numArguments, bool writesRegister, InstructionFn fn)
 {
-    g_vm = nullptr;
+    // Opcodes are registered in order, so the table stays indexable by opcode.
+    assert(opcode == instructionTable.size());
+    instructionTable.emplace_back(opcode, name, numArguments, writesRegister, fn);
+    handlerTable.push_back(fn);
 }
 
-void VirtualMachine::run()
+uint16_t VirtualMachine::lookup_value(uint16_t value)
 {
-    if (!running)
+    if (value < 32768)
     {
-        throw std::logic_error("The VM is halted");
+        return value;
     }
 
-    while (running)
+    if (value > 32767 && value < 32776)
     {
-        if (debug_mode)
-        {
-            dump();
-        }
-
-        auto word = memory.at(program_counter);
-        next_word(word);
-        ++program_counter;
+        return registers.at(value - 32768);
     }
-}
 
-bool VirtualMachine::is_running() const
-{
-    return running;
+    throw std::out_of_range("Values cannot be any higher than 32776");
 }
 
-bool VirtualMachine::debugging() const
+uint16_t VirtualMachine::check_register_address(uint16_t address)
 {
-    return debug_mode;
-}
+    if (address < 32768 || address > 32776)
+    {
+        throw std::out_of_range("Register addresses must be in [32768,32776]");
+    }
 
-void VirtualMachine::start_debugging()
-{
-    debug_mode = true;
-    std::cerr << "Started debugging" << std::endl;
+    return address - 32768;
 }
 
-void VirtualMachine::stop_debugging()
+uint16_t VirtualMachine::check_memory_address(uint16_t address)
 {
-    debug_mode = false;
-    std::cerr << "Stopped debugging" << std::endl;
+    if (address > 32767)
+    {
+        throw std::out_of_range("Memory addresses must be in [0,32767]");
+    }
+
+    return address;
 }
 
-void VirtualMachine::dump() const
+void VirtualMachine::write_memory(uint16_t address, uint16_t value)
 {
-    auto word = memory.at(program_counter);
-    std::fprintf(stderr, "PC = 0x%04x -> 0x%04x", program_counter, word);
-    auto mappedInstruction = opcodeInstructionMap.find(word);
-    if (mappedInstruction != opcodeInstructionMap.end())
+    if (recorder)
     {
-        auto& pcInst = mappedInstruction->second;
-        std::fprintf(stderr, " (%s, %d args)", pcInst.name.c_str(), pcInst.numArguments);
+        recorder->memory_written(address, memory.at(address), value);
     }
-    std::fprintf(stderr, "\n");
-    std::fprintf(stderr, "R0 = 0x%04x, R1 = 0x%04x, R2 = 0x%04x, R3 = 0x%04x\n",
-            registers.at(0), registers.at(1), registers.at(2), registers.at(3));
-    std::fprintf(stderr, "R4 = 0x%04x, R5 = 0x%04x, R6 = 0x%04x, R7 = 0x%04x\n",
-            registers.at(4), registers.at(5), registers.at(6), registers.at(7));
-    std::fprintf(stderr, "\n");
+    store_memory(address, value);
 }
 
-void VirtualMachine::code_7_override()
+void VirtualMachine::store_memory(uint16_t address, uint16_t value)
 {
-    // Set R7 to 25734
-    std::cerr << "Override: set reg 7 to 25734" << std::endl;
-    registers.at(7) = 25734;
-    
-    // Set 0x1566 to JMP 0x157a
-    std::cerr << "Override: set [0x1566, 0x1567] to JMP 0x157a" << std::endl;
-    memory.at(0x1566) = 6;
-    memory.at(0x1567) = 0x157a;
+    auto old_value = memory.at(address);
+    memory[address] = value;
+    invalidate_decoded(address);
+    if (jit)
+    {
+        jit->invalidate(address);
+    }
+    if (memo)
+    {
+        memo->forget();
+    }
+    if (native_program != nullptr)
+    {
+        native_word_changed(address, old_value);
+    }
 }
 
-void VirtualMachine::disassemble_to_file(std::string const& filename) const
+GuestIO::InputStatus VirtualMachine::read_input(char& c)
 {
-    using std::setw;
-    using std::setfill;
-
-    std::ofstream file_out(filename);
-    file_out << std::hex;
-    file_out << "Byte    Addr    Inst  Args" << std::endl;
+    // Snapshots are only taken between lines of input.
+    if (input_log_pending.empty() && (snapshot_requested || input_lines == snapshot_line))
+    {
+        save_requested_snapshot();
+    }
 
-    auto local_pc = uint16_t(0);
-    while (local_pc < memory.size())
+    if (input_pos == input_end)
     {
-        file_out << "0x" << setw(4) << setfill('0') << local_pc * 2 << "  ";
-        file_out << "0x" << setw(4) << setfill('0') << local_pc << "  ";
+        // The guest is about to wait for the user, who needs to see the
+        // prompt.
+        flush_output();
 
-        auto inst_word = memory.at(local_pc);
-        auto mappedInstruction = opcodeInstructionMap.find(inst_word);
-        if (mappedInstruction == opcodeInstructionMap.end())
+        auto status = fill_input();
+        if (status == GuestIO::InputStatus::Ended)
         {
-            file_out << "Unknown: 0x" << setw(4) << setfill('0') << inst_word;
+            write_input_log();
         }
-        else
+        if (status != GuestIO::InputStatus::Ready)
         {
-            auto& inst = mappedInstruction->second;
-            file_out << std::left << setw(4) << setfill(' ') << inst.name << std::right;
-            if (inst.numArguments > 0)
-            {
-                ++local_pc;
-                auto arg = memory.at(local_pc);
-                file_out << "  0x" << setw(4) << setfill('0') << arg;
-                for (auto i = 1; i < inst.numArguments; ++i)
-                {
-                    ++local_pc;
-                    arg = memory.at(local_pc);
-                    file_out << ", 0x" << setw(4) << setfill('0') << arg;
-                }
-            }
+            return status;
         }
+    }
 
-        file_out << std::endl;
-        ++local_pc;
+    c = input_buffer[input_pos++];
+    if (c != '\0')
+    {
+        input_log_pending.push_back(c);
     }
-}
 
-void VirtualMachine::next_word(uint16_t word)
-{
-    if (!running)
+    // The guest always reads a whole line, so that is the unit of logging.
+    if (c == '\n')
     {
-        throw std::logic_error("The VM is halted");
+        write_input_log();
+        ++input_lines;
     }
 
-    if (expectation == Expectation::Instruction)
+    return GuestIO::InputStatus::Ready;
+}
+
+GuestIO::InputStatus VirtualMachine::fill_input()
+{
+    for (;;)
     {
-        auto mappedInstruction = opcodeInstructionMap.find(word);
-        if (mappedInstruction == opcodeInstructionMap.end())
+        std::size_t count = 0;
+        auto status = guest_io->read(input_buffer.data(), input_buffer.size(), count);
+        if (status == GuestIO::InputStatus::Ready)
         {
-            throw std::out_of_range("Unknown opcode encountered");
+            input_pos = 0;
+            input_end = count;
         }
 
-        instruction = &(mappedInstruction->second);
-        arguments.clear();
-
-        if (instruction->numArguments > 0)
+        if (status != GuestIO::InputStatus::Interrupted)
         {
-            expectation = Expectation::Argument;
+            return status;
         }
-        else
+
+        if (snapshot_requested && input_log_pending.empty())
         {
-            running = CALL_MEMBER_FN(this, instruction->fn)();
+            save_requested_snapshot();
         }
-    }
-    else if (expectation == Expectation::Argument)
-    {
-        arguments.push_back(word);
-        if (arguments.size() == instruction->numArguments)
+
+        // The guest may wait here for a long time, so act on requests now
+        // rather than at its next jump.
+        if (requests_pending)
         {
-            running = CALL_MEMBER_FN(this, instruction->fn)();
-            expectation = Expectation::Instruction;
+            serve_requests();
+            if (stop.reason != Stop::Reason::None)
+            {
+                return GuestIO::InputStatus::NotYet;
+            }
         }
     }
 }
 
-void VirtualMachine::add_instruction(uint16_t opcode, std::string name, int numArguments, InstructionFn fn)
+bool VirtualMachine::suspend_for_input()
 {
-    opcodeInstructionMap.emplace(opcode, Instruction(opcode, name, numArguments, fn));
+    // Every IN is two words long. Moving back onto it means the next run()
+    // starts by reading again, and the IN is only counted once.
+    program_counter -= 2;
+    --instruction_count;
+    if (stop.reason == Stop::Reason::Request)
+    {
+        // The request came in while the guest waited, so it stops on the IN.
+        stop.address = program_counter;
+    }
+    suspended = stop.reason == Stop::Reason::None;
+    return false;
 }
 
-uint16_t VirtualMachine::lookup_value(uint16_t value)
+void VirtualMachine::write_input_log()
 {
-    if (value < 32768)
+    if (input_log_pending.empty())
     {
-        return value;
+        return;
     }
 
-    if (value > 32767 && value < 32776)
+    if (!input_log_path.empty())
     {
-        return registers.at(value - 32768);
-    }
-
-    throw std::out_of_range("Values cannot be any higher than 32776");
-}
+        if (!input_log.is_open())
+        {
+            input_log.open(input_log_path);
+        }
 
-uint16_t VirtualMachine::check_register_address(uint16_t address)
-{
-    if (address < 32768 || address > 32776)
-    {
-        throw std::out_of_range("Register addresses must be in [32768,32776]");
+        input_log.write(input_log_pending.data(), input_log_pending.size());
+        input_log.flush();
+        assert(!input_log.bad());
     }
 
-    return address - 32768;
+    input_log_pending.clear();
 }
 
-uint16_t VirtualMachine::check_memory_address(uint16_t address)
+inline void VirtualMachine::write_output(char c)
 {
-    if (address > 32767)
+    output_buffer.push_back(c);
+    if (output_buffer.size() >= output_limit)
     {
-        throw std::out_of_range("Memory addresses must be in [0,32767]");
+        flush_output();
     }
-
-    return address;
 }
 
-bool VirtualMachine::halt_fn()
+VM_HANDLER bool VirtualMachine::halt_fn()
 {
     // Opcode 0
     // HALT
@@ -315,34 +2008,34 @@ bool VirtualMachine::halt_fn()
     return false;
 }
 
-bool VirtualMachine::set_fn()
+VM_HANDLER bool VirtualMachine::set_fn()
 {
     // Opcode 1
     // SET a b
     // Set register a to the value of b.
     
-    auto a = check_register_address(arguments.at(0));
-    auto b = lookup_value(arguments.at(1));
+    auto a = check_register_address(arguments[0]);
+    auto b = lookup_value(arguments[1]);
 
     registers.at(a) = b;
 
     return true;
 }
 
-bool VirtualMachine::push_fn()
+VM_HANDLER bool VirtualMachine::push_fn()
 {
     // Opcode 2
     // PUSH a
     // Push the value of a onto the stack.
 
-    auto a = lookup_value(arguments.at(0));
+    auto a = lookup_value(arguments[0]);
 
     stack.push(a);
 
     return true;
 }
 
-bool VirtualMachine::pop_fn()
+VM_HANDLER bool VirtualMachine::pop_fn()
 {
     // Opcode 3
     // POP a
@@ -353,22 +2046,22 @@ bool VirtualMachine::pop_fn()
         throw std::logic_error("Cannot pop off of an empty stack");
     }
 
-    auto a = check_register_address(arguments.at(0));
+    auto a = check_register_address(arguments[0]);
     registers.at(a) = stack.top();
     stack.pop();
 
     return true;    
 }
 
-bool VirtualMachine::eq_fn()
+VM_HANDLER bool VirtualMachine::eq_fn()
 {
     // Opcode 4
     // EQ a b c
     // Set a to 1 if b == c; else, set a to 0.
 
-    auto a = check_register_address(arguments.at(0));
-    auto b = lookup_value(arguments.at(1));
-    auto c = lookup_value(arguments.at(2));
+    auto a = check_register_address(arguments[0]);
+    auto b = lookup_value(arguments[1]);
+    auto c = lookup_value(arguments[2]);
 
     if (b == c)
     {
@@ -382,15 +2075,15 @@ bool VirtualMachine::eq_fn()
     return true;
 }
 
-bool VirtualMachine::gt_fn()
+VM_HANDLER bool VirtualMachine::gt_fn()
 {
     // Opcode 5
     // GT a b c
     // Set a to 1 if b > c; else, set a to 0.
 
-    auto a = check_register_address(arguments.at(0));
-    auto b = lookup_value(arguments.at(1));
-    auto c = lookup_value(arguments.at(2));
+    auto a = check_register_address(arguments[0]);
+    auto b = lookup_value(arguments[1]);
+    auto c = lookup_value(arguments[2]);
 
     if (b > c)
     {
@@ -404,62 +2097,60 @@ bool VirtualMachine::gt_fn()
     return true;
 }
 
-bool VirtualMachine::jmp_fn()
+VM_HANDLER bool VirtualMachine::jmp_fn()
 {
     // Opcode 6
     // JMP a
     // Jump the PC to a.
 
-    auto a = lookup_value(arguments.at(0));
-
-    jump_pc_to(a);
+    auto a = lookup_value(arguments[0]);
 
-    return true;
+    return jump_pc_to(a);
 }
 
-bool VirtualMachine::jt_fn()
+VM_HANDLER bool VirtualMachine::jt_fn()
 {
     // Opcode 7
     // JT a b
     // If a != 0, jump the PC to b.
 
-    auto a = lookup_value(arguments.at(0));
-    auto b = lookup_value(arguments.at(1));
+    auto a = lookup_value(arguments[0]);
+    auto b = lookup_value(arguments[1]);
 
     if (a != 0)
     {
-        jump_pc_to(b);
+        return jump_pc_to(b);
     }
 
     return true;
 }
 
-bool VirtualMachine::jf_fn()
+VM_HANDLER bool VirtualMachine::jf_fn()
 {
     // Opcode 8
     // JF a b
     // If a == 0, jump the PC to b.
 
-    auto a = lookup_value(arguments.at(0));
-    auto b = lookup_value(arguments.at(1));
+    auto a = lookup_value(arguments[0]);
+    auto b = lookup_value(arguments[1]);
 
     if (a == 0)
     {
-        jump_pc_to(b);
+        return jump_pc_to(b);
     }
 
     return true;
 }
 
-bool VirtualMachine::add_fn()
+VM_HANDLER bool VirtualMachine::add_fn()
 {
     // Opcode 9
     // ADD a b c
     // Store in a the sum of b and c.
     
-    auto a = check_register_address(arguments.at(0));
-    auto b = lookup_value(arguments.at(1));
-    auto c = lookup_value(arguments.at(2));
+    auto a = check_register_address(arguments[0]);
+    auto b = lookup_value(arguments[1]);
+    auto c = lookup_value(arguments[2]);
 
     auto result = (b + c) % 32768;
 
@@ -468,15 +2159,15 @@ bool VirtualMachine::add_fn()
     return true;
 }
 
-bool VirtualMachine::mult_fn()
+VM_HANDLER bool VirtualMachine::mult_fn()
 {
     // Opcode 10
     // MULT a b c
     // Store in a the product of b and c modulo 32768.
 
-    auto a = check_register_address(arguments.at(0));
-    auto b = lookup_value(arguments.at(1));
-    auto c = lookup_value(arguments.at(2));
+    auto a = check_register_address(arguments[0]);
+    auto b = lookup_value(arguments[1]);
+    auto c = lookup_value(arguments[2]);
 
     auto result = (b * c) % 32768;
 
@@ -485,15 +2176,15 @@ bool VirtualMachine::mult_fn()
     return true;
 }
 
-bool VirtualMachine::mod_fn()
+VM_HANDLER bool VirtualMachine::mod_fn()
 {
     // Opcode 11
     // MOD a b c
     // Store in a the result of b modulo c.
 
-    auto a = check_register_address(arguments.at(0));
-    auto b = lookup_value(arguments.at(1));
-    auto c = lookup_value(arguments.at(2));
+    auto a = check_register_address(arguments[0]);
+    auto b = lookup_value(arguments[1]);
+    auto c = lookup_value(arguments[2]);
 
     auto result = b % c;
 
@@ -502,15 +2193,15 @@ bool VirtualMachine::mod_fn()
     return true;
 }
 
-bool VirtualMachine::and_fn()
+VM_HANDLER bool VirtualMachine::and_fn()
 {
     // Opcode 12
     // AND a b c
     // Store in a the bitwise and of b and c.
 
-    auto a = check_register_address(arguments.at(0));
-    auto b = lookup_value(arguments.at(1));
-    auto c = lookup_value(arguments.at(2));
+    auto a = check_register_address(arguments[0]);
+    auto b = lookup_value(arguments[1]);
+    auto c = lookup_value(arguments[2]);
 
     auto result = b & c;
 
@@ -519,15 +2210,15 @@ bool VirtualMachine::and_fn()
     return true;
 }
 
-bool VirtualMachine::or_fn()
+VM_HANDLER bool VirtualMachine::or_fn()
 {
     // Opcode 13
     // OR a b c
     // Store in a the bitwise or of b and c.
 
-    auto a = check_register_address(arguments.at(0));
-    auto b = lookup_value(arguments.at(1));
-    auto c = lookup_value(arguments.at(2));
+    auto a = check_register_address(arguments[0]);
+    auto b = lookup_value(arguments[1]);
+    auto c = lookup_value(arguments[2]);
 
     auto result = b | c;
 
@@ -536,7 +2227,7 @@ bool VirtualMachine::or_fn()
     return true;
 }
 
-bool VirtualMachine::not_fn()
+VM_HANDLER bool VirtualMachine::not_fn()
 {
     // Opcode 14
     // NOT a b
@@ -544,8 +2235,8 @@ bool VirtualMachine::not_fn()
     // invert the most significant bit. (e.g., the inverse is
     // only across the lower 15 bits)
     
-    auto a = check_register_address(arguments.at(0));
-    auto b = lookup_value(arguments.at(1));
+    auto a = check_register_address(arguments[0]);
+    auto b = lookup_value(arguments[1]);
 
     auto result = 0x7fff & (~b);
 
@@ -554,49 +2245,53 @@ bool VirtualMachine::not_fn()
     return true;
 }
 
-bool VirtualMachine::rmem_fn()
+VM_HANDLER bool VirtualMachine::rmem_fn()
 {
     // Opcode 15
     // RMEM a b
     // Store in a the value at memory address b.
 
-    auto a = check_register_address(arguments.at(0));
-    auto b = check_memory_address(lookup_value(arguments.at(1)));
+    auto a = check_register_address(arguments[0]);
+    auto b = check_memory_address(lookup_value(arguments[1]));
 
     registers.at(a) = memory.at(b);
 
     return true;
 }
 
-bool VirtualMachine::wmem_fn()
+VM_HANDLER bool VirtualMachine::wmem_fn()
 {
     // Opcode 16
     // WMEM a b
     // Store in memory address a the value of b.
     
-    auto a = check_memory_address(lookup_value(arguments.at(0)));
-    auto b = lookup_value(arguments.at(1));
+    auto a = check_memory_address(lookup_value(arguments[0]));
+    auto b = lookup_value(arguments[1]);
 
-    memory.at(a) = b;
+    write_memory(a, b);
 
     return true;
 }
 
-bool VirtualMachine::call_fn()
+VM_HANDLER bool VirtualMachine::call_fn()
 {
     // Opcode 17
     // CALL a
-    // Push (PC + 1) onto the stack, then jump to a.
+    // Push the address of the next instruction onto the stack, then jump to a.
+
+    auto a = lookup_value(arguments[0]);
 
-    auto a = lookup_value(arguments.at(0));
+    if (!intrinsics.empty() && call_intrinsic(a))
+    {
+        return true;
+    }
 
-    stack.push(program_counter + 1);
-    jump_pc_to(a);
+    stack.push(program_counter);
 
-    return true;
+    return jump_pc_to(a);
 }
 
-bool VirtualMachine::ret_fn()
+VM_HANDLER bool VirtualMachine::ret_fn()
 {
     // Opcode 18
     // RET
@@ -610,44 +2305,41 @@ bool VirtualMachine::ret_fn()
 
     auto jmp_loc = stack.top();
     stack.pop();
-    jump_pc_to(jmp_loc);
 
-    return true;
+    return jump_pc_to(jmp_loc);
 }
 
-bool VirtualMachine::out_fn()
+VM_HANDLER bool VirtualMachine::out_fn()
 {
     // Opcode 19
     // OUT a
     // Write the character represented by ascii code <a> to the terminal
     
-    auto a = lookup_value(arguments.at(0));
+    auto a = lookup_value(arguments[0]);
     char ascii(a);
-    std::cout << ascii;
+    write_output(ascii);
 
     return true;
 }
 
-bool VirtualMachine::in_fn()
+VM_HANDLER bool VirtualMachine::in_fn()
 {
     // Opcode 20
     // IN a
     // Read a character from the terminal and write its ascii code to <a>
 
-    auto a = check_register_address(arguments.at(0));
+    auto a = check_register_address(arguments[0]);
     char val;
 
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(0, &readfds);
-    select(1, &readfds, nullptr, nullptr, nullptr);
-
-    std::cin.read(&val, 1);
-    if (val != '\0')
+    switch (read_input(val))
     {
-        input_log.put(val);
-        assert(!input_log.bad());
-        input_log.flush();
+        case GuestIO::InputStatus::Ready:
+            break;
+        case GuestIO::InputStatus::NotYet:
+            return suspend_for_input();
+        default:
+            // There is nothing left to read, so the guest can never continue.
+            return false;
     }
 
     registers.at(a) = uint16_t(val);
@@ -655,7 +2347,7 @@ bool VirtualMachine::in_fn()
     return true;
 }
 
-bool VirtualMachine::nop_fn()
+VM_HANDLER bool VirtualMachine::nop_fn()
 {
     // Opcode 21
     // NOP
@@ -664,10 +2356,255 @@ bool VirtualMachine::nop_fn()
     return true;
 }
 
-void VirtualMachine::jump_pc_to(std::uint16_t address)
+VM_HANDLER bool VirtualMachine::jump_pc_to(std::uint16_t address)
+{
+    // run() has already moved the PC past the current instruction,
+    // so a jump simply replaces it.
+    program_counter = address;
+
+    // Every guest loop jumps, so this is often enough to notice requests
+    // without checking for them on every instruction.
+    if (requests_pending)
+    {
+        paused = true;
+        return false;
+    }
+
+    return true;
+}
+
+template <unsigned Registers, int N>
+VM_HANDLER uint16_t VirtualMachine::operand() const
+{
+    return (Registers & (1u << N)) ? registers[arguments[N]] : arguments[N];
+}
+
+template <std::uint16_t Opcode, unsigned Registers>
+VM_HANDLER bool VirtualMachine::verified_fn()
+{
+    // The same operations as the checked handlers above. Register and value
+    // operands were validated at decode time; only the checks that depend
+    // on run-time values (memory addresses, the stack) remain.
+
+    auto a = arguments[0];
+
+    switch (Opcode)
+    {
+        case 0:
+            return false;
+        case 1:
+            registers[a] = operand<Registers, 1>();
+            break;
+        case 2:
+            stack.push(operand<Registers, 0>());
+            break;
+        case 3:
+            if (stack.empty())
+            {
+                throw std::logic_error("Cannot pop off of an empty stack");
+            }
+            registers[a] = stack.top();
+            stack.pop();
+            break;
+        case 4:
+            registers[a] = operand<Registers, 1>() == operand<Registers, 2>() ? 1 : 0;
+            break;
+        case 5:
+            registers[a] = operand<Registers, 1>() > operand<Registers, 2>() ? 1 : 0;
+            break;
+        case 6:
+            return jump_pc_to(operand<Registers, 0>());
+        case 7:
+            if (operand<Registers, 0>() != 0)
+            {
+                return jump_pc_to(operand<Registers, 1>());
+            }
+            break;
+        case 8:
+            if (operand<Registers, 0>() == 0)
+            {
+                return jump_pc_to(operand<Registers, 1>());
+            }
+            break;
+        case 9:
+            registers[a] = (operand<Registers, 1>() + operand<Registers, 2>()) % 32768;
+            break;
+        case 10:
+            registers[a] = (operand<Registers, 1>() * operand<Registers, 2>()) % 32768;
+            break;
+        case 11:
+            registers[a] = operand<Registers, 1>() % operand<Registers, 2>();
+            break;
+        case 12:
+            registers[a] = operand<Registers, 1>() & operand<Registers, 2>();
+            break;
+        case 13:
+            registers[a] = operand<Registers, 1>() | operand<Registers, 2>();
+            break;
+        case 14:
+            registers[a] = 0x7fff & (~operand<Registers, 1>());
+            break;
+        case 15:
+            registers[a] = memory[check_memory_address(operand<Registers, 1>())];
+            break;
+        case 16:
+            write_memory(check_memory_address(operand<Registers, 0>()), operand<Registers, 1>());
+            break;
+        case 17:
+            if (!intrinsics.empty() && call_intrinsic(operand<Registers, 0>()))
+            {
+                break;
+            }
+            stack.push(program_counter);
+            return jump_pc_to(operand<Registers, 0>());
+        case 18:
+            return ret_fn();
+        case 19:
+            write_output(char(operand<Registers, 0>()));
+            break;
+        case 20:
+        {
+            char val;
+            switch (read_input(val))
+            {
+                case GuestIO::InputStatus::Ready:
+                    break;
+                case GuestIO::InputStatus::NotYet:
+                    return suspend_for_input();
+                default:
+                    return false;
+            }
+            registers[a] = uint16_t(val);
+            break;
+        }
+    }
+
+    return true;
+}
+
+template <std::uint16_t Compare, std::uint16_t Branch, unsigned Registers>
+VM_HANDLER bool VirtualMachine::compare_branch_fn()
+{
+    // EQ/GT a b c
+    // JT/JF a target
+
+    auto b = operand<Registers, 1>();
+    auto c = operand<Registers, 2>();
+    auto result = Compare == 4 ? b == c : b > c;
+    registers[arguments[0]] = result ? 1 : 0;
+
+    ++instruction_count;
+    ++fusion_runs[std::size_t(Fusion::CompareBranch)];
+    fusion_instructions[std::size_t(Fusion::CompareBranch)] += 2;
+
+    if (result == (Branch == 7))
+    {
+        auto target = memory[program_counter - 1];
+        return jump_pc_to((Registers & 8) ? registers[target - 32768] : target);
+    }
+
+    return true;
+}
+
+template <unsigned Registers>
+VM_HANDLER bool VirtualMachine::add_read_fn()
+{
+    // ADD a b c
+    // RMEM d a
+
+    auto sum = uint16_t((operand<Registers, 1>() + operand<Registers, 2>()) % 32768);
+    registers[arguments[0]] = sum;
+    registers[memory[program_counter - 2] - 32768] = memory[sum];
+
+    ++instruction_count;
+    ++fusion_runs[std::size_t(Fusion::AddRead)];
+    fusion_instructions[std::size_t(Fusion::AddRead)] += 2;
+
+    return true;
+}
+
+template <unsigned Registers>
+VM_HANDLER bool VirtualMachine::call_prologue_fn()
+{
+    // PUSH a
+    // PUSH b
+    // CALL c
+
+    auto b = memory[program_counter - 3];
+    auto c = memory[program_counter - 1];
+    stack.push(operand<Registers, 0>());
+    stack.push((Registers & 2) ? registers[b - 32768] : b);
+    auto target = (Registers & 4) ? registers[c - 32768] : c;
+
+    instruction_count += 2;
+    ++fusion_runs[std::size_t(Fusion::CallPrologue)];
+    fusion_instructions[std::size_t(Fusion::CallPrologue)] += 3;
+
+    if (!intrinsics.empty() && call_intrinsic(target))
+    {
+        return true;
+    }
+    stack.push(program_counter);
+    return jump_pc_to(target);
+}
+
+VM_HANDLER bool VirtualMachine::out_run_fn()
+{
+    // OUT a, any number of times
+
+    auto count = arguments[1];
+    auto first = program_counter - count * 2;
+    for (auto i = 0u; i < count; ++i)
+    {
+        output_buffer.push_back(char(memory[first + 1 + i * 2]));
+    }
+    if (output_buffer.size() >= output_limit)
+    {
+        flush_output();
+    }
+
+    instruction_count += count - 1;
+    ++fusion_runs[std::size_t(Fusion::OutRun)];
+    fusion_instructions[std::size_t(Fusion::OutRun)] += count;
+
+    return true;
+}
+
+bool VirtualMachine::breakpoint_fn()
+{
+    auto address = arguments[0];
+    if (breaks_at(address))
+    {
+        return stop_at(address, Stop::Reason::Breakpoint, address);
+    }
+
+    // The condition does not hold, so the instruction runs as it would
+    // have without the breakpoint.
+    DecodedInstruction decoded;
+    decode_operands(*find_instruction(memory[address]), address, decoded);
+    patch_stops(address, decoded, false);
+    arguments = decoded.args.data();
+    return CALL_MEMBER_FN(this, handlerTable[decoded.handler])();
+}
+
+bool VirtualMachine::watched_rmem_fn()
 {
-    // Because the PC always increments by 1 after a call,
-    // we want to jump the PC to a - 1.
-    program_counter = address - 1;
+    auto b = check_memory_address(lookup_value(arguments[1]));
+    if (watch_hit(b, false))
+    {
+        return stop_at(uint16_t(program_counter - 3), Stop::Reason::Read, b);
+    }
+
+    return rmem_fn();
 }
 
+bool VirtualMachine::watched_wmem_fn()
+{
+    auto a = check_memory_address(lookup_value(arguments[0]));
+    if (watch_hit(a, true))
+    {
+        return stop_at(uint16_t(program_counter - 3), Stop::Reason::Write, a);
+    }
+
+    return wmem_fn();
+}
@@ -1,36 +1,323 @@
+#pragma once
+
 #include <array>
+#include <csignal>
 #include <cstdint>
 #include <fstream>
 #include <functional>
-#include <stack>
+#include <map>
+#include <memory>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "disasm.h"
+#include "guestmem.h"
+#include "image.h"
+#include "io.h"
+#include "memo.h"
+#include "native.h"
+#include "profile.h"
+#include "recorder.h"
+#include "stack.h"
+
 namespace Backend
 {
+    class Jit;
+
+    // A VM holds no process-wide state, so any number of them can run at
+    // once on different threads. Signals only reach a VM through a
+    // SignalRouter (signals.h).
     class VirtualMachine
     {
     public:
-        VirtualMachine(std::vector<std::uint16_t> const& init_mem);
+        // Classic dispatches every instruction through its handler's
+        // pointer-to-member; Switch runs all handlers inline in one loop;
+        // Jit runs translated x86-64 blocks and interprets the rest; Native
+        // runs the blocks of the program given to set_native_program(), and
+        // is Switch without one.
+        enum class Engine
+        {
+            Classic,
+            Switch,
+            Jit,
+            Native
+        };
+
+        // The VM does all of its input and output through io, which is a
+        // ConsoleIO unless given.
+        VirtualMachine(std::vector<std::uint16_t> const& init_mem,
+                std::shared_ptr<GuestIO> io = std::shared_ptr<GuestIO>());
+        VirtualMachine(ProgramImage const& image,
+                std::shared_ptr<GuestIO> io = std::shared_ptr<GuestIO>());
         virtual ~VirtualMachine();
 
+        // Runs until the guest halts, or until it wants input that its
+        // GuestIO does not have yet. In that case the VM is still running and
+        // waiting_for_input() is true; run() again once there is input, and
+        // the guest carries on from the same IN. run() also returns when the
+        // guest stops (see stopped()).
         void run();
         bool is_running() const;
+        bool waiting_for_input() const;
+
+        GuestIO& io() const;
+
+        // How many guest instructions this VM has executed.
+        std::uint64_t instructions_executed() const;
+
+        Engine engine() const;
+        void set_engine(Engine engine);
+
+        // Gives the Native engine code translated ahead of time (see
+        // NativeProgram). The program has to outlive the VM.
+        void set_native_program(NativeProgram const* program);
+
+        // In verified mode, operands are checked once when an instruction is
+        // decoded, and instructions that pass run on handlers without any
+        // operand checks. Instructions that fail still throw when executed.
+        bool verified_mode() const;
+        void set_verified_mode(bool verified);
+
+        // The guest stack grows without bound unless given a maximum depth.
+        // A PUSH or CALL beyond it fails with std::overflow_error.
+        std::size_t stack_limit() const;
+        void set_stack_limit(std::size_t max_depth);
+        std::size_t stack_high_water_mark() const;
+
+        // Guest output is buffered and written to the GuestIO when the guest
+        // waits for input, when run() returns, or when the buffer reaches
+        // its size limit. Input is read from the GuestIO in chunks and
+        // handed to the guest a character at a time.
+        std::size_t output_buffer_size() const;
+        void set_output_buffer_size(std::size_t size);
+        void flush_output();
 
+        // Every line the guest reads is appended to this file. The log is
+        // off by default, and an empty path turns it off again.
+        void set_input_log_path(std::string const& path);
+
+        // Snapshots hold memory, registers, the stack, the PC and whether
+        // the VM is still running. Both throw std::runtime_error on failure;
+        // a failed restore leaves the VM as it was. Restoring is otherwise
+        // the same as restore_state().
+        void save_snapshot(std::string const& path) const;
+        void restore_snapshot(std::string const& path);
+
+        // By default the VM copies the program into memory of its own. This
+        // backs memory with a copy-on-write mapping of image instead (see
+        // ProgramImage::map_memory()), keeping what the guest has written so
+        // far, so that VMs and processes running the same program file share
+        // the pages the guest has not written. Resident memory then grows
+        // with the pages written rather than with the number of VMs.
+        void share_memory(ProgramImage const& image);
+
+        // The same as a snapshot, in memory, for copying a guest between VMs
+        // loaded from the same program. Restoring also drops any input the
+        // VM has read from its GuestIO but not yet handed to the guest.
+        struct State
+        {
+            std::vector<std::uint16_t> memory;
+            std::array<std::uint16_t, 8> registers;
+            std::vector<std::uint16_t> stack;
+            std::uint16_t program_counter;
+            bool running;
+        };
+        State capture_state() const;
+        void restore_state(State const& state);
+
+        // Saves a snapshot to the given path just before the guest reads
+        // input line number line (counting from 0), or the next time it
+        // starts reading a line after request_snapshot().
+        void set_snapshot_path(std::string const& path);
+        void set_snapshot_line(std::uint64_t line);
+        void request_snapshot();
+
+        // With profiling on, the VM counts how often each opcode and each
+        // address runs and how often each branch is taken. The JIT engine
+        // interprets while profiling, so every engine gives the same counts.
+        bool profiling() const;
+        void set_profiling(bool enabled);
+        Profile const& profile() const;
+        void report_profile(std::ostream& out) const;
+
+        // With memoization on, the VM watches every CALL, and caches the
+        // results of routines that only use registers and their own part of
+        // the stack (see Memoizer). A CALL whose routine and registers have
+        // been seen before then skips the routine. At most capacity results
+        // are kept, and any write to memory drops them all. Memoization runs
+        // on the interpreter; a capacity of 0 turns it off.
+        bool memoizing() const;
+        void set_memoization(std::size_t capacity);
+        Memoizer::Stats memoization_stats() const;
+        void report_memoization(std::ostream& out) const;
+
+        // With recording on, the VM keeps what each instruction changed, up
+        // to capacity deltas (see Recorder), and can step back and forward
+        // through them without running anything. Running again after
+        // stepping back carries on from there and drops what was undone. A
+        // CALL to an intrinsic, restoring a snapshot or the code 7 override
+        // forgets the record. Recording runs on the interpreter; a capacity
+        // of 0 turns it off.
+        bool recording() const;
+        void set_recording(std::size_t capacity);
+        // Undo or redo up to count instructions and return how many were.
+        std::uint64_t step_back(std::uint64_t count = 1);
+        std::uint64_t step_forward(std::uint64_t count = 1);
+        std::uint64_t undoable_steps() const;
+        std::uint64_t redoable_steps() const;
+
+        // With fusion on, verified decoding also looks for a few common
+        // instruction sequences and runs each as a single instruction: EQ or
+        // GT followed by a JT or JF on the result, ADD followed by an RMEM
+        // from the sum, PUSH PUSH CALL, and runs of OUTs of literal
+        // characters. A write to any word of a fused sequence breaks it up
+        // again. Profiling, memoization and debug mode see every instruction,
+        // so fusion waits while any of them is on.
+        enum class Fusion
+        {
+            CompareBranch,
+            AddRead,
+            CallPrologue,
+            OutRun
+        };
+        static const std::size_t FusionKinds = 4;
+        bool fusing() const;
+        void set_fusion(bool enabled);
+        // How often each kind of sequence ran, and the instructions it ran.
+        std::uint64_t fused_runs(Fusion kind) const;
+        std::uint64_t fused_instructions(Fusion kind) const;
+        void report_fusion(std::ostream& out) const;
+
+        // Breakpoints and watchpoints stop the guest just before an
+        // instruction runs: a breakpoint at the instruction's address, a
+        // read watchpoint at an RMEM from a watched word, and a write
+        // watchpoint at a WMEM to one. Either can have a condition on a
+        // register. run() then returns with the VM still running and
+        // stopped() saying why, and the next run() starts with that
+        // instruction, without stopping there again. Both are patched into
+        // decoded instructions, so code without any runs as fast as ever;
+        // while any are set, the JIT and native engines interpret.
+        struct Condition
+        {
+            enum class Test : std::uint8_t
+            {
+                Always,
+                Equal,
+                NotEqual,
+                Less,
+                Greater
+            };
+
+            Condition() : test(Test::Always), reg(0), value(0) {}
+            Condition(Test test, unsigned reg, std::uint16_t value) : test(test), reg(reg), value(value) {}
+
+            Test test;
+            unsigned reg;
+            std::uint16_t value;
+        };
+
+        struct Watchpoint
+        {
+            // The words watched, first to last inclusive.
+            std::uint16_t first;
+            std::uint16_t last;
+            bool read;
+            bool write;
+            Condition condition;
+        };
+
+        struct Stop
+        {
+            enum class Reason
+            {
+                None,
+                Breakpoint,
+                Read,
+                Write,
+                // request_stop()
+                Request
+            };
+
+            Reason reason;
+            // The word read or written, for Read and Write.
+            std::uint16_t address;
+        };
+
+        void set_breakpoint(std::uint16_t address, Condition condition = Condition());
+        void clear_breakpoint(std::uint16_t address);
+        std::map<std::uint16_t, Condition> const& breakpoints() const;
+        // Returns the number clear_watchpoint() takes.
+        unsigned set_watchpoint(Watchpoint const& watchpoint);
+        // Returns false if there is no watchpoint id.
+        bool clear_watchpoint(unsigned id);
+        std::map<unsigned, Watchpoint> const& watchpoints() const;
+
+        // Why the last run() stopped, if it did.
+        Stop stopped() const;
+
+        // Runs the instruction at the PC, even if a breakpoint or
+        // watchpoint is on it.
+        void step_instruction();
+
+        // The request_ functions are safe to call from a signal handler. The
+        // VM acts on them from run(), the next time the guest jumps or waits
+        // for input, so the dispatch loops only look for them on jumps.
+
+        // Has the profile written to stderr.
+        void request_profile_report();
+
+        // Stops the guest as a breakpoint would.
+        void request_stop();
+
+        // In debug mode, the VM dumps its state before every instruction.
+        void request_debug_toggle();
         bool debugging() const;
         void start_debugging();
         void stop_debugging();
         void dump() const;
 
+        // Sets R7 to the teleporter energy level and has the teleporter
+        // confirmation routine run natively.
+        void request_code_7_override();
         void code_7_override();
 
+        // A host function that stands in for the guest routine at some
+        // address. A CALL to that address runs it instead, after which the
+        // guest carries on after the CALL as if the routine had returned.
+        // It has to leave registers, memory and the stack as the routine
+        // would have.
+        typedef std::function<void(VirtualMachine& vm)> Intrinsic;
+        void register_intrinsic(std::uint16_t address, Intrinsic intrinsic);
+        void unregister_intrinsic(std::uint16_t address);
+
+        // Guest state, for intrinsics. These throw if an index, address or
+        // value is out of range, or on a pop from an empty stack. Setting a
+        // register is not recorded, so it forgets the recorded history.
+        std::uint16_t register_value(unsigned index) const;
+        void set_register_value(unsigned index, std::uint16_t value);
+        std::uint16_t memory_value(std::uint16_t address) const;
+        void set_memory_value(std::uint16_t address, std::uint16_t value);
+        void push_value(std::uint16_t value);
+        std::uint16_t pop_value();
+
+        // Disassembles memory as it is now, following control flow from
+        // address 0, from the PC and from any other entry points given.
+        Disassembler disassembler(std::vector<std::uint16_t> const& entries = std::vector<std::uint16_t>()) const;
         void disassemble_to_file(std::string const& filename) const;
         
     private:
-        enum class Expectation
+        friend class NativeRuntime;
+
+        // Copies the program straight into memory. Throws std::out_of_range
+        // if it does not fit.
+        VirtualMachine(std::uint16_t const* program, std::size_t size, std::shared_ptr<GuestIO> io);
+
+        enum class OperandKind : std::uint8_t
         {
-            Instruction,
-            Argument
+            Literal,
+            Register,
+            Invalid
         };
 
         // An instruction returns false if the VM is supposed to halt.
@@ -38,10 +325,11 @@ namespace Backend
 
         struct Instruction
         {
-            Instruction(std::uint16_t opcode, std::string name, int numArguments, InstructionFn fn) :
+            Instruction(std::uint16_t opcode, std::string name, int numArguments, bool writesRegister, InstructionFn fn) :
                 opcode(opcode),
                 name(name),
                 numArguments(numArguments),
+                writesRegister(writesRegister),
                 fn(fn)
             {
             }
@@ -49,12 +337,56 @@ namespace Backend
             std::uint16_t opcode;
             std::string name;
             int numArguments;
+            // Whether the first argument is the register the result goes to.
+            bool writesRegister;
             InstructionFn fn;
         };
 
-        void next_word(std::uint16_t word);
+        // One fully decoded instruction as it sits in memory at some address.
+        // An opcode of NotDecoded marks a cache slot that must be (re)decoded
+        // from memory before it can be executed.
+        struct DecodedInstruction
+        {
+            static const std::uint8_t NotDecoded = 0xff;
+
+            std::uint8_t opcode;
+            // Index into handlerTable.
+            std::uint8_t handler;
+            std::uint8_t length;
+            std::array<OperandKind, 3> kinds;
+            std::array<std::uint16_t, 3> args;
+        };
+
+        static OperandKind operand_kind(std::uint16_t value);
+
+        // Returns the instruction starting at address, decoding it from memory
+        // if the cache does not hold it yet.
+        DecodedInstruction const& decode(std::uint16_t address);
+
+        // Drops every cached instruction that covers address, so a write to
+        // memory is seen the next time the PC reaches it.
+        void invalidate_decoded(std::uint16_t address);
+        void clear_decoded();
+
+        // Fills in the operands, length and handler of the instruction inst
+        // at address.
+        void decode_operands(Instruction const& inst, std::size_t address, DecodedInstruction& decoded) const;
+
+        // Decodes the instruction at address without caching it. Returns
+        // false unless it would run on a verified handler.
+        bool peek_verified(std::size_t address, DecodedInstruction& decoded) const;
+
+        // Turns a freshly decoded verified instruction into the head of a
+        // fused sequence, if it starts one.
+        void fuse(std::uint16_t address, DecodedInstruction& decoded);
+
+        // Whether every argument of a decoded instruction is valid for the
+        // way the instruction uses it.
+        static bool operands_valid(Instruction const& inst, DecodedInstruction const& decoded);
+
+        Instruction const* find_instruction(std::uint16_t opcode) const;
 
-        void add_instruction(std::uint16_t opcode, std::string name, int numArguments, InstructionFn fn);
+        void add_instruction(std::uint16_t opcode, std::string name, int numArguments, bool writesRegister, InstructionFn fn);
 
         // 0..32767 returns the value itself
         // 32768..32775 return the values from registers 0-7
@@ -68,6 +400,35 @@ namespace Backend
         // Checks that an address is in the range [0,32767] and returns it back.
         std::uint16_t check_memory_address(std::uint16_t address);        
 
+        // Stores a value in memory and drops any code translated from it.
+        void write_memory(std::uint16_t address, std::uint16_t value);
+        // The same, without recording the write.
+        void store_memory(std::uint16_t address, std::uint16_t value);
+
+        // Runs the intrinsic registered for a CALL target, if there is one.
+        bool call_intrinsic(std::uint16_t address);
+
+        // Returns Ready with a character, or why there is none.
+        GuestIO::InputStatus read_input(char& c);
+        GuestIO::InputStatus fill_input();
+
+        // Stops the dispatch loop at the IN that just ran, so run() can
+        // return and pick it up again later.
+        bool suspend_for_input();
+        void write_input_log();
+        void save_requested_snapshot();
+        void write_snapshot(std::string const& path, std::uint16_t pc) const;
+        // Replaces the whole guest state for restore_snapshot() and
+        // restore_state(), or throws std::overflow_error before changing
+        // anything if the stack does not fit under its limit.
+        void replace_state(std::uint16_t const* words, std::array<std::uint16_t, 8> const& values,
+                std::uint16_t const* stack_words, std::size_t depth, std::uint16_t pc, bool is_running);
+        // Drops everything derived from memory after it was replaced.
+        void memory_replaced();
+
+        static const std::uint64_t NoSnapshotLine = ~std::uint64_t(0);
+        void write_output(char c);
+
         bool halt_fn();
         bool set_fn();
         bool push_fn();
@@ -91,23 +452,203 @@ namespace Backend
         bool in_fn();
         bool nop_fn();
 
-        void jump_pc_to(std::uint16_t address);
+        // Handlers for verified instructions, one per opcode and combination
+        // of register operands. Registers has bit n set if argument n is a
+        // register, in which case the argument already holds its number.
+        template <std::uint16_t Opcode, unsigned Registers>
+        bool verified_fn();
+
+        // Reads argument N of a verified instruction.
+        template <unsigned Registers, int N>
+        std::uint16_t operand() const;
+
+        static const std::uint8_t VerifiedHandlers = 22;
+
+        // Handlers for fused sequences. Each runs from the head of its
+        // sequence, whose length covers the whole sequence, and reads the
+        // operands past the first instruction from memory.
+        template <std::uint16_t Compare, std::uint16_t Branch, unsigned Registers>
+        bool compare_branch_fn();
+        template <unsigned Registers>
+        bool add_read_fn();
+        template <unsigned Registers>
+        bool call_prologue_fn();
+        bool out_run_fn();
+
+        // CompareBranchHandlers + ((Compare - 4) * 2 + Branch - 7) * 8 +
+        // operand mask, with bit 0 for the compare's b, bit 1 for its c and
+        // bit 2 for the branch target; AddReadHandlers + mask of the ADD's b
+        // and c; CallPrologueHandlers + mask of the three operands.
+        static const std::uint8_t CompareBranchHandlers = VerifiedHandlers + 22 * 8;
+        static const std::uint8_t AddReadHandlers = CompareBranchHandlers + 32;
+        static const std::uint8_t CallPrologueHandlers = AddReadHandlers + 4;
+        static const std::uint8_t OutRunHandler = CallPrologueHandlers + 8;
+
+        // An instruction with a breakpoint on it. Its first argument holds
+        // its address, and the instruction itself is decoded again if it
+        // runs.
+        bool breakpoint_fn();
+        // RMEM and WMEM while any watchpoints are set. They take their
+        // arguments as they are in memory.
+        bool watched_rmem_fn();
+        bool watched_wmem_fn();
+
+        static const std::uint8_t BreakpointHandler = OutRunHandler + 1;
+        static const std::uint8_t WatchedReadHandler = BreakpointHandler + 1;
+        static const std::uint8_t WatchedWriteHandler = WatchedReadHandler + 1;
+
+        // Patches watchpoints, and breakpoints if asked to, into a freshly
+        // decoded instruction. Returns true if it did.
+        bool patch_stops(std::uint16_t address, DecodedInstruction& decoded, bool breakpoints) const;
+        bool holds(Condition const& condition) const;
+        // Whether the guest has to stop before the instruction at address,
+        // or before it touches the word at address.
+        bool breaks_at(std::uint16_t address) const;
+        bool watch_hit(std::uint16_t address, bool write) const;
+        // Leaves the PC on the instruction at address and stops the loop.
+        bool stop_at(std::uint16_t address, Stop::Reason reason, std::uint16_t data_address);
+        // OUT runs stop at this many characters.
+        static const std::uint16_t MaxOutRun = 64;
+        static const std::size_t MaxFusedLength = MaxOutRun * 2;
+
+        // Returns false if the dispatch loop has to pause so run() can
+        // serve a request.
+        bool jump_pc_to(std::uint16_t address);
+
+        // Acts on everything the request_ functions asked for.
+        void serve_requests();
+
+        // Decodes and runs the single instruction at the PC.
+        template <bool Profiled>
+        void step();
+
+        // Runs the chosen engine, or the debug loop, until the guest halts
+        // or a request pauses it.
+        void dispatch();
+
+        template <bool Profiled>
+        void run_classic();
+        template <bool Profiled>
+        void run_switch();
+        void run_jit();
+        void run_native();
+        void run_watched();
+        void run_debug();
+
+        // Runs the instruction at the PC through the memoizer and the
+        // recorder, whichever are on.
+        void step_watched();
+
+        // Whether the instruction at address is a CALL to an intrinsic.
+        bool calls_intrinsic(std::uint16_t address) const;
+
+        // Undoes or redoes one recorded change.
+        void replay(Recorder::Delta const& delta, bool forward);
+
+        // Tells the memoizer about the instruction at the PC before it runs.
+        // Returns true if it was a CALL that the cache answered.
+        bool memoize();
+
+        // Recounts, for every native block, how many of its words differ
+        // from the words it was translated from.
+        void check_native_blocks();
+        // Keeps that count up to date after a word changes.
+        void native_word_changed(std::uint16_t address, std::uint16_t old_value);
+
+        static std::uint32_t jit_write(VirtualMachine* vm, std::uint16_t address, std::uint16_t value);
 
         bool running;
+        // Set when a dispatch loop stopped early for a request rather than
+        // because the guest halted.
+        bool paused;
+        Engine active_engine;
+        std::uint64_t instruction_count;
+
+        std::uint16_t const* arguments;
 
-        Expectation expectation;
-        Instruction const* instruction;
-        std::vector<std::uint16_t> arguments;
+        std::vector<Instruction> instructionTable;
+        // The checked handlers, indexed by opcode, followed by the verified
+        // handlers at VerifiedHandlers + opcode * 8 + register mask and the
+        // fused handlers.
+        std::vector<InstructionFn> handlerTable;
+        bool verified;
+        std::array<DecodedInstruction, 0x8000> decode_cache;
 
-        std::unordered_map<std::uint16_t, Instruction> opcodeInstructionMap;
+        bool fusion;
+        // Whether decode() fuses right now; see dispatch().
+        bool fusion_active;
+        // Set for every word some fused sequence covers, until the cache is
+        // cleared.
+        std::vector<bool> fused_words;
+        std::array<std::uint64_t, FusionKinds> fusion_runs;
+        std::array<std::uint64_t, FusionKinds> fusion_instructions;
 
         std::uint16_t program_counter;
 
-        std::stack<std::uint16_t> stack;
+        GuestStack stack;
         std::array<std::uint16_t, 8> registers;
-        std::array<std::uint16_t, 0x8000> memory;
+        GuestMemory memory;
+
+        std::shared_ptr<GuestIO> guest_io;
+        // Set when run() returned because the guest is waiting for input.
+        bool suspended;
+
+        std::string output_buffer;
+        std::size_t output_limit;
 
         bool debug_mode;
+
+        // Only allocated once profiling is turned on.
+        std::unique_ptr<Profile> profile_data;
+        bool profile_enabled;
+
+        std::unique_ptr<Memoizer> memo;
+
+        std::unique_ptr<Recorder> recorder;
+        // Bit n is set if opcode n writes its result to a register.
+        std::uint32_t register_writers;
+        std::vector<Recorder::Delta> replayed;
+
+        // Set from signal handlers. requests_pending is raised along with
+        // any of the others, so the dispatch loops only check one flag.
+        volatile std::sig_atomic_t requests_pending;
+        volatile std::sig_atomic_t profile_report_requested;
+        volatile std::sig_atomic_t debug_toggle_requested;
+        volatile std::sig_atomic_t override_requested;
+        volatile std::sig_atomic_t stop_requested;
+
+        std::map<std::uint16_t, Condition> break_at;
+        std::map<unsigned, Watchpoint> watches;
+        unsigned next_watch;
+        Stop stop;
+        // Set while step_instruction() runs.
+        bool ignore_stops;
+
+        std::unique_ptr<Jit> jit;
+
+        static const std::uint16_t NoNativeBlock = 0xffff;
+        NativeProgram const* native_program;
+        // Indexed by address: the block that starts there if it can run,
+        // the block as translated, the start of the block covering the
+        // word, and how many words of the block starting there differ.
+        std::vector<NativeBlock> native_blocks;
+        std::vector<NativeBlock> native_translated;
+        std::vector<std::uint16_t> native_block_at;
+        std::vector<std::uint16_t> native_mismatches;
+
+        std::unordered_map<std::uint16_t, Intrinsic> intrinsics;
+        std::vector<char> input_buffer;
+        std::size_t input_pos;
+        std::size_t input_end;
+
+        std::string input_log_path;
         std::ofstream input_log;
+        // What the guest has read since the last line was logged.
+        std::string input_log_pending;
+        std::uint64_t input_lines;
+
+        std::string snapshot_path;
+        std::uint64_t snapshot_line;
+        volatile std::sig_atomic_t snapshot_requested;
     };
 }
@@ -0,0 +1,423 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "codestr.h"
+#include "file.h"
+#include "vm.h"
+
+using namespace Backend;
+using namespace Frontend;
+using std::uint16_t;
+
+namespace
+{
+    // The commands go_to_beach.sh sends before it needs the override.
+    const char* const WalkthroughCommands[] = {
+        "take tablet", "use tablet", "south", "north", "doorway", "north", "north",
+        "bridge", "continue", "down", "east", "take empty lantern", "west", "west",
+        "passage", "ladder", "west", "south", "north", "take can", "use can", "west",
+        "use lantern", "east", "east", "north", "south", "west", "north", "north",
+        "ladder", "darkness", "continue", "west", "west", "west", "west", "north",
+        "take red coin", "north", "east", "take concave coin", "down",
+        "take corroded coin", "up", "west", "west", "take blue coin", "up",
+        "take shiny coin", "down", "east", "use blue coin", "use red coin",
+        "use shiny coin", "use concave coin", "use corroded coin", "look", "north",
+        "take teleporter", "use teleporter", "take business card",
+        "take strange book", "look strange book"
+    };
+
+    struct Workload
+    {
+        std::string name;
+        std::vector<uint16_t> program;
+        // Fed to the guest as its whole input; the VM halts when it ends.
+        std::string input;
+        // For the synthetic loops, which make up the per-opcode-class
+        // breakdown, the opcodes of the loop body. Every iteration also runs
+        // the loop's own ADD and JT.
+        std::string opcode_class;
+    };
+
+    struct Result
+    {
+        std::uint64_t instructions;
+        std::size_t output_bytes;
+        double seconds;
+        long peak_rss_kb;
+    };
+
+    struct EngineChoice
+    {
+        char const* name;
+        VirtualMachine::Engine engine;
+        bool verified;
+        bool profiled;
+        bool fused;
+    };
+
+    const EngineChoice Engines[] = {
+        { "classic", VirtualMachine::Engine::Classic, false, false, false },
+        { "classic-verified", VirtualMachine::Engine::Classic, true, false, false },
+        { "switch", VirtualMachine::Engine::Switch, false, false, false },
+        { "switch-verified", VirtualMachine::Engine::Switch, true, false, false },
+        { "switch-fused", VirtualMachine::Engine::Switch, true, false, true },
+        { "switch-profiled", VirtualMachine::Engine::Switch, false, true, false },
+#if defined(__x86_64__)
+        { "jit", VirtualMachine::Engine::Jit, false, false, false },
+#endif
+    };
+
+    // Builds a code string the same way a user would type one for -c.
+    class CodeBuilder
+    {
+    public:
+        CodeBuilder& operator()(std::initializer_list<unsigned> words)
+        {
+            for (auto word : words)
+            {
+                if (!code.empty())
+                {
+                    code += ",";
+                }
+                code += std::to_string(word);
+                ++size;
+            }
+            return *this;
+        }
+
+        std::string code;
+        unsigned size = 0;
+    };
+
+    const unsigned R0 = 32768, R1 = 32769, R2 = 32770, R3 = 32771, R6 = 32774, R7 = 32775;
+
+    // Guest numbers stop at 32767, so the loop counts passes in R6 and
+    // PassLength iterations per pass in R7.
+    const unsigned PassLength = 10000;
+
+    // A loop that runs body passes * PassLength times. `tail` is the
+    // address of a RET placed after the loop's HALT, for bodies that need
+    // something to call.
+    Workload synthetic(std::string const& name, std::string const& opcodes, unsigned passes,
+            std::function<void(CodeBuilder&, unsigned tail)> body)
+    {
+        // Lay the loop out once to find where it ends, then for real.
+        CodeBuilder sizing;
+        body(sizing, 0);
+        auto tail = 3 + 3 + 3 + sizing.size + 4 + 3 + 4 + 3 + 1;
+
+        CodeBuilder b;
+        b({ 1, R6, passes });
+        b({ 1, R3, 0 });
+        auto pass_top = b.size;
+        b({ 1, R7, PassLength });
+        auto top = b.size;
+        body(b, tail);
+        b({ 9, R7, R7, 32767 });
+        b({ 7, R7, top });
+        b({ 9, R6, R6, 32767 });
+        b({ 7, R6, pass_top });
+        b({ 0 });
+        b({ 18 });
+
+        Workload w;
+        w.name = "synthetic-" + name;
+        w.program = code_points_from_str(b.code);
+        w.opcode_class = opcodes;
+        return w;
+    }
+
+    std::vector<Workload> workloads(std::string const& materials)
+    {
+        std::vector<Workload> all;
+
+        Workload rr;
+        rr.name = "rr.bin";
+        rr.program = code_points_from_file(materials + "/rr.bin");
+        rr.input = "\n";
+        all.push_back(rr);
+
+        Workload self_test;
+        self_test.name = "challenge-self-test";
+        self_test.program = code_points_from_file(materials + "/challenge.bin");
+        all.push_back(self_test);
+
+        Workload walkthrough;
+        walkthrough.name = "challenge-walkthrough";
+        walkthrough.program = self_test.program;
+        for (auto command : WalkthroughCommands)
+        {
+            walkthrough.input += command;
+            walkthrough.input += "\n";
+        }
+        all.push_back(walkthrough);
+
+        const unsigned Passes = 20;
+        all.push_back(synthetic("alu", "ADD MULT MOD AND OR NOT", Passes, [](CodeBuilder& b, unsigned)
+        {
+            for (auto i = 0; i < 4; ++i)
+            {
+                b({ 9, R0, R0, R1 });
+                b({ 10, R1, R1, 3 });
+                b({ 11, R2, R0, 7 });
+                b({ 12, R1, R1, R0 });
+                b({ 13, R2, R2, 5 });
+                b({ 14, R0, R0 });
+            }
+        }));
+        all.push_back(synthetic("branch", "EQ JT JF", Passes, [](CodeBuilder& b, unsigned)
+        {
+            for (auto i = 0; i < 8; ++i)
+            {
+                b({ 4, R1, R0, R3 });
+                b({ 8, R3, b.size + 3 });
+                b({ 7, R1, b.size + 3 });
+            }
+        }));
+        all.push_back(synthetic("memory", "WMEM RMEM", Passes, [](CodeBuilder& b, unsigned)
+        {
+            for (auto i = 0; i < 8; ++i)
+            {
+                b({ 16, 20000 + unsigned(i), R7 });
+                b({ 15, R0, 20000 + unsigned(i) });
+            }
+        }));
+        all.push_back(synthetic("stack", "PUSH POP", Passes, [](CodeBuilder& b, unsigned)
+        {
+            for (auto i = 0; i < 8; ++i)
+            {
+                b({ 2, R7 });
+                b({ 3, R0 });
+            }
+        }));
+        all.push_back(synthetic("call", "CALL RET", Passes, [](CodeBuilder& b, unsigned tail)
+        {
+            for (auto i = 0; i < 8; ++i)
+            {
+                b({ 17, tail });
+            }
+        }));
+        all.push_back(synthetic("out", "OUT", Passes, [](CodeBuilder& b, unsigned)
+        {
+            for (auto i = 0; i < 8; ++i)
+            {
+                b({ 19, 'x' });
+            }
+        }));
+
+        return all;
+    }
+
+    // Feeds the workload's input from memory and only counts the output,
+    // so the guest halts once it has read everything.
+    class CountingIO : public MemoryInput
+    {
+    public:
+        explicit CountingIO(std::string const& input) :
+            MemoryInput(input),
+            bytes(0)
+        {
+            end_input();
+        }
+
+        void write(char const*, std::size_t size) override
+        {
+            bytes += size;
+        }
+
+        std::size_t bytes;
+    };
+
+    Result run_once(Workload const& workload, EngineChoice const& engine)
+    {
+        auto io = std::make_shared<CountingIO>(workload.input);
+        VirtualMachine vm(workload.program, io);
+        vm.set_engine(engine.engine);
+        vm.set_verified_mode(engine.verified);
+        vm.set_profiling(engine.profiled);
+        vm.set_fusion(engine.fused);
+
+        Result result;
+
+        auto start = std::chrono::steady_clock::now();
+        vm.run();
+        auto stop = std::chrono::steady_clock::now();
+
+        result.output_bytes = io->bytes;
+        result.instructions = vm.instructions_executed();
+        result.seconds = std::chrono::duration<double>(stop - start).count();
+        return result;
+    }
+
+    Result fastest_of(Workload const& workload, EngineChoice const& engine, int repetitions)
+    {
+        Result best = Result();
+        for (auto i = 0; i < repetitions; ++i)
+        {
+            auto result = run_once(workload, engine);
+            if (i == 0 || result.seconds < best.seconds)
+            {
+                best = result;
+            }
+        }
+        return best;
+    }
+
+    // Runs the repetitions in a child process, so the peak RSS is that of
+    // this workload on this engine rather than of every run so far.
+    Result measure(Workload const& workload, EngineChoice const& engine, int repetitions)
+    {
+        int fds[2];
+        if (pipe(fds) < 0)
+        {
+            throw std::runtime_error("Could not create a pipe for the benchmark");
+        }
+
+        std::fflush(stdout);
+        auto pid = fork();
+        if (pid < 0)
+        {
+            close(fds[0]);
+            close(fds[1]);
+            throw std::runtime_error("Could not fork the benchmark");
+        }
+
+        if (pid == 0)
+        {
+            close(fds[0]);
+            auto status = 0;
+            try
+            {
+                auto best = fastest_of(workload, engine, repetitions);
+                if (write(fds[1], &best, sizeof(best)) != sizeof(best))
+                {
+                    status = 1;
+                }
+            }
+            catch (std::exception const& ex)
+            {
+                std::cerr << "Error during benchmark: " << ex.what() << std::endl;
+                status = 1;
+            }
+            _exit(status);
+        }
+
+        close(fds[1]);
+        Result best = Result();
+        auto got = read(fds[0], &best, sizeof(best));
+        close(fds[0]);
+
+        auto status = 0;
+        struct rusage usage;
+        if (wait4(pid, &status, 0, &usage) < 0 || got != sizeof(best) ||
+                !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            throw std::runtime_error(workload.name + " failed on " + engine.name);
+        }
+
+        best.peak_rss_kb = usage.ru_maxrss;
+        return best;
+    }
+
+    void usage()
+    {
+        std::cerr << "Usage: vmbench [-m materials_dir] [-n repetitions] [-w workload] [-e engine]" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string materials = MATERIALS_DIR;
+    std::string only_workload;
+    std::string only_engine;
+    auto repetitions = 5;
+
+    for (auto i = 1; i < argc; ++i)
+    {
+        auto arg = std::string{argv[i]};
+        auto hasValue = i + 1 < argc;
+
+        if (arg == "-m" && hasValue)
+        {
+            materials = argv[++i];
+        }
+        else if (arg == "-n" && hasValue)
+        {
+            repetitions = std::atoi(argv[++i]);
+        }
+        else if (arg == "-w" && hasValue)
+        {
+            only_workload = argv[++i];
+        }
+        else if (arg == "-e" && hasValue)
+        {
+            only_engine = argv[++i];
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (repetitions < 1)
+    {
+        usage();
+        return 1;
+    }
+
+    try
+    {
+        // One JSON object per line: the fastest of the repetitions of one
+        // workload on one engine. The synthetic workloads give ns per
+        // instruction for each opcode class.
+        for (auto const& workload : workloads(materials))
+        {
+            if (!only_workload.empty() && workload.name != only_workload)
+            {
+                continue;
+            }
+
+            for (auto const& engine : Engines)
+            {
+                if (!only_engine.empty() && engine.name != only_engine)
+                {
+                    continue;
+                }
+
+                auto best = measure(workload, engine, repetitions);
+                auto seconds = best.seconds > 0 ? best.seconds : 1e-9;
+                auto opcode_class = workload.opcode_class.empty() ? std::string("null") :
+                    "\"" + workload.opcode_class + "\"";
+                std::printf("{\"workload\": \"%s\", \"opcode_class\": %s, \"engine\": \"%s\", "
+                        "\"instructions\": %llu, \"seconds\": %.6f, \"instructions_per_second\": %.0f, "
+                        "\"ns_per_instruction\": %.3f, \"output_bytes\": %zu, \"peak_rss_kb\": %ld}\n",
+                        workload.name.c_str(), opcode_class.c_str(), engine.name,
+                        static_cast<unsigned long long>(best.instructions),
+                        best.seconds, best.instructions / seconds,
+                        best.instructions > 0 ? seconds * 1e9 / best.instructions : 0.0,
+                        best.output_bytes, best.peak_rss_kb);
+                std::fflush(stdout);
+            }
+        }
+    }
+    catch (std::exception const& ex)
+    {
+        std::cerr << "Error during benchmark: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "explorer.h"
+#include "start.h"
+
+using namespace Backend;
+using namespace Explore;
+
+namespace
+{
+    void usage()
+    {
+        std::cout << "Usage: explore program.bin [-i script] [-t target_text] [-j threads] "
+            "[-n max_states] [-d max_depth] [-g graph.dot]" << std::endl;
+        std::cout << "Explores every state reachable from where the script leaves the guest, "
+            "lists each room's exits and prints the shortest commands to the target text" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc % 2 != 0)
+    {
+        usage();
+        return 1;
+    }
+
+    Explorer::Options options;
+    options.configure = &configure;
+    std::string script;
+    std::string dot_path;
+
+    try
+    {
+        for (auto i = 2; i < argc; i += 2)
+        {
+            auto option = std::string{argv[i]};
+            auto value = argv[i + 1];
+            if (option == "-i")
+            {
+                script = contents_of_file(value);
+            }
+            else if (option == "-t")
+            {
+                options.target = value;
+            }
+            else if (option == "-j")
+            {
+                options.threads = unsigned(std::strtoul(value, nullptr, 10));
+            }
+            else if (option == "-n")
+            {
+                options.max_states = std::strtoul(value, nullptr, 10);
+            }
+            else if (option == "-d")
+            {
+                options.max_depth = unsigned(std::strtoul(value, nullptr, 10));
+            }
+            else if (option == "-g")
+            {
+                dot_path = value;
+            }
+            else
+            {
+                usage();
+                return 1;
+            }
+        }
+
+        auto image = std::make_shared<ProgramImage const>(argv[1]);
+        Explorer explorer(image, options);
+        auto states = explorer.explore(start_after(*image, script));
+
+        explorer.write_places(std::cout);
+        std::cout << std::endl << states << " states" << std::endl;
+
+        if (!dot_path.empty())
+        {
+            std::ofstream dot(dot_path);
+            explorer.write_dot(dot);
+        }
+
+        if (!options.target.empty())
+        {
+            if (explorer.found().empty())
+            {
+                std::cout << "Nothing said \"" << options.target << "\"" << std::endl;
+                return 1;
+            }
+
+            auto path = explorer.path_to(explorer.found().front());
+            std::cout << "\"" << options.target << "\" after " << path.size() << " commands:" << std::endl;
+            for (auto const& command : path)
+            {
+                std::cout << command << std::endl;
+            }
+        }
+    }
+    catch (std::exception const& ex)
+    {
+        std::cerr << "Error: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "search.h"
+#include "start.h"
+
+using namespace Backend;
+using namespace Explore;
+
+namespace
+{
+    void usage()
+    {
+        std::cout << "Usage: search program.bin -s success_regex [-i script] [-a action]... [-A actions_file] "
+            "[-u] [-m min_length] [-M max_length] [-j threads]" << std::endl;
+        std::cout << "Tries orderings of the actions, or with -u choices of them, after the script, "
+            "until one prints a match for the success pattern" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        usage();
+        return 1;
+    }
+
+    InputSearch::Options options;
+    options.configure = &configure;
+    std::string script;
+
+    try
+    {
+        for (auto i = 2; i < argc; ++i)
+        {
+            auto option = std::string{argv[i]};
+            auto hasValue = i + 1 < argc;
+            if (option == "-u")
+            {
+                options.ordered = false;
+            }
+            else if (option == "-i" && hasValue)
+            {
+                script = contents_of_file(argv[++i]);
+            }
+            else if (option == "-a" && hasValue)
+            {
+                options.actions.push_back(argv[++i]);
+            }
+            else if (option == "-A" && hasValue)
+            {
+                std::istringstream lines(contents_of_file(argv[++i]));
+                std::string line;
+                while (std::getline(lines, line))
+                {
+                    if (!line.empty())
+                    {
+                        options.actions.push_back(line);
+                    }
+                }
+            }
+            else if (option == "-s" && hasValue)
+            {
+                options.success = argv[++i];
+            }
+            else if (option == "-m" && hasValue)
+            {
+                options.min_length = std::strtoul(argv[++i], nullptr, 10);
+            }
+            else if (option == "-M" && hasValue)
+            {
+                options.max_length = std::strtoul(argv[++i], nullptr, 10);
+            }
+            else if (option == "-j" && hasValue)
+            {
+                options.threads = unsigned(std::strtoul(argv[++i], nullptr, 10));
+            }
+            else
+            {
+                usage();
+                return 1;
+            }
+        }
+
+        if (options.success.empty())
+        {
+            usage();
+            return 1;
+        }
+
+        auto image = std::make_shared<ProgramImage const>(argv[1]);
+        InputSearch search(image, options);
+        auto result = search.search(start_after(*image, script));
+
+        std::cout << result.runs << " actions run, " << result.unshared_runs
+            << " without sharing prefixes" << std::endl;
+        if (!result.found)
+        {
+            std::cout << "Nothing matched" << std::endl;
+            return 1;
+        }
+
+        for (auto const& action : result.actions)
+        {
+            std::cout << action << std::endl;
+        }
+        std::cout << std::endl << result.output;
+    }
+    catch (std::exception const& ex)
+    {
+        std::cerr << "Error: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include "start.h"
+
+#include "io.h"
+#include "runner.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace Backend;
+
+std::string Explore::contents_of_file(std::string const& filename)
+{
+    std::ifstream ifile(filename, std::ifstream::binary);
+    if (!ifile)
+    {
+        throw std::runtime_error("Could not open " + filename);
+    }
+
+    std::ostringstream contents;
+    contents << ifile.rdbuf();
+    return contents.str();
+}
+
+void Explore::configure(VirtualMachine& vm)
+{
+    vm.set_engine(VirtualMachine::Engine::Switch);
+    vm.set_fusion(true);
+    vm.set_verified_mode(true);
+}
+
+VirtualMachine::State Explore::start_after(ProgramImage const& image, std::string const& script)
+{
+    // VMs are too big for the stack.
+    std::unique_ptr<VirtualMachine> vm(new VirtualMachine(image, std::make_shared<StringIO>()));
+    auto start = continue_from(image, vm->capture_state(), script, &configure);
+    if (start.halted)
+    {
+        throw std::runtime_error("The guest halted before the end of the script: " + start.output);
+    }
+    return start.state;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "image.h"
+#include "vm.h"
+
+namespace Explore
+{
+    std::string contents_of_file(std::string const& filename);
+
+    // Sets up a VM for many short runs: the switch engine with fusion.
+    void configure(Backend::VirtualMachine& vm);
+
+    // Runs the script from the start of the program, and returns the guest
+    // waiting for the next command. Throws std::runtime_error if the guest
+    // halts first.
+    Backend::VirtualMachine::State start_after(Backend::ProgramImage const& image, std::string const& script);
+}
@@ -1,8 +1,95 @@
 #include "args.h"
 
+#include "debugger.h"
+#include "intrinsics.h"
+#include "signals.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+using namespace Backend;
 using namespace Frontend;
 
-Arguments::Arguments(int argc, char *argv[])
+namespace
+{
+    bool engine_from_str(std::string const& name, VirtualMachine::Engine& engine)
+    {
+        if (name == "classic")
+        {
+            engine = VirtualMachine::Engine::Classic;
+        }
+        else if (name == "switch")
+        {
+            engine = VirtualMachine::Engine::Switch;
+        }
+        else if (name == "jit")
+        {
+            engine = VirtualMachine::Engine::Jit;
+        }
+        else if (name == "native")
+        {
+            engine = VirtualMachine::Engine::Native;
+        }
+        else
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    // Dumps the state before each of the last count instructions, and the
+    // state now.
+    void dump_history(VirtualMachine& vm, std::uint64_t count)
+    {
+        count = vm.step_back(count);
+        std::cerr << "The last " << count << " instructions:" << std::endl;
+        for (std::uint64_t i = 0; i < count; ++i)
+        {
+            vm.dump();
+            vm.step_forward();
+        }
+        vm.dump();
+    }
+
+    // Parses "address=name", where address can be decimal or 0x-prefixed hex.
+    bool intrinsic_from_str(std::string const& spec, std::pair<std::uint16_t, std::string>& intrinsic)
+    {
+        auto equals = spec.find('=');
+        if (equals == std::string::npos || equals == 0 || equals + 1 == spec.size())
+        {
+            return false;
+        }
+
+        char* end = nullptr;
+        auto address = std::strtoul(spec.c_str(), &end, 0);
+        if (end != spec.c_str() + equals || address > 32767)
+        {
+            return false;
+        }
+
+        intrinsic.first = std::uint16_t(address);
+        intrinsic.second = spec.substr(equals + 1);
+        return true;
+    }
+}
+
+Arguments::Arguments(int argc, char *argv[]) :
+    engine(VirtualMachine::Engine::Classic),
+    verified(false),
+    stack_limit(GuestStack::Unlimited),
+    output_buffer_size(0),
+    input_log_path("input.log"),
+    snapshot_line(~std::uint64_t(0)),
+    profile(false),
+    memo_entries(0),
+    record_entries(0),
+    fusion(false),
+    share_image(false),
+    native_program(nullptr),
+    threads(0)
 {
     if (argc < 3)
     {
@@ -25,9 +112,186 @@ Arguments::Arguments(int argc, char *argv[])
         {
             type = InputType::DisassembleFile;
         }
+        else if (typeArg == "-r")
+        {
+            type = InputType::Snapshot;
+        }
+        else if (typeArg == "-b")
+        {
+            type = InputType::Batch;
+        }
         else
         {
             type = InputType::None;
         }
+
+        for (auto i = 3; i < argc && type != InputType::None; ++i)
+        {
+            auto optionArg = std::string{argv[i]};
+            auto hasValue = i + 1 < argc;
+
+            if (optionArg == "-e" && hasValue && engine_from_str(argv[i + 1], engine))
+            {
+                ++i;
+            }
+            else if (optionArg == "-V")
+            {
+                verified = true;
+            }
+            else if (optionArg == "-S" && hasValue)
+            {
+                stack_limit = std::strtoul(argv[++i], nullptr, 10);
+            }
+            else if (optionArg == "-B" && hasValue)
+            {
+                output_buffer_size = std::strtoul(argv[++i], nullptr, 10);
+            }
+            else if (optionArg == "-l" && hasValue)
+            {
+                input_log_path = argv[++i];
+            }
+            else if (optionArg == "-w" && hasValue)
+            {
+                snapshot_path = argv[++i];
+            }
+            else if (optionArg == "-W" && hasValue)
+            {
+                snapshot_line = std::strtoull(argv[++i], nullptr, 10);
+            }
+            else if (optionArg == "-p")
+            {
+                profile = true;
+            }
+            else if (optionArg == "-M" && hasValue)
+            {
+                memo_entries = std::strtoul(argv[++i], nullptr, 10);
+            }
+            else if (optionArg == "-R" && hasValue)
+            {
+                record_entries = std::strtoul(argv[++i], nullptr, 10);
+            }
+            else if (optionArg == "-C")
+            {
+                share_image = true;
+            }
+            else if (optionArg == "-D" && hasValue)
+            {
+                debug_commands = argv[++i];
+            }
+            else if (optionArg == "-F")
+            {
+                fusion = true;
+                verified = true;
+            }
+            else if (optionArg == "-I" && hasValue)
+            {
+                std::pair<std::uint16_t, std::string> intrinsic;
+                if (!intrinsic_from_str(argv[++i], intrinsic))
+                {
+                    type = InputType::None;
+                }
+                intrinsics.push_back(intrinsic);
+            }
+            else if (optionArg == "-i" && hasValue)
+            {
+                input_scripts.push_back(argv[++i]);
+            }
+            else if (optionArg == "-j" && hasValue)
+            {
+                threads = unsigned(std::strtoul(argv[++i], nullptr, 10));
+            }
+            else
+            {
+                type = InputType::None;
+            }
+        }
+    }
+}
+
+void Arguments::configure(VirtualMachine& vm) const
+{
+    vm.set_engine(engine);
+    vm.set_native_program(native_program);
+    vm.set_verified_mode(verified);
+    vm.set_stack_limit(stack_limit);
+    if (output_buffer_size > 0)
+    {
+        vm.set_output_buffer_size(output_buffer_size);
+    }
+    vm.set_input_log_path(input_log_path);
+    vm.set_snapshot_path(snapshot_path);
+    vm.set_snapshot_line(snapshot_line);
+    vm.set_profiling(profile);
+    vm.set_memoization(memo_entries);
+    vm.set_recording(record_entries);
+    vm.set_fusion(fusion);
+
+    for (auto const& intrinsic : intrinsics)
+    {
+        auto fn = find_intrinsic(intrinsic.second);
+        if (!fn)
+        {
+            throw std::runtime_error("There is no intrinsic called " + intrinsic.second);
+        }
+        vm.register_intrinsic(intrinsic.first, fn);
+    }
+}
+
+void Frontend::run_vm(VirtualMachine& vm, Arguments const& args)
+{
+    args.configure(vm);
+    SignalRouter signals(vm, !args.debug_commands.empty());
+
+    auto report = [&]()
+    {
+        if (args.profile)
+        {
+            vm.report_profile(std::cerr);
+        }
+        if (vm.memoizing())
+        {
+            vm.report_memoization(std::cerr);
+        }
+        if (vm.fusing())
+        {
+            vm.report_fusion(std::cerr);
+        }
+    };
+
+    try
+    {
+        if (args.debug_commands.empty())
+        {
+            vm.run();
+        }
+        else
+        {
+            std::ifstream commands(args.debug_commands);
+            if (!commands)
+            {
+                throw std::runtime_error("Could not open " + args.debug_commands);
+            }
+
+            Debugger debugger(vm, commands, std::cerr);
+            if (debugger.prompt())
+            {
+                do
+                {
+                    vm.run();
+                }
+                while (vm.stopped().reason != VirtualMachine::Stop::Reason::None && debugger.prompt());
+            }
+        }
     }
+    catch (...)
+    {
+        report();
+        if (vm.recording())
+        {
+            dump_history(vm, 16);
+        }
+        throw;
+    }
+
+    report();
 }
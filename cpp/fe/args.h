@@ -1,4 +1,10 @@
+#pragma once
+
 #include <string>
+#include <utility>
+#include <vector>
+
+#include "vm.h"
 
 namespace Frontend
 {
@@ -9,12 +15,54 @@ namespace Frontend
             None,
             DisassembleFile,
             File,
-            Code
+            Code,
+            Snapshot,
+            Batch
         };
         
         Arguments(int argc, char *argv[]);
+
+        // Applies the options that follow the input argument to a VM.
+        void configure(Backend::VirtualMachine& vm) const;
         
         InputType type;
         std::string arg;
+
+        Backend::VirtualMachine::Engine engine;
+        bool verified;
+        std::size_t stack_limit;
+        std::size_t output_buffer_size;
+        std::string input_log_path;
+        std::string snapshot_path;
+        std::uint64_t snapshot_line;
+        bool profile;
+        // For -M: how many results to memoize, or 0 for none.
+        std::size_t memo_entries;
+        // For -R: how many changes to record, or 0 for none.
+        std::size_t record_entries;
+        // -F, which implies -V.
+        bool fusion;
+        // -C: share the program's pages copy-on-write between VMs.
+        bool share_image;
+        // For -D: where the debugger reads its commands, such as /dev/tty,
+        // or empty for no debugger.
+        std::string debug_commands;
+        // Only set by programs that were translated ahead of time.
+        Backend::NativeProgram const* native_program;
+
+        // For -I address=name: the built-in intrinsics to register.
+        std::vector<std::pair<std::uint16_t, std::string>> intrinsics;
+
+        // For -b: the input scripts to run, and how many threads to use
+        // (0 for one per hardware thread).
+        std::vector<std::string> input_scripts;
+        unsigned threads;
     };
+
+    // Configures vm from args, routes signals to it and runs it. With -p and
+    // -M, the profile and the memoization statistics go to stderr
+    // afterwards, even if the guest failed. With -D, the debugger prompts on
+    // stderr before the guest starts and whenever it stops, and SIGINT
+    // stops it.
+    void run_vm(Backend::VirtualMachine& vm, Arguments const& args);
 }
@@ -23,12 +23,12 @@ namespace
     }
 }
 
-void Frontend::interpret_code_str(std::string const& code)
+void Frontend::interpret_code_str(std::string const& code, Arguments const& args)
 {
     auto code_points = code_points_from_str(code);
     
     VirtualMachine vm(code_points);
-    vm.run();
+    run_vm(vm, args);
 }
 
 std::vector<uint16_t> Frontend::code_points_from_str(std::string const& code)
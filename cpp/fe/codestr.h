@@ -2,9 +2,11 @@
 #include <vector>
 #include <cstdint>
 
+#include "args.h"
+
 namespace Frontend
 {
-    void interpret_code_str(std::string const& code);
+    void interpret_code_str(std::string const& code, Arguments const& args);
     
     std::vector<std::uint16_t> code_points_from_str(std::string const& code);
 }
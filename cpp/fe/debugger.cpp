@@ -0,0 +1,372 @@
+#include "debugger.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace Backend;
+using namespace Frontend;
+using std::uint16_t;
+
+namespace
+{
+    typedef VirtualMachine::Condition Condition;
+
+    // Parses a decimal or 0x-prefixed hex number up to limit.
+    bool number_from_str(std::string const& text, unsigned long limit, unsigned long& value)
+    {
+        if (text.empty())
+        {
+            return false;
+        }
+
+        char* end = nullptr;
+        value = std::strtoul(text.c_str(), &end, 0);
+        return *end == '\0' && value <= limit;
+    }
+
+    uint16_t address_from_str(std::string const& text)
+    {
+        unsigned long value;
+        if (!number_from_str(text, 32767, value))
+        {
+            throw std::invalid_argument("Not an address: " + text);
+        }
+        return uint16_t(value);
+    }
+
+    uint16_t value_from_str(std::string const& text)
+    {
+        unsigned long value;
+        if (!number_from_str(text, 65535, value))
+        {
+            throw std::invalid_argument("Not a value: " + text);
+        }
+        return uint16_t(value);
+    }
+
+    unsigned register_from_str(std::string const& text)
+    {
+        unsigned long index;
+        if (text.size() < 2 || (text[0] != 'r' && text[0] != 'R') || !number_from_str(text.substr(1), 7, index))
+        {
+            throw std::invalid_argument("Not a register: " + text);
+        }
+        return unsigned(index);
+    }
+
+    // Reads an optional count, which is 1 if it is missing.
+    std::uint64_t optional_count(std::istream& words)
+    {
+        std::string word;
+        if (!(words >> word))
+        {
+            return 1;
+        }
+
+        char* end = nullptr;
+        auto count = std::strtoull(word.c_str(), &end, 0);
+        if (*end != '\0')
+        {
+            throw std::invalid_argument("Not a count: " + word);
+        }
+        return count;
+    }
+
+    // Parses what follows "if", such as "r3 == 0x10", spaces optional.
+    Condition condition_from_stream(std::istream& words)
+    {
+        std::string text, word;
+        while (words >> word)
+        {
+            text += word;
+        }
+
+        static char const* const tests[] = { "==", "!=", "<", ">" };
+        static Condition::Test const kinds[] =
+        {
+            Condition::Test::Equal,
+            Condition::Test::NotEqual,
+            Condition::Test::Less,
+            Condition::Test::Greater
+        };
+        for (auto i = 0u; i < 4; ++i)
+        {
+            auto at = text.find(tests[i]);
+            if (at != std::string::npos)
+            {
+                auto length = std::string(tests[i]).size();
+                return Condition(kinds[i], register_from_str(text.substr(0, at)),
+                    value_from_str(text.substr(at + length)));
+            }
+        }
+
+        throw std::invalid_argument("Conditions look like r0 == 5, r0 != 5, r0 < 5 or r0 > 5");
+    }
+
+    // Reads an optional "if" and the condition after it.
+    Condition optional_condition(std::istream& words)
+    {
+        std::string word;
+        if (!(words >> word))
+        {
+            return Condition();
+        }
+        if (word != "if")
+        {
+            throw std::invalid_argument("Expected if, not " + word);
+        }
+        return condition_from_stream(words);
+    }
+
+    std::string describe(Condition const& condition)
+    {
+        static char const* const tests[] = { "", "==", "!=", "<", ">" };
+        if (condition.test == Condition::Test::Always)
+        {
+            return "";
+        }
+
+        std::ostringstream text;
+        text << " if r" << condition.reg << ' ' << tests[std::size_t(condition.test)] << ' ' << condition.value;
+        return text.str();
+    }
+
+    std::string hex(uint16_t value)
+    {
+        std::ostringstream text;
+        text << "0x" << std::hex << std::setw(4) << std::setfill('0') << value;
+        return text.str();
+    }
+}
+
+Debugger::Debugger(VirtualMachine& vm, std::istream& in, std::ostream& out) :
+    vm(vm),
+    in(in),
+    out(out)
+{
+}
+
+bool Debugger::prompt()
+{
+    show_stop();
+
+    std::string line;
+    for (;;)
+    {
+        out << "(debug) " << std::flush;
+        if (!std::getline(in, line))
+        {
+            // Nobody is left to give commands, so let the guest finish.
+            out << std::endl;
+            return vm.is_running();
+        }
+
+        auto quit = false;
+        try
+        {
+            if (!execute(line, quit))
+            {
+                return !quit && vm.is_running();
+            }
+        }
+        catch (std::logic_error const& ex)
+        {
+            out << ex.what() << std::endl;
+        }
+    }
+}
+
+bool Debugger::execute(std::string const& line, bool& quit)
+{
+    std::istringstream words(line);
+    std::string command;
+    if (!(words >> command))
+    {
+        return true;
+    }
+
+    if (command == "c" || command == "continue")
+    {
+        return false;
+    }
+    else if (command == "q" || command == "quit")
+    {
+        quit = true;
+        return false;
+    }
+    else if (command == "s" || command == "step")
+    {
+        auto count = optional_count(words);
+        for (std::uint64_t i = 0; i < count && vm.is_running(); ++i)
+        {
+            vm.step_instruction();
+        }
+        vm.flush_output();
+        vm.dump();
+    }
+    else if (command == "back" || command == "forward")
+    {
+        auto count = optional_count(words);
+        auto steps = command == "back" ? vm.step_back(count) : vm.step_forward(count);
+        out << "Moved " << command << " " << steps << " instructions" << std::endl;
+        vm.dump();
+    }
+    else if (command == "b" || command == "break")
+    {
+        std::string where;
+        words >> where;
+        auto address = address_from_str(where);
+        vm.set_breakpoint(address, optional_condition(words));
+    }
+    else if (command == "delete")
+    {
+        std::string where;
+        words >> where;
+        vm.clear_breakpoint(address_from_str(where));
+    }
+    else if (command == "w" || command == "watch")
+    {
+        std::string range, access;
+        words >> range;
+        auto dash = range.find('-');
+
+        VirtualMachine::Watchpoint watchpoint;
+        watchpoint.first = address_from_str(range.substr(0, dash));
+        watchpoint.last = dash == std::string::npos ? watchpoint.first : address_from_str(range.substr(dash + 1));
+        watchpoint.read = false;
+        watchpoint.write = true;
+
+        auto position = words.tellg();
+        if (words >> access && access != "if")
+        {
+            if (access != "r" && access != "w" && access != "rw")
+            {
+                throw std::invalid_argument("Watch r, w or rw, not " + access);
+            }
+            watchpoint.read = access.find('r') != std::string::npos;
+            watchpoint.write = access.find('w') != std::string::npos;
+        }
+        else
+        {
+            words.clear();
+            words.seekg(position);
+        }
+        watchpoint.condition = optional_condition(words);
+
+        out << "Watchpoint " << vm.set_watchpoint(watchpoint) << std::endl;
+    }
+    else if (command == "unwatch")
+    {
+        std::string id;
+        words >> id;
+        unsigned long number;
+        if (!number_from_str(id, ~0u, number) || !vm.clear_watchpoint(unsigned(number)))
+        {
+            throw std::invalid_argument("Not a watchpoint: " + id);
+        }
+    }
+    else if (command == "l" || command == "list")
+    {
+        list();
+    }
+    else if (command == "r" || command == "registers")
+    {
+        vm.dump();
+    }
+    else if (command == "x")
+    {
+        std::string where;
+        words >> where;
+        auto address = address_from_str(where);
+        auto count = optional_count(words);
+        for (std::uint64_t i = 0; i < count && address + i < 32768; ++i)
+        {
+            if (i % 8 == 0)
+            {
+                out << (i > 0 ? "\n" : "") << hex(uint16_t(address + i)) << ":";
+            }
+            out << " " << hex(vm.memory_value(uint16_t(address + i)));
+        }
+        out << std::endl;
+    }
+    else if (command == "set")
+    {
+        std::string reg, value;
+        words >> reg >> value;
+        vm.set_register_value(register_from_str(reg), value_from_str(value));
+    }
+    else if (command == "h" || command == "help")
+    {
+        help();
+    }
+    else
+    {
+        out << "Unknown command " << command << "; h lists them" << std::endl;
+    }
+
+    return true;
+}
+
+void Debugger::show_stop() const
+{
+    auto stop = vm.stopped();
+    switch (stop.reason)
+    {
+        case VirtualMachine::Stop::Reason::Breakpoint:
+            out << "Breakpoint at " << hex(stop.address) << std::endl;
+            break;
+        case VirtualMachine::Stop::Reason::Read:
+            out << "Read of " << hex(stop.address) << std::endl;
+            break;
+        case VirtualMachine::Stop::Reason::Write:
+            out << "Write to " << hex(stop.address) << std::endl;
+            break;
+        case VirtualMachine::Stop::Reason::Request:
+            out << "Interrupted" << std::endl;
+            break;
+        default:
+            return;
+    }
+    vm.dump();
+}
+
+void Debugger::list() const
+{
+    for (auto const& breakpoint : vm.breakpoints())
+    {
+        out << "Breakpoint at " << hex(breakpoint.first) << describe(breakpoint.second) << std::endl;
+    }
+    for (auto const& watch : vm.watchpoints())
+    {
+        auto const& watchpoint = watch.second;
+        out << "Watchpoint " << watch.first << " on " << hex(watchpoint.first);
+        if (watchpoint.last != watchpoint.first)
+        {
+            out << "-" << hex(watchpoint.last);
+        }
+        out << " " << (watchpoint.read ? "r" : "") << (watchpoint.write ? "w" : "")
+            << describe(watchpoint.condition) << std::endl;
+    }
+}
+
+void Debugger::help() const
+{
+    out << "c                           continue\n"
+           "s [n]                       run n instructions, ignoring breakpoints\n"
+           "back [n], forward [n]       move through the recording (-R)\n"
+           "b ADDR [if COND]            break before the instruction at ADDR\n"
+           "delete ADDR                 remove the breakpoint at ADDR\n"
+           "w FIRST[-LAST] [r|w|rw] [if COND]\n"
+           "                            stop before reading or writing (default) the words\n"
+           "unwatch ID                  remove a watchpoint\n"
+           "l                           list breakpoints and watchpoints\n"
+           "r                           show the PC and registers\n"
+           "x ADDR [n]                  show n words of memory\n"
+           "set rN VALUE                change a register\n"
+           "q                           stop the guest\n"
+           "COND is rN == V, rN != V, rN < V or rN > V; numbers may be 0x-prefixed hex"
+        << std::endl;
+}
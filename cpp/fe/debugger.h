@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+#include "vm.h"
+
+namespace Frontend
+{
+    // A small command prompt for breakpoints and watchpoints. It reads
+    // commands from in and writes the prompt and everything it shows to
+    // out, which should not be where the guest writes. Type h at the prompt
+    // for the commands.
+    class Debugger
+    {
+    public:
+        Debugger(Backend::VirtualMachine& vm, std::istream& in, std::ostream& out);
+
+        // Says why the guest stopped, if it did, and reads commands until
+        // one lets it continue. Returns false if the guest should not run
+        // any further.
+        bool prompt();
+
+    private:
+        // Returns false to leave the prompt; quit says whether the guest
+        // should stop for good.
+        bool execute(std::string const& line, bool& quit);
+
+        void show_stop() const;
+        void list() const;
+        void help() const;
+
+        Backend::VirtualMachine& vm;
+        std::istream& in;
+        std::ostream& out;
+    };
+}
@@ -1,51 +1,134 @@
 #include "file.h"
 
+#include "runner.h"
+#include "snapshot.h"
 #include "vm.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <cstdlib>
+#include <sstream>
 #include <stdexcept>
 
 using namespace Backend;
 using namespace Frontend;
 using std::uint16_t;
 
+namespace
+{
+    std::string contents_of_file(std::string const& filename)
+    {
+        std::ifstream ifile(filename, std::ifstream::binary);
+        if (!ifile)
+        {
+            throw std::runtime_error("Could not open " + filename);
+        }
+
+        std::ostringstream contents;
+        contents << ifile.rdbuf();
+        return contents.str();
+    }
+
+    bool is_snapshot(std::string const& filename)
+    {
+        char magic[sizeof(SnapshotMagic)] = {};
+        std::ifstream ifile(filename, std::ifstream::binary);
+        ifile.read(magic, sizeof(magic));
+        return ifile && std::equal(std::begin(magic), std::end(magic), std::begin(SnapshotMagic));
+    }
+}
+
 void Frontend::disassemble_file(std::string const& filename)
 {
-    auto code_points = code_points_from_file(filename);
+    // Snapshots are disassembled from the memory they hold.
+    std::unique_ptr<VirtualMachine> vm;
+    if (is_snapshot(filename))
+    {
+        vm.reset(new VirtualMachine(std::vector<uint16_t>{}));
+        vm->restore_snapshot(filename);
+    }
+    else
+    {
+        vm.reset(new VirtualMachine(ProgramImage(filename)));
+    }
+
+    auto disassembler = vm->disassembler();
+
+    std::ofstream listing(filename + ".sasm");
+    disassembler.write_listing(listing);
+    std::ofstream calls(filename + ".calls");
+    disassembler.write_call_graph(calls);
+    std::ofstream dot(filename + ".dot");
+    disassembler.write_call_graph_dot(dot);
 
-    VirtualMachine vm(code_points);
-    vm.disassemble_to_file(filename + ".sasm");
+    std::cout << "Disassembled " << filename << " to " << filename + ".sasm" << ", with its call graph in "
+        << filename + ".calls and " << filename + ".dot" << std::endl;
+}
+
+void Frontend::interpret_file(std::string const& filename, Arguments const& args)
+{
+    ProgramImage image(filename);
 
-    std::cout << "Disassembled " << filename << " to " << filename + ".sasm" << std::endl;
+    VirtualMachine vm(image);
+    if (args.share_image)
+    {
+        vm.share_memory(image);
+    }
+    run_vm(vm, args);
 }
 
-void Frontend::interpret_file(std::string const& filename)
+void Frontend::interpret_snapshot(std::string const& filename, Arguments const& args)
 {
-    auto code_points = code_points_from_file(filename);
-    
-    VirtualMachine vm(code_points);
-    vm.run();
+    VirtualMachine vm(std::vector<uint16_t>{});
+    // A snapshot deeper than the limit is refused rather than loaded.
+    vm.set_stack_limit(args.stack_limit);
+    vm.restore_snapshot(filename);
+    run_vm(vm, args);
 }
 
-std::vector<uint16_t> Frontend::code_points_from_file(std::string const& filename)
+void Frontend::interpret_batch(std::string const& filename, Arguments const& args)
 {
-    std::vector<uint16_t> code_points;
-    std::ifstream ifile(filename, std::ifstream::binary);
+    Runner runner(std::make_shared<ProgramImage const>(filename), args.threads);
+    runner.set_shared_memory(args.share_image);
+    runner.set_configure([&args](VirtualMachine& vm)
+    {
+        args.configure(vm);
 
-    uint16_t cp;
-    while (ifile)
+        // Every run has its own input and output, so nothing is shared.
+        vm.set_input_log_path("");
+        vm.set_snapshot_path("");
+    });
+
+    auto const& scripts = args.input_scripts;
+    std::vector<std::shared_ptr<StringIO>> ios;
+    std::vector<Runner::Job> jobs(scripts.size());
+    for (std::size_t i = 0; i < scripts.size(); ++i)
     {
-        // Assumption is that both input file and platform running this code
-        // are little-endian
-        ifile.read(reinterpret_cast<char*>(&cp), 2);
-        if (ifile.gcount() < 2)
+        ios.push_back(std::make_shared<StringIO>(contents_of_file(scripts[i])));
+        ios.back()->end_input();
+        jobs[i].io = ios.back();
+    }
+
+    auto results = runner.run(jobs);
+
+    for (std::size_t i = 0; i < scripts.size(); ++i)
+    {
+        std::ofstream file_out(scripts[i] + ".out", std::ofstream::binary);
+        file_out << ios[i]->output();
+
+        std::cout << scripts[i] << ": " << results[i].instructions << " instructions";
+        if (!results[i].error.empty())
         {
-            break;
+            std::cout << ", stopped by: " << results[i].error;
         }
-        code_points.push_back(cp);
+        std::cout << std::endl;
     }
 
-    return code_points;
+    std::cout << "Ran " << scripts.size() << " scripts on " << runner.threads() << " threads" << std::endl;
+}
+
+std::vector<uint16_t> Frontend::code_points_from_file(std::string const& filename)
+{
+    return ProgramImage(filename).words();
 }
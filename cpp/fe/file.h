@@ -2,10 +2,19 @@
 #include <vector>
 #include <cstdint>
 
+#include "args.h"
+
 namespace Frontend
 {
+    // Writes a listing of a program or snapshot to <filename>.sasm, and its
+    // call graph to <filename>.calls and, for Graphviz, <filename>.dot.
     void disassemble_file(std::string const& filename);
-    void interpret_file(std::string const& filename);
+    void interpret_file(std::string const& filename, Arguments const& args);
+    void interpret_snapshot(std::string const& filename, Arguments const& args);
+
+    // Runs the program once per input script, in parallel, and writes each
+    // run's output next to its script as <script>.out.
+    void interpret_batch(std::string const& filename, Arguments const& args);
     
     std::vector<std::uint16_t> code_points_from_file(std::string const& filename);
 }
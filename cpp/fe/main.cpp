@@ -15,16 +15,26 @@ int main(int argc, char *argv[])
         switch (args.type)
         {
             case Arguments::InputType::Code:
-                interpret_code_str(args.arg);
+                interpret_code_str(args.arg, args);
                 break;
             case Arguments::InputType::DisassembleFile:
                 disassemble_file(args.arg);
                 break;
             case Arguments::InputType::File:
-                interpret_file(args.arg);
+                interpret_file(args.arg, args);
+                break;
+            case Arguments::InputType::Snapshot:
+                interpret_snapshot(args.arg, args);
+                break;
+            case Arguments::InputType::Batch:
+                interpret_batch(args.arg, args);
                 break;
             default:
-                std::cout << "Specify -d, -c, or -f" << std::endl;
+                std::cout << "Specify -d, -c, -f or -r, optionally followed by -e classic|switch|jit|native, -V, "
+                    "-S depth, -B bytes, -l input_log, -w snapshot, -W line, -p, -M entries, -R entries, -F, -C, -D commands "
+                    "(such as /dev/tty) and -I address=intrinsic" << std::endl;
+                std::cout << "Or specify -b file followed by -i script for every input script, "
+                    "-j threads and any of the options above" << std::endl;
         }
     }
     catch (std::exception const& ex)
@@ -0,0 +1,258 @@
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "codestr.h"
+#include "io.h"
+#include "vm.h"
+
+using namespace Backend;
+using namespace Frontend;
+
+namespace
+{
+    struct EngineChoice
+    {
+        char const* name;
+        VirtualMachine::Engine engine;
+        bool verified;
+        bool fused;
+    };
+
+    // The first is the reference the others are checked against.
+    const EngineChoice Engines[] = {
+        { "switch", VirtualMachine::Engine::Switch, false, false },
+        { "classic", VirtualMachine::Engine::Classic, false, false },
+        { "classic-verified", VirtualMachine::Engine::Classic, true, false },
+        { "switch-verified", VirtualMachine::Engine::Switch, true, false },
+        { "switch-fused", VirtualMachine::Engine::Switch, true, true },
+#if defined(__x86_64__)
+        { "jit", VirtualMachine::Engine::Jit, false, false },
+#endif
+    };
+
+    // Each program runs its loop twice, and overwrites a word of it in
+    // between. Running the old code again prints something else.
+    struct SelfModifying
+    {
+        char const* name;
+        char const* code;
+        char const* output;
+        // The sequence the fused engine has to have run, if any.
+        bool fuses;
+        VirtualMachine::Fusion fusion;
+    };
+
+    const SelfModifying SelfModifyingPrograms[] = {
+        // 0: set r1 'a'; 3: out r1; 5: jt r0 16; 8: set r0 1;
+        // 11: wmem 2 'b'; 14: jmp 0; 16: out '\n'; 18: halt
+        { "decoded-set", "1,32769,97,19,32769,7,32768,16,1,32768,1,16,2,98,6,0,19,10,0",
+            "ab\n", false, VirtualMachine::Fusion::CompareBranch },
+        // 0: set r2 0; 3: eq r1 r0 1; 7: jt r1 23; 10: out 'a'; 12: jt r2 25;
+        // 15: set r2 1; 18: wmem 7 JF; 21: jmp 3; 23: out 'b'; 25: out '\n';
+        // 27: halt
+        { "compare-branch", "1,32770,0,4,32769,32768,1,7,32769,23,19,97,7,32770,25,"
+            "1,32770,1,16,7,8,6,3,19,98,19,10,0",
+            "ab\n", true, VirtualMachine::Fusion::CompareBranch },
+        // 0: set r1 0; 3: add r0 r1 26; 7: rmem r2 r0; 10: out r2;
+        // 12: jt r3 23; 15: set r3 1; 18: wmem 9 27; 21: jmp 3;
+        // 23: out '\n'; 25: halt; 26: 'x'; 27: 'y'
+        { "add-read", "1,32769,0,9,32768,32769,26,15,32770,32768,19,32770,7,32771,23,"
+            "1,32771,1,16,9,27,6,3,19,10,0,120,121",
+            "xy\n", true, VirtualMachine::Fusion::AddRead },
+        // 0: out 'a'; 2: out 'b'; 4: out 'c'; 6: jt r0 17; 9: set r0 1;
+        // 12: wmem 3 'd'; 15: jmp 0; 17: out '\n'; 19: halt
+        { "out-run", "19,97,19,98,19,99,7,32768,17,1,32768,1,16,3,100,6,0,19,10,0",
+            "abcadc\n", true, VirtualMachine::Fusion::OutRun },
+    };
+
+    // Reverses each line of input, keeping the line on the guest stack and
+    // its length in r2.
+    // 0: in r0; 2: eq r1 r0 '\n'; 6: jt r1 17; 9: push r0; 11: add r2 r2 1;
+    // 15: jmp 0; 17: jf r2 30; 20: pop r0; 22: out r0; 24: add r2 r2 -1;
+    // 28: jmp 17; 30: out '\n'; 32: jmp 0
+    const char* const Reverse = "20,32768,4,32769,32768,10,7,32769,17,2,32768,9,32770,32770,1,6,0,"
+        "8,32770,30,3,32768,19,32768,9,32770,32770,32767,6,17,19,10,6,0";
+
+    unsigned failures = 0;
+
+    void check(bool ok, std::string const& what)
+    {
+        if (!ok)
+        {
+            std::cerr << "FAIL: " << what << std::endl;
+            ++failures;
+        }
+    }
+
+    bool same_state(VirtualMachine::State const& a, VirtualMachine::State const& b)
+    {
+        return a.memory == b.memory && a.registers == b.registers && a.stack == b.stack &&
+            a.program_counter == b.program_counter && a.running == b.running;
+    }
+
+    struct Guest
+    {
+        Guest(std::string const& code, std::string const& input = std::string()) :
+            io(std::make_shared<StringIO>(input)),
+            vm(code_points_from_str(code), io)
+        {
+        }
+
+        std::shared_ptr<StringIO> io;
+        VirtualMachine vm;
+    };
+
+    std::string run_on(EngineChoice const& choice, std::string const& code, std::string const& input)
+    {
+        Guest guest(code, input);
+        guest.io->end_input();
+        guest.vm.set_engine(choice.engine);
+        guest.vm.set_verified_mode(choice.verified);
+        guest.vm.set_fusion(choice.fused);
+        guest.vm.run();
+        return guest.io->output();
+    }
+
+    // Fused sequences and decoded instructions have to be dropped when the
+    // guest writes over them.
+    void test_self_modifying()
+    {
+        for (auto const& program : SelfModifyingPrograms)
+        {
+            auto expected = run_on(Engines[0], program.code, std::string());
+            check(expected == program.output, std::string(program.name) + " on " + Engines[0].name +
+                    " printed \"" + expected + "\"");
+
+            for (auto const& choice : Engines)
+            {
+                auto output = run_on(choice, program.code, std::string());
+                check(output == expected, std::string(program.name) + " on " + choice.name +
+                        " printed \"" + output + "\"");
+            }
+
+            if (program.fuses)
+            {
+                Guest guest(program.code);
+                guest.vm.set_verified_mode(true);
+                guest.vm.set_fusion(true);
+                guest.vm.run();
+                check(guest.vm.fused_runs(program.fusion) > 0,
+                        std::string(program.name) + " never ran fused");
+            }
+        }
+
+        for (auto const& choice : Engines)
+        {
+            auto output = run_on(choice, Reverse, "stressed\nlevel\n");
+            check(output == "desserts\nlevel\n", std::string("reverse on ") + choice.name +
+                    " printed \"" + output + "\"");
+        }
+    }
+
+    // A guest stopped in the middle of a line carries on from a snapshot
+    // as if it had never stopped.
+    void test_snapshot()
+    {
+        const std::string path = "vmtest.snapshot";
+
+        Guest first(Reverse, "stre");
+        first.vm.set_engine(VirtualMachine::Engine::Switch);
+        first.vm.run();
+        check(first.vm.waiting_for_input(), "reverse did not wait for input");
+        first.vm.save_snapshot(path);
+
+        Guest second(Reverse, "ssed\n");
+        second.io->end_input();
+        second.vm.restore_snapshot(path);
+        check(same_state(second.vm.capture_state(), first.vm.capture_state()),
+                "the restored state differs from the saved one");
+        second.vm.run();
+        check(second.io->output() == "desserts\n", "the restored guest printed \"" +
+                second.io->output() + "\"");
+
+        // A snapshot that does not fit leaves the VM as it was.
+        std::ofstream(path, std::ios::app) << "x";
+        auto before = second.vm.capture_state();
+        auto threw = false;
+        try
+        {
+            second.vm.restore_snapshot(path);
+        }
+        catch (std::runtime_error const&)
+        {
+            threw = true;
+        }
+        check(threw, "a snapshot of the wrong size was restored");
+        check(same_state(second.vm.capture_state(), before), "a failed restore changed the VM");
+
+        std::remove(path.c_str());
+    }
+
+    // Stepping back through the record passes through every state the
+    // guest had, in reverse, and stepping forward again ends where it was.
+    void test_recorder(std::string const& name, std::string const& code, std::string const& input)
+    {
+        Guest stepped(code, input);
+        stepped.io->end_input();
+        std::vector<VirtualMachine::State> states(1, stepped.vm.capture_state());
+        while (stepped.vm.is_running())
+        {
+            stepped.vm.step_instruction();
+            states.push_back(stepped.vm.capture_state());
+        }
+
+        Guest recorded(code, input);
+        recorded.io->end_input();
+        recorded.vm.set_recording(1 << 16);
+        recorded.vm.run();
+        check(!recorded.vm.is_running(), name + " did not halt while recording");
+
+        auto steps = recorded.vm.undoable_steps();
+        check(steps + 1 == states.size(), name + " recorded " + std::to_string(steps) + " of " +
+                std::to_string(states.size() - 1) + " steps");
+        for (auto i = steps; i > 0; --i)
+        {
+            check(same_state(recorded.vm.capture_state(), states[i]),
+                    name + " differs before undoing step " + std::to_string(i));
+            recorded.vm.step_back();
+        }
+        check(same_state(recorded.vm.capture_state(), states[0]), name + " did not undo to the start");
+
+        check(recorded.vm.step_forward(steps) == steps, name + " did not redo every step");
+        check(same_state(recorded.vm.capture_state(), states.back()), name + " did not redo to the end");
+    }
+}
+
+int main()
+{
+    try
+    {
+        test_self_modifying();
+        test_snapshot();
+        for (auto const& program : SelfModifyingPrograms)
+        {
+            test_recorder(program.name, program.code, std::string());
+        }
+        test_recorder("reverse", Reverse, "stressed\nlevel\n");
+    }
+    catch (std::exception const& ex)
+    {
+        std::cerr << "Error: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    if (failures > 0)
+    {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
@@ -1,55 +1,128 @@
-#include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
-#include <unordered_map>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 using std::printf;
 using std::fflush;
+using std::uint16_t;
 
 namespace
 {
-    std::unordered_map<unsigned, unsigned> cache;   
+    const unsigned Modulus = 0x8000;
+    const unsigned Rows = 5;
+
+    // What the teleporter check has to return for a working R7.
+    const unsigned Wanted = 6;
+
+    // The guest's verification routine, for a given c:
+    //   ver(0, b) = b + 1
+    //   ver(a, 0) = ver(a - 1, c)
+    //   ver(a, b) = ver(a - 1, ver(a, b - 1))
+    // all modulo 0x8000. Row a of the table holds ver(a, b) for every b, and
+    // only depends on row a - 1, so the rows are filled in order without
+    // any recursion.
+    class VerTable
+    {
+    public:
+        VerTable() :
+            values(Rows * Modulus)
+        {
+            for (unsigned b = 0; b < Modulus; ++b)
+            {
+                values[b] = uint16_t((b + 1) % Modulus);
+            }
+        }
+
+        // Returns ver(4, 1) for c.
+        unsigned solve(unsigned c)
+        {
+            for (unsigned a = 1; a < Rows - 1; ++a)
+            {
+                auto previous = row(a - 1);
+                auto current = row(a);
+
+                current[0] = previous[c];
+                for (unsigned b = 1; b < Modulus; ++b)
+                {
+                    current[b] = previous[current[b - 1]];
+                }
+            }
+
+            // Only the first two entries of the last row are needed.
+            auto third = row(Rows - 2);
+            return third[third[c]];
+        }
+
+    private:
+        uint16_t* row(unsigned a)
+        {
+            return values.data() + a * Modulus;
+        }
+
+        std::vector<uint16_t> values;
+    };
 }
 
-unsigned ver(unsigned a, unsigned b, unsigned c)
+int main(int argc, char *argv[])
 {
-    if (a == 0)
+    auto threads = argc > 1 ? unsigned(std::atoi(argv[1])) : std::thread::hardware_concurrency();
+    if (threads == 0)
     {
-        return (b + 1) % 0x8000;
+        threads = 1;
     }
 
-    auto key = (a << 16) | b;
-    auto rec = cache.find(key);
-    if (rec != cache.end())
+    auto start = std::chrono::steady_clock::now();
+
+    // Workers take small chunks of the c range as they go, so they all
+    // finish at about the same time.
+    const unsigned Chunk = 64;
+    std::atomic<unsigned> next(0);
+    std::mutex solutions_lock;
+    std::vector<unsigned> solutions;
+
+    auto worker = [&]()
     {
-        return rec->second;
-    }
+        VerTable table;
+        for (auto first = next.fetch_add(Chunk); first < Modulus; first = next.fetch_add(Chunk))
+        {
+            for (auto c = first; c < first + Chunk && c < Modulus; ++c)
+            {
+                if (table.solve(c) == Wanted)
+                {
+                    std::lock_guard<std::mutex> hold(solutions_lock);
+                    solutions.push_back(c);
+                }
+            }
+        }
+    };
 
-    if (b == 0)
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; ++i)
+    {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers)
     {
-        return ver(a - 1, c, c);
+        thread.join();
     }
 
-    auto val = ver(a - 1, ver(a, b - 1, c), c);
-    cache[key] = val;
-    return val;
-}
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-int main(int argc, char *argv[])
-{
-    for (unsigned i = 0; i < 0x8000; ++i)
+    std::sort(solutions.begin(), solutions.end());
+    for (auto c : solutions)
     {
-        cache.clear();
-        printf("\rguessing ver(4, 1, %5d) = ", i);
-        fflush(stdout);
-        unsigned guess = ver(4, 1, i);
-        printf("%5d", guess);
-        if (guess == 6)
-        {
-            printf("\nFound solution!\n");
-            break;
-        }
+        printf("Found solution: ver(4, 1, %5u) = %u\n", c, Wanted);
     }
+    printf("Checked %u values of c on %u threads in %.2f s, found %zu solutions\n",
+            Modulus, threads, seconds, solutions.size());
+    fflush(stdout);
 
-    return 0;
+    return solutions.empty() ? 1 : 0;
 }
-